@@ -33,383 +33,16 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <stdbool.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <limits.h>
-#include <math.h>
 
 #include "common.h"
-
-/* TODO:a global - not good. Should be moved into cpu state or somewhere else */
-static uint64_t steplimit = LLONG_MAX;
-
-static inline Instr_t fetch(const cpu_t *pcpu) {
-    assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
-    return pcpu->pmem[pcpu->pc];
-};
-
-static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
-        printf("PC out of bounds\n");
-        pcpu->state = Cpu_Break;
-        return Instr_Break;
-    }
-    return fetch(pcpu);
-}
-
-static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
-    assert(pcpu);
-    decode_t result = {0};
-    result.opcode = raw_instr;
-    switch (raw_instr) {
-    case Instr_Nop:
-    case Instr_Halt:
-    case Instr_Print:
-    case Instr_Swap:
-    case Instr_Dup:
-    case Instr_Inc:
-    case Instr_Add:
-    case Instr_Sub:
-    case Instr_Mul:
-    case Instr_Rand:
-    case Instr_Dec:
-    case Instr_Drop:
-    case Instr_Over:
-    case Instr_Mod:
-    case Instr_And:
-    case Instr_Or:
-    case Instr_Xor:
-    case Instr_SHL:
-    case Instr_SHR:
-    case Instr_Rot:
-    case Instr_SQRT:
-    case Instr_Pick:
-        result.length = 1;
-        break;
-    case Instr_Push:
-    case Instr_JNE:
-    case Instr_JE:
-    case Instr_Jump:
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
-            result.length = 1;
-            result.opcode = Instr_Break;
-            break;
-        }
-        result.length = 2;
-        result.immediate = (int32_t)pcpu->pmem[pcpu->pc+1];
-        break;
-    case Instr_Break:
-    default: /* Undefined instructions equal to Break */
-        result.length = 1;
-        result.opcode = Instr_Break;
-        break;
-    }
-    return result;
-}
-
-static inline decode_t fetch_decode(cpu_t *pcpu) {
-    return decode(fetch_checked(pcpu), pcpu);
-}
-
-/*** Service routines ***/
-#define BAIL_ON_ERROR() if (pcpu->state != Cpu_Running) return;
-
-#define DISPATCH() service_routines[pdecoded->opcode](pcpu, pdecoded);
-
-#define ADVANCE_PC() do {\
-    pcpu->pc += pdecoded->length;\
-    pcpu->steps++; \
-    if (pcpu->state != Cpu_Running || pcpu->steps >= steplimit) return;\
-} while(0);
-
-static inline void push(cpu_t *pcpu, uint32_t v) {
-    assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
-        pcpu->state = Cpu_Break;
-        return;
-    }
-    pcpu->stack[++pcpu->sp] = v;
-}
-
-static inline uint32_t pop(cpu_t *pcpu) {
-    assert(pcpu);
-    if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp--];
-}
-
-static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
-    assert(pcpu);
-    if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp - pos];
-}
+#include "checkpoint.h"
+#include "output.h"
+#include "vm.h"
 
 typedef void (*service_routine_t)(cpu_t *pcpu, decode_t* pdecode);
-service_routine_t service_routines[];
-
-void sr_Nop(cpu_t *pcpu, decode_t *pdecoded) {
-    /* Do nothing */
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Halt(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->state = Cpu_Halted;
-    ADVANCE_PC();
-    return;
-}
-
-void sr_Push(cpu_t *pcpu, decode_t *pdecoded) {
-    push(pcpu, pdecoded->immediate);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Print(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    printf("[%d]\n", tmp1);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Swap(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Dup(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp1);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Over(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp2);
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Inc(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1+1);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Add(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 + tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Sub(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 - tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Mod(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp2 == 0) {
-        pcpu->state = Cpu_Break;
-        return;
-    }
-    push(pcpu, tmp1 % tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Mul(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 * tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Rand(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = rand();
-    push(pcpu, tmp1);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Dec(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1-1);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Drop(cpu_t *pcpu, decode_t *pdecoded) {
-    (void)pop(pcpu);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Je(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp1 == 0)
-        pcpu->pc += pdecoded->immediate;
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Jne(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp1 != 0)
-        pcpu->pc += pdecoded->immediate;
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Jump(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->pc += pdecoded->immediate;
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_And(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 & tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Or(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 | tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Xor(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 ^ tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_SHL(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 << tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_SHR(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 >> tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Rot(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    uint32_t tmp3 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp3);
-    push(pcpu, tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_SQRT(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, sqrt(tmp1));
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Pick(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, pick(pcpu, tmp1));
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Break(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->state = Cpu_Break;
-    ADVANCE_PC();
-    /* No need to dispatch after Break */
-    return;
-}
-
 
 extern void srv_Halt(cpu_t *pcpu, decode_t *pdecoded);
 extern void srv_Break(cpu_t *pcpu, decode_t *pdecoded);
@@ -425,19 +58,36 @@ extern void srv_Mod(cpu_t *pcpu, decode_t *pdecoded);
 extern void srv_Jump(cpu_t *pcpu, decode_t *pdecoded);
 extern void srv_Je(cpu_t *pcpu, decode_t *pdecoded);
 extern void srv_Print(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_Jne(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_Add(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_Mul(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_Rand(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_Dec(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_And(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_Or(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_Xor(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_SHL(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_SHR(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_SQRT(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_Rot(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_Pick(cpu_t *pcpu, decode_t *pdecoded);
+extern void srv_Stop(cpu_t *pcpu, decode_t *pdecoded);
 
 service_routine_t service_routines[] = {
         &srv_Break, &srv_Nop, &srv_Halt, &srv_Push, &srv_Print,
-        &sr_Jne, &srv_Swap, &srv_Dup, &srv_Je, &srv_Inc,
-        &sr_Add, &srv_Sub, &sr_Mul, &sr_Rand, &sr_Dec,
+        &srv_Jne, &srv_Swap, &srv_Dup, &srv_Je, &srv_Inc,
+        &srv_Add, &srv_Sub, &srv_Mul, &srv_Rand, &srv_Dec,
         &srv_Drop, &srv_Over, &srv_Mod, &srv_Jump,
-        &sr_And, &sr_Or, &sr_Xor,
-        &sr_SHL, &sr_SHR,
-        &sr_SQRT,
-        &sr_Rot,
-        &sr_Pick
+        &srv_And, &srv_Or, &srv_Xor,
+        &srv_SHL, &srv_SHR,
+        &srv_SQRT,
+        &srv_Rot,
+        &srv_Pick
     };
 
+/* The same routines assembled to count steps against the budget */
+extern service_routine_t counted_routines[];
+
 extern uint64_t cnt_VM_Push;
 extern uint64_t cnt_VM_Pop;
 
@@ -462,50 +112,221 @@ extern uint64_t cnt_Jump;
 
 extern uint64_t asm_main();
 
-extern uint64_t ret_steps;
-extern uint64_t ret_state;
-extern uint64_t ret_pc;
-extern uint64_t ret_sp;
-extern char * ret_err_ptr;
-extern uint32_t * ret_stack;
-
-
-int main(int argc, char **argv) {
-
-    steplimit = parse_args(argc, argv);
+extern _Thread_local uint64_t ret_steps;
+extern _Thread_local uint64_t ret_budget;
+extern _Thread_local uint64_t ret_state;
+extern _Thread_local uint64_t ret_pc;
+extern _Thread_local uint64_t ret_sp;
+extern _Thread_local uint64_t ret_top;
+extern _Thread_local uint64_t ret_subtop;
+extern _Thread_local const char *ret_err_ptr;
+
+/* The asm code keeps the VM stack in 64-bit slots [asm_stack_lo,
+   asm_stack_hi) and grows it down from asm_stack_hi. As %rsp points there,
+   the slack below asm_stack_lo takes the return address pushed when calling
+   the overflow handler and frames of signals delivered meanwhile, e.g.
+   SIGPROF of gprof. */
+#define ASM_STACK_SLACK ((64 << 10) / sizeof(uint64_t))
+
+extern _Thread_local uint64_t *asm_stack_lo;
+extern _Thread_local uint64_t *asm_stack_hi;
+
+struct vm {
+    cpu_t cpu;
+    Instr_t *prog;         /* The program and a zero word */
+    uint64_t *stack_buf;   /* VM stack of the asm code, with the slack */
+    size_t stack_capacity; /* in slots */
+    const char *err;       /* Left by the asm code, NULL if no run yet */
+    service_routine_t service_routines[sizeof(service_routines)
+                                       / sizeof(service_routines[0])];
+    volatile sig_atomic_t running;
+    volatile sig_atomic_t preempted;
+};
 
-    uint32_t stack[STACK_CAPACITY];
+/* The asm code works on thread-local variables, they belong to this
+   machine during vm_run() */
+static _Thread_local vm_t *active_vm;
 
-    asm_main(service_routines, DefProgram, Cpu_Running, steplimit);
+static uint64_t *asm_alloc_stack(size_t capacity) {
+    uint64_t *buf = malloc((capacity + ASM_STACK_SLACK) * sizeof(uint64_t));
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate memory for data stack.\n");
+        exit(2);
+    }
+    return buf;
+}
+
+static void asm_use_stack(vm_t *vm) {
+    asm_stack_lo = vm->stack_buf + ASM_STACK_SLACK;
+    asm_stack_hi = asm_stack_lo + vm->stack_capacity;
+}
+
+/* Called from the asm code, on the host stack, when the VM stack overflows.
+   Moves everything above vm_sp into a buffer twice as large and returns
+   the new location of vm_sp, or NULL if the stack may not grow. */
+uint64_t *asm_grow_stack(uint64_t *vm_sp) {
+    vm_t *vm = active_vm;
+    size_t capacity = vm->stack_capacity;
+    const size_t limit = vm->cpu.stack_limit;
+    if (capacity >= limit)
+        return NULL;
+    size_t used = asm_stack_hi - vm_sp;
+    uint64_t *old_buf = vm->stack_buf;
+    capacity *= 2;
+    if (capacity > limit)
+        capacity = limit;
+    vm->stack_buf = asm_alloc_stack(capacity);
+    vm->stack_capacity = capacity;
+    asm_use_stack(vm);
+    memcpy(asm_stack_hi - used, vm_sp, used * sizeof(uint64_t));
+    free(old_buf);
+    return asm_stack_hi - used;
+}
+
+/* Called from the asm code, on the host stack, for Rand */
+uint32_t asm_rand(void) {
+    return next_random(&active_vm->cpu.random);
+}
+
+/* The asm code caches the two topmost words of the VM stack in registers
+   and starts with two zero words below the program's data. So word i of
+   its stack, counting from the bottom, is stack[i - 2] of the cpu, and
+   ret_sp equals the number of words in the cpu stack. */
+static uint32_t asm_stack_word(const cpu_t *pcpu, int64_t i) {
+    return i < 2 ? 0 : pcpu->stack[i - 2];
+}
+
+static void load_asm_state(const cpu_t *pcpu) {
+    const int64_t n = pcpu->sp + 1;
+    for (int64_t i = 0; i < n; i++)
+        asm_stack_hi[-1 - i] = asm_stack_word(pcpu, i);
+    ret_subtop = asm_stack_word(pcpu, n);
+    ret_top = asm_stack_word(pcpu, n + 1);
+    ret_sp = n;
+    ret_pc = pcpu->pc;
+}
+
+static void save_asm_state(cpu_t *pcpu, int counted) {
+    const int64_t n = ret_sp;
+    while (pcpu->stack_capacity < n && grow_stack(pcpu))
+        ;
+    assert(pcpu->stack_capacity >= n);
+    for (int64_t i = 0; i < n; i++) {
+        const int64_t j = i + 2;
+        pcpu->stack[i] = j < n ? asm_stack_hi[-1 - j]
+                       : j == n ? ret_subtop : ret_top;
+    }
+    pcpu->sp = n - 1;
+    pcpu->pc = ret_pc;
+    /* The asm code counts the budget down instead of steps up, if at all */
+    if (counted)
+        pcpu->steps = pcpu->steplimit - ret_budget;
+    pcpu->state = ret_state;
+}
+
+/* The asm code names the reason it stopped for, the other variants
+   print these as diagnostics */
+static void report_asm_stop(const char *err) {
+    if (!strcmp(err, "stack underflow"))
+        print_message("Stack underflow\n");
+    else if (!strcmp(err, "stack overflow"))
+        print_message("Stack overflow\n");
+    else if (!strcmp(err, "out of bound picking"))
+        print_message("Out of bound picking\n");
+    else if (!strcmp(err, "PC out of bounds"))
+        print_message("PC out of bounds\n");
+}
+
+/* Preemption diverts every dispatch to srv_Stop */
+void vm_preempt(vm_t *vm) {
+    vm->preempted = 1;
+    if (!vm->running)
+        return;
+    for (size_t i = 0; i < sizeof(vm->service_routines) / sizeof(vm->service_routines[0]); i++)
+        vm->service_routines[i] = &srv_Stop;
+}
 
-    /* /\* decode_t decoded = fetch_decode(&cpu); *\/ */
-    /* /\* service_routines[decoded.opcode](&cpu, &decoded); *\/ */
+vm_t *vm_create(const Instr_t *program, uint32_t len, const options_t *opts) {
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (vm == NULL) {
+        fprintf(stderr, "Failed to allocate memory for virtual machine.\n");
+        exit(2);
+    }
+    /* The asm code reads the word after every instruction as its
+       immediate, a zero word past the end keeps that in bounds */
+    vm->prog = malloc((len + 1) * sizeof(Instr_t));
+    if (vm->prog == NULL) {
+        fprintf(stderr, "Failed to allocate memory for program.\n");
+        exit(2);
+    }
+    memcpy(vm->prog, program, len * sizeof(Instr_t));
+    vm->prog[len] = 0;
+    vm->cpu = init_cpu(vm->prog, len, opts);
+    vm->stack_capacity = vm->cpu.stack_capacity;
+    vm->stack_buf = asm_alloc_stack(vm->stack_capacity);
+    vm->err = NULL;
+    vm->running = 0;
+    vm->preempted = 0;
+    return vm;
+}
+
+cpu_state_t vm_run(vm_t *vm, uint64_t budget) {
+    const int counted = budget != UNLIMITED_STEPS;
+    cpu_t *pcpu = &vm->cpu;
+    pcpu->steplimit = run_steplimit(pcpu, budget);
+    memcpy(vm->service_routines, counted ? counted_routines : service_routines,
+           sizeof(service_routines));
+    vm->running = 1;
+    /* The asm code checks the limit only after an instruction */
+    if (!vm->preempted && pcpu->state == Cpu_Running
+        && pcpu->steps < pcpu->steplimit) {
+        active_vm = vm;
+        asm_use_stack(vm);
+        load_asm_state(pcpu);
+        ret_err_ptr = vm->err; /* Kept unless the asm code names a reason */
+        asm_main(vm->service_routines, pcpu->pmem, pcpu->state,
+                 pcpu->steplimit - pcpu->steps, pcpu->pmem_size);
+        save_asm_state(pcpu, counted);
+        vm->err = ret_err_ptr;
+        if (pcpu->state == Cpu_Break)
+            report_asm_stop(vm->err);
+        active_vm = NULL;
+    }
+    vm->running = 0;
+    if (pcpu->state != Cpu_Running)
+        flush_output(); /* All output of a finished guest is out */
+    vm->preempted = 0;
+    return pcpu->state;
+}
 
-    /* Print CPU state */
-    printf("CPU executed %ld steps. End state \"%s\".\n",
-            ret_steps, ret_state == Cpu_Halted? "Halted":
-                       ret_state == Cpu_Running? "Running": "Break");
+const cpu_t *vm_cpu(const vm_t *vm) {
+    return &vm->cpu;
+}
 
-    printf("PC = %lu, SP = %lu\n\n", ret_pc, ret_sp);
+int vm_restore(vm_t *vm, const cpu_t *state) {
+    if (!restore_cpu(&vm->cpu, state))
+        return 0;
+    /* load_asm_state() copies the whole cpu stack to the asm one */
+    if (vm->stack_capacity < (size_t)vm->cpu.stack_capacity) {
+        free(vm->stack_buf);
+        vm->stack_capacity = vm->cpu.stack_capacity;
+        vm->stack_buf = asm_alloc_stack(vm->stack_capacity);
+    }
+    return 1;
+}
 
-    printf("Errors: %s\n\n", ret_err_ptr);
+void vm_report(const vm_t *vm) {
+    printf("\nErrors: %s\n\n", vm->err ? vm->err : "no errors.");
 
     printf("Counters     :\n cnt_VM_Push : %20lu\n cnt_VM_Pop  : %20lu\n cnt_LPush   : %20lu\n cnt_LPop    : %20lu\n cnt_Print   : %20lu\n cnt_Je      : %20lu\n cnt_Mod     : %20lu\n cnt_Sub     : %20lu\n cnt_Over    : %20lu\n cnt_Swap    : %20lu\n cnt_Dup     : %20lu\n cnt_Drop    : %20lu\n cnt_Push    : %20lu\n cnt_Nop     : %20lu\n cnt_Halt    : %20lu\n cnt_Break   : %20lu\n cnt_Inc     : %20lu\n cnt_Jump    : %20lu\n",
            cnt_VM_Push, cnt_VM_Pop, cnt_LPush, cnt_LPop, cnt_Print, cnt_Je, cnt_Mod, cnt_Sub, cnt_Over, cnt_Swap, cnt_Dup, cnt_Drop, cnt_Push, cnt_Nop, cnt_Halt, cnt_Break, cnt_Inc, cnt_Jump);
-    printf("Stack (%ld): \n", ret_sp);
-    for (uint64_t i=0; i < ret_sp ; i++) {
-        printf("%2lu : %20lu : %20d\n",
-               i,
-               ((uintptr_t)(&ret_stack + (i))),
-               (*(uint32_t *)(&ret_stack + (i)))
-            );
-    }
-
-    free(LoadedProgram);
+}
 
-    return ret_state == Cpu_Halted ||
-           (ret_state == Cpu_Running &&
-            ret_steps == steplimit)?0:1;
+void vm_destroy(vm_t *vm) {
+    free(vm->stack_buf);
+    destroy_cpu(&vm->cpu);
+    free(vm->prog);
+    free(vm);
 }
 
 void fail(const char *message) {
@@ -0,0 +1,368 @@
+/*  batch.c - runs a batch of programs for a stack virtual machine on a
+    pool of worker threads.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* For sysconf() and clock_gettime() */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "vm.h"
+
+#define CACHE_LINE 64
+
+typedef struct {
+    const char *name; /* Program file, NULL for copies of one program */
+    const Instr_t *program;
+    uint32_t len;
+    /* The first job with the same program contents, and whether any other
+       job has them */
+    uint32_t first;
+    int repeated;
+    /* Filled in by the worker that ran it */
+    cpu_state_t state;
+    uint64_t steps;
+    uint32_t pc;
+    int32_t sp;
+    int worker;
+} job_t;
+
+/* Every worker starts with a contiguous range of jobs and takes them from
+   the bottom end. Idle workers steal from the top end of others' ranges.
+   Jobs are never added, so a range only shrinks and is a work-stealing
+   deque without a buffer. The thieves' end, the owner's end and private
+   state of every worker live on separate cache lines. */
+typedef struct {
+    _Alignas(CACHE_LINE) atomic_int_fast64_t top;
+    _Alignas(CACHE_LINE) atomic_int_fast64_t bottom;
+    uint32_t first; /* Index of the first job of the range */
+    _Alignas(CACHE_LINE) int id;
+    pthread_t thread;
+    /* One machine of every program that more jobs run, kept until the
+       worker is done so that the code of the program stays shared. Others
+       are destroyed when their job is. */
+    vm_t **anchors;
+    uint32_t *anchor_jobs; /* The first job of the program of each */
+    uint32_t nanchors;
+    uint32_t capacity;
+    /* Statistics */
+    uint64_t steps;
+    uint32_t jobs;
+    uint32_t stolen;
+} worker_t;
+
+static job_t *jobs;
+static worker_t *workers;
+static int nworkers;
+static uint64_t steplimit;
+
+/* Owner side: the last job of the range, -1 if it is empty */
+static int64_t take(worker_t *w) {
+    int64_t b = atomic_load_explicit(&w->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&w->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&w->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&w->bottom, b + 1, memory_order_relaxed);
+        return -1;
+    }
+    if (t == b) { /* The last job, thieves may want it too */
+        if (!atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1,
+                memory_order_seq_cst, memory_order_relaxed))
+            b = -1;
+        atomic_store_explicit(&w->bottom, t + 1, memory_order_relaxed);
+    }
+    return b < 0 ? -1 : w->first + b;
+}
+
+/* Thief side: the first job of the range, -1 if it is empty,
+   -2 if another worker took it first */
+static int64_t steal(worker_t *w) {
+    int64_t t = atomic_load_explicit(&w->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&w->bottom, memory_order_acquire);
+    if (t >= b)
+        return -1;
+    if (!atomic_compare_exchange_strong_explicit(&w->top, &t, t + 1,
+            memory_order_seq_cst, memory_order_relaxed))
+        return -2;
+    return w->first + t;
+}
+
+static int64_t find_job(worker_t *self) {
+    int64_t j = take(self);
+    if (j >= 0)
+        return j;
+    for (int k = 1; k < nworkers; k++) {
+        worker_t *victim = &workers[(self->id + k) % nworkers];
+        while ((j = steal(victim)) == -2)
+            ;
+        if (j >= 0) {
+            self->stolen++;
+            return j;
+        }
+    }
+    return -1; /* Ranges never grow, so there is nothing left */
+}
+
+static void run_job(worker_t *self, job_t *job) {
+    /* Job i draws from the generator seeded with --seed plus i, so copies
+       of a program differ */
+    options_t opts = Options;
+    opts.seed = Options.seed + (uint64_t)(job - jobs);
+    vm_t *vm = vm_create(job->program, job->len, &opts);
+    /* Run in slices to notice --timeout */
+    const cpu_t *pcpu = vm_cpu(vm);
+    while (!Preempted && pcpu->state == Cpu_Running
+           && pcpu->steps < steplimit) {
+        uint64_t budget = steplimit - pcpu->steps;
+        vm_run(vm, budget < Options.slice ? budget : Options.slice);
+    }
+    job->state = pcpu->state;
+    job->steps = pcpu->steps;
+    job->pc = pcpu->pc;
+    job->sp = pcpu->sp;
+    job->worker = self->id;
+    self->steps += pcpu->steps;
+    self->jobs++;
+
+    if (job->repeated) {
+        uint32_t i = 0;
+        while (i < self->nanchors && self->anchor_jobs[i] != job->first)
+            i++;
+        if (i == self->nanchors) {
+            if (self->nanchors == self->capacity) {
+                self->capacity = self->capacity ? 2 * self->capacity : 64;
+                self->anchors = realloc(self->anchors,
+                                        self->capacity * sizeof(vm_t *));
+                self->anchor_jobs = realloc(self->anchor_jobs,
+                                            self->capacity * sizeof(uint32_t));
+                if (!self->anchors || !self->anchor_jobs) {
+                    fprintf(stderr, "Failed to allocate memory for batch runner.\n");
+                    exit(2);
+                }
+            }
+            self->anchor_jobs[self->nanchors] = job->first;
+            self->anchors[self->nanchors++] = vm;
+            return;
+        }
+    }
+    vm_destroy(vm);
+}
+
+static void *worker_main(void *arg) {
+    worker_t *self = arg;
+    int64_t j;
+    while (!Preempted && (j = find_job(self)) >= 0)
+        run_job(self, &jobs[j]);
+    /* translated machines have to be destroyed by the thread they ran on */
+    for (uint32_t i = 0; i < self->nanchors; i++)
+        vm_destroy(self->anchors[i]);
+    free(self->anchors);
+    free(self->anchor_jobs);
+    return NULL;
+}
+
+/* One job per line of the list file, empty lines are skipped */
+static uint32_t read_batch_list(const char *list_file) {
+    FILE *list = fopen(list_file, "r");
+    if (list == NULL) {
+        fprintf(stderr, "Cannot open batch list file: %s\n", list_file);
+        exit(2);
+    }
+    uint32_t n = 0, capacity = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), list)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+            continue;
+        if (n == capacity) {
+            capacity = capacity ? 2 * capacity : 64;
+            jobs = realloc(jobs, capacity * sizeof(job_t));
+            if (!jobs) {
+                fprintf(stderr, "Failed to allocate memory for batch runner.\n");
+                exit(2);
+            }
+        }
+        jobs[n] = (job_t){.name = strdup(line)};
+        jobs[n].program = read_program(line, &jobs[n].len);
+        n++;
+    }
+    fclose(list);
+    return n;
+}
+
+/* Orders jobs by program contents */
+static int compare_programs(const job_t *x, const job_t *y) {
+    if (x->len != y->len)
+        return x->len < y->len ? -1 : 1;
+    if (x->program == y->program)
+        return 0;
+    return memcmp(x->program, y->program, x->len * sizeof(Instr_t));
+}
+
+/* Orders job indices by program contents, then by index */
+static int compare_jobs(const void *a, const void *b) {
+    const uint32_t i = *(const uint32_t *)a, j = *(const uint32_t *)b;
+    const int c = compare_programs(&jobs[i], &jobs[j]);
+    return c ? c : (i > j) - (i < j);
+}
+
+/* Finds the jobs that run the same program contents, so that workers keep
+   one machine of each such program rather than one of every job */
+static void group_jobs(uint32_t njobs) {
+    uint32_t *order = malloc(njobs * sizeof(uint32_t));
+    if (njobs && !order) {
+        fprintf(stderr, "Failed to allocate memory for batch runner.\n");
+        exit(2);
+    }
+    for (uint32_t i = 0; i < njobs; i++)
+        order[i] = i;
+    qsort(order, njobs, sizeof(uint32_t), compare_jobs);
+    for (uint32_t i = 0; i < njobs; ) {
+        uint32_t end = i + 1;
+        while (end < njobs
+               && !compare_programs(&jobs[order[i]], &jobs[order[end]]))
+            end++;
+        for (uint32_t k = i; k < end; k++) {
+            jobs[order[k]].first = order[i];
+            jobs[order[k]].repeated = end - i > 1;
+        }
+        i = end;
+    }
+    free(order);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static const char *state_name(cpu_state_t state) {
+    return state == Cpu_Halted? "Halted":
+           state == Cpu_Running? "Running": "Break";
+}
+
+/* Runs every program of --batch=<list file>, or --vms copies of the usual
+   program, on --threads workers. --steplimit applies to every machine,
+   --timeout to the whole batch. */
+int main(int argc, char **argv) {
+    steplimit = parse_args(argc, argv);
+    uint32_t njobs;
+    if (Options.batch_list) {
+        njobs = read_batch_list(Options.batch_list);
+    } else {
+        njobs = Options.vms;
+        jobs = calloc(njobs, sizeof(job_t));
+        if (!jobs) {
+            fprintf(stderr, "Failed to allocate memory for batch runner.\n");
+            exit(2);
+        }
+        for (uint32_t i = 0; i < njobs; i++) {
+            jobs[i].program = LoadedProgram ? LoadedProgram : DefProgram;
+            jobs[i].len = LoadedProgram ? LoadedProgramSize : DefProgramSize;
+        }
+    }
+
+    group_jobs(njobs);
+
+    nworkers = Options.threads ? (int)Options.threads
+                               : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nworkers < 1)
+        nworkers = 1;
+    workers = aligned_alloc(CACHE_LINE, nworkers * sizeof(worker_t));
+    if (!workers) {
+        fprintf(stderr, "Failed to allocate memory for batch runner.\n");
+        exit(2);
+    }
+    for (int w = 0; w < nworkers; w++) {
+        const uint32_t first = (uint64_t)njobs * w / nworkers;
+        const uint32_t end = (uint64_t)njobs * (w + 1) / nworkers;
+        memset(&workers[w], 0, sizeof(worker_t));
+        atomic_init(&workers[w].top, 0);
+        atomic_init(&workers[w].bottom, end - first);
+        workers[w].first = first;
+        workers[w].id = w;
+    }
+
+    arm_timeout(NULL, NULL);
+    const uint64_t start = now_ns();
+    for (int w = 0; w < nworkers; w++) {
+        errno = pthread_create(&workers[w].thread, NULL, worker_main,
+                               &workers[w]);
+        if (errno) {
+            perror("pthread_create");
+            exit(2);
+        }
+    }
+    for (int w = 0; w < nworkers; w++)
+        pthread_join(workers[w].thread, NULL);
+    const uint64_t elapsed = now_ns() - start;
+
+    uint64_t steps = 0;
+    uint32_t halted = 0, broken = 0, finished = 0;
+    for (uint32_t i = 0; i < njobs; i++) {
+        const job_t *job = &jobs[i];
+        if (job->name)
+            printf("%s: %s after %lu steps, PC = %#x, SP = %d\n", job->name,
+                   state_name(job->state), job->steps, job->pc, job->sp);
+        steps += job->steps;
+        halted += job->state == Cpu_Halted;
+        broken += job->state == Cpu_Break;
+        finished += job->state != Cpu_Running || job->steps == steplimit;
+    }
+    printf("Ran %u programs on %d threads: Halted %u, Break %u, Running %u.\n",
+           njobs, nworkers, halted, broken, njobs - halted - broken);
+    printf("Executed %lu steps in %.3f s, %.1f MIPS\n", steps, elapsed / 1e9,
+           elapsed ? steps / (elapsed / 1e3) : 0.0);
+    for (int w = 0; w < nworkers; w++)
+        printf("Thread %d: %u programs, %u stolen, %lu steps\n", w,
+               workers[w].jobs, workers[w].stolen, workers[w].steps);
+
+    for (uint32_t i = 0; i < njobs; i++) {
+        if (jobs[i].name) {
+            free((char *)jobs[i].name);
+            free_program((Instr_t *)jobs[i].program, jobs[i].len);
+        }
+    }
+    free(jobs);
+    free(workers);
+    free_program(LoadedProgram, LoadedProgramSize);
+
+    return finished == njobs && broken == 0 ? 0 : 1;
+}
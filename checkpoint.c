@@ -0,0 +1,207 @@
+/*  checkpoint.c - snapshots of virtual machine state that a run of any
+    variant can be resumed from
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "common.h"
+#include "checkpoint.h"
+
+/* writev() of everything, continuing after short writes */
+static int write_all(int fd, struct iovec *iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t done = writev(fd, iov, iovcnt);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        while (iovcnt > 0 && (size_t)done >= iov->iov_len) {
+            done -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + done;
+            iov->iov_len -= done;
+        }
+    }
+    return 0;
+}
+
+/* FNV-1a continued over more words */
+static uint64_t add_to_hash(uint64_t h, const uint32_t *words, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h ^= words[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static uint64_t checksum(const checkpoint_header_t *header,
+                         const uint32_t *stack) {
+    checkpoint_header_t h = *header;
+    h.checksum = 0;
+    uint32_t words[sizeof(h) / sizeof(uint32_t)];
+    memcpy(words, &h, sizeof(h));
+    return add_to_hash(add_to_hash(0xcbf29ce484222325ull, words,
+                                   sizeof(h) / sizeof(uint32_t)),
+                       stack, header->sp + 1);
+}
+
+/* Make a rename() to path durable by syncing the directory holding it */
+static int sync_dir(const char *path) {
+    const char *slash = strrchr(path, '/');
+    char *dir = slash == NULL ? strdup(".")
+              : strndup(path, slash == path ? 1 : (size_t)(slash - path));
+    if (dir == NULL)
+        return -1;
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    free(dir);
+    if (fd < 0)
+        return -1;
+    int ret = fsync(fd);
+    if (close(fd) && ret == 0)
+        ret = -1;
+    return ret;
+}
+
+int write_checkpoint(const cpu_t *pcpu, const char *path, int sync) {
+    checkpoint_header_t header = {
+        .magic = CHECKPOINT_MAGIC, .version = CHECKPOINT_VERSION,
+        .hash = hash_program(pcpu->pmem, pcpu->pmem_size),
+        .pmem_size = pcpu->pmem_size, .pc = pcpu->pc, .sp = pcpu->sp,
+        .state = pcpu->state, .steps = pcpu->steps,
+        .random = pcpu->random};
+    header.checksum = checksum(&header, pcpu->stack);
+    struct iovec iov[3] = {
+        {&header, sizeof(header)},
+        {(void *)pcpu->pmem, (size_t)pcpu->pmem_size * sizeof(Instr_t)},
+        {pcpu->stack, (size_t)(pcpu->sp + 1) * sizeof(uint32_t)}};
+
+    char *tmp_path = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmp_path == NULL)
+        return -1;
+    sprintf(tmp_path, "%s.tmp", path);
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        free(tmp_path);
+        return -1;
+    }
+    int ret = write_all(fd, iov, 3);
+    if (ret == 0 && sync)
+        ret = fsync(fd);
+    if (close(fd) && ret == 0)
+        ret = -1;
+    if (ret == 0)
+        ret = rename(tmp_path, path);
+    if (ret == 0) {
+        if (sync)
+            ret = sync_dir(path);
+    } else {
+        const int err = errno;
+        unlink(tmp_path);
+        errno = err;
+    }
+    free(tmp_path);
+    return ret;
+}
+
+static void read_exactly(FILE *f, void *buf, size_t size, const char *path) {
+    if (fread(buf, 1, size, f) != size) {
+        fprintf(stderr, "Truncated checkpoint: %s\n", path);
+        exit(2);
+    }
+}
+
+cpu_t read_checkpoint(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Cannot open checkpoint file: %s\n", path);
+        exit(2);
+    }
+    checkpoint_header_t header;
+    read_exactly(f, &header, sizeof(header), path);
+    if (header.magic != CHECKPOINT_MAGIC
+        || header.version != CHECKPOINT_VERSION
+        || header.sp < -1 || header.sp >= STACK_MAX_CAPACITY
+        || header.state > Cpu_Break) {
+        fprintf(stderr, "Not a valid checkpoint: %s\n", path);
+        exit(2);
+    }
+    const uint32_t words = header.sp + 1;
+    Instr_t *program = malloc(header.pmem_size ? header.pmem_size
+                                                 * sizeof(Instr_t) : 1);
+    uint32_t *stack = malloc(words ? words * sizeof(uint32_t) : 1);
+    if (program == NULL || stack == NULL) {
+        fprintf(stderr, "Failed to allocate memory for checkpoint.\n");
+        exit(2);
+    }
+    read_exactly(f, program, header.pmem_size * sizeof(Instr_t), path);
+    read_exactly(f, stack, words * sizeof(uint32_t), path);
+    if (fgetc(f) != EOF
+        || hash_program(program, header.pmem_size) != header.hash
+        || checksum(&header, stack) != header.checksum) {
+        fprintf(stderr, "Corrupted checkpoint: %s\n", path);
+        exit(2);
+    }
+    fclose(f);
+
+    cpu_t cpu = {.pc = header.pc, .sp = header.sp, .state = header.state,
+                 .steps = header.steps, .steplimit = header.steps,
+                 .stack = stack, .stack_capacity = words,
+                 .stack_limit = words,
+                 .pmem = program, .pmem_size = header.pmem_size,
+                 .random = header.random};
+    return cpu;
+}
+
+int restore_cpu(cpu_t *pcpu, const cpu_t *from) {
+    const int32_t words = from->sp + 1;
+    if (words > pcpu->stack_limit)
+        return 0;
+    while (pcpu->stack_capacity < words)
+        if (!grow_stack(pcpu))
+            return 0;
+    memcpy(pcpu->stack, from->stack, words * sizeof(uint32_t));
+    pcpu->pc = from->pc;
+    pcpu->sp = from->sp;
+    pcpu->state = from->state;
+    pcpu->steps = from->steps;
+    pcpu->random = from->random;
+    return 1;
+}
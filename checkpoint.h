@@ -0,0 +1,76 @@
+/*  checkpoint.h - snapshots of virtual machine state that a run of any
+    variant can be resumed from
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdint.h>
+
+#include "common.h"
+
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#define CHECKPOINT_MAGIC 0x4b434d56u /* "VMCK" */
+#define CHECKPOINT_VERSION 2
+
+/* A checkpoint file is this header, the program and the data stack from
+   the bottom up, all in host byte order. The hash is the key decoded and
+   translated code is shared by, so a machine restored in a process that
+   already runs the program starts with that code ready. The checksum
+   covers the rest of the header and the stack. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;      /* hash_program() of the program */
+    uint32_t pmem_size; /* Program words */
+    uint32_t pc;
+    int32_t sp;         /* Stack words minus one */
+    uint32_t state;
+    uint64_t steps;
+    uint64_t random;    /* State of the generator of Instr_Rand */
+    uint64_t checksum;
+} checkpoint_header_t;
+
+/* Write the program and state of a cpu to path.tmp and rename it over path,
+   so that readers see either the old or the new checkpoint, whole. With
+   sync the file is synced before and the directory after the rename, which
+   makes that hold across a crash of the system too, for some milliseconds.
+   Returns zero on success, -1 with errno set otherwise. */
+int write_checkpoint(const cpu_t *pcpu, const char *path, int sync);
+
+/* Read a checkpoint into a cpu with the program as pmem and exactly the
+   stack it needs. Both are allocated with malloc() and released by
+   free(), not destroy_cpu(). Exits the process on a malformed file, as
+   read_program() does. */
+cpu_t read_checkpoint(const char *path);
+
+/* Copy pc, stack, steps, generator and state of a run of the same program
+   into pcpu, growing its stack if needed. Returns zero if the stack does
+   not fit within the stack limit of pcpu. */
+int restore_cpu(cpu_t *pcpu, const cpu_t *from);
+
+#endif /* CHECKPOINT_H_ */
@@ -0,0 +1,242 @@
+/*  codearena.c - executable memory arena for binary translators
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef __x86_64__
+/* Stubs contain machine code, only specific platforms are supported */
+#error This program is designed to compile only on Intel64/AMD64 platform.
+#error Sorry.
+#endif
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "codearena.h"
+
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+#ifndef MAP_POPULATE
+#define MAP_POPULATE 0
+#endif
+
+/* Largest displacement still considered safe for a rel32 branch between
+   generated code and host code. Leaves room for the host .text itself. */
+#define NEAR_LIMIT (((intptr_t)1 << 31) - ((intptr_t)64 << 20))
+
+static bool is_near(const void *a, const void *b, size_t len) {
+    intptr_t lo = (intptr_t)a - (intptr_t)b;
+    intptr_t hi = lo + (intptr_t)len;
+    return lo > -NEAR_LIMIT && hi < NEAR_LIMIT;
+}
+
+/* Reserve an inaccessible range of len bytes. If near is not NULL, try to
+   find a place for it within rel32 reach of that address. */
+static char *reserve_range(size_t len, const void *near, bool *placed_near) {
+    const int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE;
+    *placed_near = false;
+    if (near) {
+        /* Probe candidate addresses below and then above the host code,
+           in steps of the reservation size */
+        const uintptr_t align = (uintptr_t)2 << 20;
+        uintptr_t base = (uintptr_t)near & ~(align - 1);
+        for (int dir = -1; dir <= 1; dir += 2) {
+            for (int k = 1; k <= 6; k++) {
+                uintptr_t hint = dir < 0 ? base - k * (uintptr_t)len
+                                         : base + k * (uintptr_t)len;
+                if (dir < 0 && hint > base) /* wrapped around zero */
+                    break;
+                void *p = mmap((void *)hint, len, PROT_NONE, flags, -1, 0);
+                if (p == MAP_FAILED)
+                    continue;
+                if (is_near(p, near, len)) {
+                    *placed_near = true;
+                    return p;
+                }
+                munmap(p, len);
+            }
+        }
+    }
+    void *p = mmap(NULL, len, PROT_NONE, flags, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        exit(2);
+    }
+    if (near)
+        *placed_near = is_near(p, near, len);
+    return p;
+}
+
+static void prefault(const char *p, size_t len) {
+    const long page = sysconf(_SC_PAGESIZE);
+    for (size_t off = 0; off < len; off += page)
+        (void)*(volatile const char *)(p + off);
+}
+
+/* Back [committed, new_size) of both views with memory */
+static void grow(code_arena_t *arena, size_t new_size) {
+    assert(new_size <= CODE_ARENA_RESERVE);
+    const size_t old = arena->committed;
+    const size_t delta = new_size - old;
+    const int populate = (arena->flags & Arena_Populate) ? MAP_POPULATE : 0;
+
+    if (arena->fd >= 0) {
+        if (ftruncate(arena->fd, new_size)) {
+            perror("ftruncate");
+            exit(2);
+        }
+        if (mmap(arena->rx + old, delta, PROT_READ | PROT_EXEC,
+                 MAP_SHARED | MAP_FIXED | populate, arena->fd, old) == MAP_FAILED
+         || mmap(arena->rw + old, delta, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_FIXED | populate, arena->fd, old) == MAP_FAILED) {
+            perror("mmap");
+            exit(2);
+        }
+    } else {
+        if (mprotect(arena->rx + old, delta,
+                     PROT_READ | PROT_WRITE | PROT_EXEC)) {
+            perror("mprotect");
+            exit(2);
+        }
+    }
+    /* Pre-populate resulting code buffer with INT3 (machine code 0xCC).
+       This will help to catch jumps to wrong locations */
+    memset(arena->rw + old, 0xcc, delta);
+    if (arena->flags & Arena_Prefault)
+        prefault(arena->rx + old, delta);
+    arena->committed = new_size;
+}
+
+void code_arena_init(code_arena_t *arena, size_t initial_size, int flags) {
+    assert(arena);
+    memset(arena, 0, sizeof(*arena));
+    arena->fd = -1;
+    arena->flags = flags;
+
+    /* Generated code calls service routines located in our own .text */
+    arena->rx = reserve_range(CODE_ARENA_RESERVE, (const void *)&code_arena_init,
+                              &arena->near_text);
+#ifdef MFD_CLOEXEC
+    if (flags & Arena_DualMap) {
+        arena->fd = memfd_create("jit-code", MFD_CLOEXEC);
+        if (arena->fd < 0)
+            perror("memfd_create"); /* Fall back to a single RWX view */
+    }
+#endif
+    if (arena->fd >= 0) {
+        bool unused;
+        arena->rw = reserve_range(CODE_ARENA_RESERVE, NULL, &unused);
+    } else {
+        arena->rw = arena->rx;
+        arena->flags &= ~Arena_DualMap;
+    }
+
+    arena->used = CODE_ARENA_MAX_STUBS * CODE_ARENA_STUB_SIZE;
+    size_t size = initial_size + arena->used;
+    size = (size + CODE_ARENA_CHUNK - 1) & ~(size_t)(CODE_ARENA_CHUNK - 1);
+    grow(arena, size);
+}
+
+void code_arena_destroy(code_arena_t *arena) {
+    assert(arena);
+    if (arena->rw != arena->rx)
+        munmap(arena->rw, CODE_ARENA_RESERVE);
+    munmap(arena->rx, CODE_ARENA_RESERVE);
+    if (arena->fd >= 0)
+        close(arena->fd);
+    arena->rw = arena->rx = NULL;
+    arena->fd = -1;
+}
+
+char *code_arena_reserve(code_arena_t *arena, size_t size) {
+    assert(arena);
+    if (arena->used + size > arena->committed) {
+        size_t new_size = arena->committed;
+        while (arena->used + size > new_size)
+            new_size *= 2;
+        if (new_size > CODE_ARENA_RESERVE)
+            new_size = CODE_ARENA_RESERVE;
+        if (arena->used + size > new_size) {
+            fprintf(stderr, "Generated code does not fit in %u bytes\n",
+                    CODE_ARENA_RESERVE);
+            exit(2);
+        }
+        grow(arena, new_size);
+    }
+    return arena->rw + arena->used;
+}
+
+void code_arena_commit(code_arena_t *arena, size_t size) {
+    assert(arena);
+    assert(arena->used + size <= arena->committed);
+    __builtin___clear_cache(arena->rx + arena->used,
+                            arena->rx + arena->used + size);
+    arena->used += size;
+}
+
+void code_arena_reset(code_arena_t *arena) {
+    assert(arena);
+    const size_t start = CODE_ARENA_MAX_STUBS * CODE_ARENA_STUB_SIZE;
+    memset(arena->rw + start, 0xcc, arena->used - start);
+    arena->used = start;
+}
+
+const void *code_arena_call_target(code_arena_t *arena, const void *target) {
+    assert(arena);
+    if (arena->near_text && is_near(arena->rx, target, CODE_ARENA_RESERVE))
+        return target;
+
+    for (int i = 0; i < arena->nstubs; i++)
+        if (arena->stub_target[i] == target)
+            return arena->stub_rx[i];
+
+    if (arena->nstubs == CODE_ARENA_MAX_STUBS) {
+        fprintf(stderr, "Too many far call targets in generated code\n");
+        exit(2);
+    }
+    /* MOVABS R11, imm64; JMP R11 */
+    const char stub_template_code[] = {0x49, 0xbb, 0, 0, 0, 0, 0, 0, 0, 0,
+                                       0x41, 0xff, 0xe3};
+    char *stub = arena->rw + arena->nstubs * CODE_ARENA_STUB_SIZE;
+    memcpy(stub, stub_template_code, sizeof(stub_template_code));
+    memcpy(stub + 2, &target, 8);
+    __builtin___clear_cache(code_arena_rx(arena, stub),
+                            code_arena_rx(arena, stub) + CODE_ARENA_STUB_SIZE);
+
+    arena->stub_target[arena->nstubs] = target;
+    arena->stub_rx[arena->nstubs] = code_arena_rx(arena, stub);
+    return arena->stub_rx[arena->nstubs++];
+}
@@ -0,0 +1,96 @@
+/*  codearena.h - executable memory arena for binary translators
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifndef CODEARENA_H_
+#define CODEARENA_H_
+
+/* Virtual address range reserved for generated code. The arena grows inside
+   it, so addresses of already emitted code never change. It must stay well
+   below 2 GiB for rel32 branches to reach from one end to the other. */
+#define CODE_ARENA_RESERVE (256u << 20)
+
+/* Granularity of arena growth */
+#define CODE_ARENA_CHUNK (64u << 10)
+
+/* Flags for code_arena_init() */
+enum {
+    Arena_DualMap  = 1 << 0, /* W^X: separate RW and RX views of one memfd */
+    Arena_Populate = 1 << 1, /* MAP_POPULATE every newly committed chunk */
+    Arena_Prefault = 1 << 2, /* touch every page of the RX view after growth */
+};
+
+/* Far-call stubs live at the very beginning of the arena and survive
+   code_arena_reset() */
+#define CODE_ARENA_MAX_STUBS 64
+#define CODE_ARENA_STUB_SIZE 16
+
+typedef struct {
+    char *rw;        /* Writable view of generated code */
+    char *rx;        /* Executable view of the same bytes */
+    size_t committed; /* Bytes backed by memory in both views */
+    size_t used;     /* Bytes handed out to the translator */
+    int fd;          /* memfd backing both views, -1 for a single RWX view */
+    int flags;
+    bool near_text;  /* rel32 from the arena reaches the host .text */
+    /* Far-call stubs, used when the arena could not be placed near .text */
+    int nstubs;
+    const void *stub_target[CODE_ARENA_MAX_STUBS];
+    char *stub_rx[CODE_ARENA_MAX_STUBS];
+} code_arena_t;
+
+/* Reserve address space and commit the first initial_size bytes.
+   Exits the program on failure, as other setup code does. */
+void code_arena_init(code_arena_t *arena, size_t initial_size, int flags);
+void code_arena_destroy(code_arena_t *arena);
+
+/* Make sure that at least size bytes are available past the current
+   allocation point; returns the RW address of that point */
+char *code_arena_reserve(code_arena_t *arena, size_t size);
+
+/* Advance the allocation point past size bytes written at
+   code_arena_reserve()'s result */
+void code_arena_commit(code_arena_t *arena, size_t size);
+
+/* Drop all generated code; committed memory is kept for reuse */
+void code_arena_reset(code_arena_t *arena);
+
+/* Executable address corresponding to a writable one */
+static inline char *code_arena_rx(const code_arena_t *arena, const char *rw) {
+    return arena->rx + (rw - arena->rw);
+}
+
+/* Return an address reachable with a rel32 CALL/JMP from anywhere inside the
+   arena which transfers control to target: either target itself or a
+   "MOVABS R11, target; JMP R11" stub emitted into the arena */
+const void *code_arena_call_target(code_arena_t *arena, const void *target);
+
+#endif /* CODEARENA_H_ */
@@ -26,14 +26,28 @@ CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
 OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
 OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+/* For POSIX timers */
+/* make STACK_GUARD=1 defines it too */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
 #include <errno.h>
 #include <string.h>
-#include <assert.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "common.h"
+#include "output.h"
+#include "container.h"
 
 /* Program to print all prime numbers < 10000 */
 const Instr_t Primes[PROGRAM_SIZE] = {
@@ -75,9 +89,11 @@ const Instr_t Primes[PROGRAM_SIZE] = {
 
 /* Choose a default program we are about to simulate */
 const Instr_t* DefProgram = Primes;
+const uint32_t DefProgramSize = PROGRAM_SIZE;
 
-/* Pointer to a loaded program */
+/* Pointer to a loaded program and its size in words */
 Instr_t* LoadedProgram = NULL;
+uint32_t LoadedProgramSize = 0;
 
 const Instr_t Instr_Rot_Test[PROGRAM_SIZE] = {
     Instr_Push, 1,
@@ -175,25 +191,400 @@ const Instr_t Factorial[PROGRAM_SIZE] = {
     Instr_Halt
 };
 
-cpu_t init_cpu () {
+#define DEFAULT_OPTIONS {.jit_cache_size = 0, .jit_evict = Jit_Evict_Flush, \
+                         .jit_stats = 0, .jit_thread = 0, \
+                         .decode_threads = 0, \
+                         .stack_size = STACK_CAPACITY, \
+                         .stack_grow = 0, .steplimit = UNLIMITED_STEPS, \
+                         .timeout_ms = 0, .vms = 1, .slice = 10000, \
+                         .threads = 0, .batch_list = NULL, \
+                         .socket_path = NULL, .requests = 1000, \
+                         .fork_server = 0, .has_input = 0, .input = 0, \
+                         .checkpoint_path = NULL, .checkpoint_sync = 0, \
+                         .restore_path = NULL, \
+                         .output = Output_Auto, .out_bin = NULL, \
+                         .seed = 0}
+
+options_t Options = DEFAULT_OPTIONS;
+const options_t DefOptions = DEFAULT_OPTIONS;
+
+#ifdef STACK_GUARD
+static size_t page_size;
+
+/* Address space behind the stack at its limit in whole pages, without the
+   guard pages. A growable stack reserves its maximum size up front, so it
+   never moves */
+static size_t stack_reserve(const cpu_t *pcpu) {
+    return ((size_t)pcpu->stack_limit * sizeof(uint32_t) + page_size - 1)
+           / page_size * page_size;
+}
+
+/* The capacity of at least n words whose end is at a page boundary */
+static int32_t capacity_to_page(const uint32_t *stack, int32_t n) {
+    const uintptr_t end = ((uintptr_t)(stack + n) + page_size - 1)
+                          / page_size * page_size;
+    return (end - (uintptr_t)stack) / sizeof(uint32_t);
+}
+
+/* Start of the mapping: the lower guard page */
+static char *stack_base(const cpu_t *pcpu) {
+    return (char *)(pcpu->stack + pcpu->stack_limit) - stack_reserve(pcpu)
+           - page_size;
+}
+
+/* Guard pages fence the reserved range on both sides. The upper one is
+   right after the stack at its limit, so overflow faults at exactly
+   stack_limit words; the slack to whole pages goes before the start, above
+   the lower one. */
+static uint32_t *alloc_stack(cpu_t *pcpu) {
+    page_size = sysconf(_SC_PAGESIZE);
+    const size_t len = stack_reserve(pcpu) + 2 * page_size;
+    char *base = mmap(NULL, len, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    uint32_t *stack = (uint32_t *)(base + page_size + stack_reserve(pcpu))
+                      - pcpu->stack_limit;
+    pcpu->stack_capacity = capacity_to_page(stack, pcpu->stack_capacity);
+    char *end = (char *)(stack + pcpu->stack_capacity);
+    if (mprotect(base + page_size, end - base - page_size,
+                 PROT_READ | PROT_WRITE)) {
+        munmap(base, len);
+        return NULL;
+    }
+    return stack;
+}
+
+static void free_stack(cpu_t *pcpu) {
+    if (pcpu->stack)
+        munmap(stack_base(pcpu), stack_reserve(pcpu) + 2 * page_size);
+}
+#else
+static uint32_t *alloc_stack(cpu_t *pcpu) {
+    return calloc(pcpu->stack_capacity, sizeof(uint32_t));
+}
+
+static void free_stack(cpu_t *pcpu) {
+    free(pcpu->stack);
+}
+#endif
+
+cpu_t init_cpu (const Instr_t *program, uint32_t len, const options_t *opts) {
+    if (opts == NULL)
+        opts = &DefOptions;
     cpu_t cpu = {.pc = 0, .sp = -1, .state = Cpu_Running,
-                 .steps = 0, .stack = {0},
-                 .pmem = LoadedProgram ? LoadedProgram : DefProgram};
+                 .steps = 0, .steplimit = 0,
+                 .stack = NULL,
+                 .stack_capacity = opts->stack_size,
+                 .stack_limit = opts->stack_grow ? STACK_MAX_CAPACITY
+                                                 : (int32_t)opts->stack_size,
+                 .pmem = program,
+                 .pmem_size = len,
+                 .random = seed_random(opts->seed)};
+    cpu.stack = alloc_stack(&cpu);
+    if (cpu.stack == NULL) {
+        fprintf(stderr, "Failed to allocate memory for data stack.\n");
+        exit(2);
+    }
+    if (opts->has_input)
+        cpu.stack[++cpu.sp] = opts->input;
     return cpu;
 }
 
+void destroy_cpu (cpu_t *pcpu) {
+    free_stack(pcpu);
+    pcpu->stack = NULL;
+    pcpu->stack_capacity = 0;
+}
+
+/* Slow path of push(): double the data stack if it may grow.
+   Returns zero when the stack cannot be enlarged */
+int grow_stack (cpu_t *pcpu) {
+    if (pcpu->stack_capacity >= pcpu->stack_limit)
+        return 0;
+    int32_t capacity = pcpu->stack_capacity * 2;
+    if (capacity > pcpu->stack_limit)
+        capacity = pcpu->stack_limit;
+#ifdef STACK_GUARD
+    /* Open up more of the reserved range, the stack stays in place */
+    capacity = capacity_to_page(pcpu->stack, capacity);
+    if (mprotect(pcpu->stack + pcpu->stack_capacity,
+                 (capacity - pcpu->stack_capacity) * sizeof(uint32_t),
+                 PROT_READ | PROT_WRITE))
+        return 0;
+#else
+    uint32_t *stack = realloc(pcpu->stack, capacity * sizeof(uint32_t));
+    if (stack == NULL)
+        return 0;
+    pcpu->stack = stack;
+#endif
+    pcpu->stack_capacity = capacity;
+    return 1;
+}
+
+#ifdef STACK_GUARD
+/* Faults are delivered to the thread that caused them */
+_Thread_local sigjmp_buf StackFaultEnv;
+static _Thread_local cpu_t *watched_cpu;
+
+static void stack_fault_handler(int sig, siginfo_t *info, void *context) {
+    (void)context;
+    cpu_t *pcpu = watched_cpu;
+    if (pcpu == NULL || pcpu->stack == NULL) {
+        signal(sig, SIG_DFL);
+        return;
+    }
+    const char *addr = info->si_addr;
+    const char *lo = stack_base(pcpu);
+    const char *hi = (const char *)(pcpu->stack + pcpu->stack_capacity);
+    const char *end = (const char *)(pcpu->stack + pcpu->stack_limit)
+                      + page_size;
+
+    if (addr >= lo && addr < lo + page_size) {
+        print_message("Stack underflow\n");
+        pcpu->sp = -1;
+        pcpu->state = Cpu_Break;
+        siglongjmp(StackFaultEnv, 1);
+    }
+    if (addr < hi || addr >= end) {
+        /* Not a stack access, let it crash as usual */
+        signal(sig, SIG_DFL);
+        return;
+    }
+    if (grow_stack(pcpu))
+        return; /* Retry the access */
+    print_message("Stack overflow\n");
+    pcpu->sp = pcpu->stack_capacity - 1;
+    pcpu->state = Cpu_Break;
+    siglongjmp(StackFaultEnv, 1);
+}
+
+void watch_stack (cpu_t *pcpu) {
+    static int installed = 0;
+    watched_cpu = pcpu;
+    if (installed)
+        return;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = stack_fault_handler;
+    /* Not blocked in the handler, so leaving it by siglongjmp() needs no
+       saved signal mask and STACK_FAULT_CAUGHT() no system call */
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGSEGV, &sa, NULL)) {
+        perror("sigaction");
+        exit(2);
+    }
+    installed = 1;
+}
+#endif
+
 static const char *steplimit_opt = "--steplimit=";
 static const char *inp_prog_opt = "--inp-prog=";
+static const char *jit_cache_opt = "--jit-cache=";
+static const char *jit_evict_opt = "--jit-evict=";
+static const char *jit_stats_opt = "--jit-stats";
+static const char *jit_thread_opt = "--jit-thread";
+static const char *decode_threads_opt = "--decode-threads=";
+static const char *stack_size_opt = "--stack-size=";
+static const char *stack_grow_opt = "--stack-grow";
+static const char *timeout_opt = "--timeout=";
+static const char *vms_opt = "--vms=";
+static const char *slice_opt = "--slice=";
+static const char *threads_opt = "--threads=";
+static const char *batch_opt = "--batch=";
+static const char *socket_opt = "--socket=";
+static const char *requests_opt = "--requests=";
+static const char *fork_opt = "--fork";
+static const char *input_opt = "--input=";
+static const char *seed_opt = "--seed=";
+static const char *checkpoint_opt = "--checkpoint=";
+static const char *checkpoint_sync_opt = "--checkpoint-sync";
+static const char *restore_opt = "--restore=";
+static const char *output_opt = "--output=";
+static const char *out_bin_opt = "--out-bin=";
 
 static inline
 void report_usage_and_exit(char * exec_name, int ret_code) {
-    fprintf(stderr, "Usage: %s %s<num> %s<str>\n", exec_name, steplimit_opt, inp_prog_opt);
+    fprintf(stderr, "Usage: %s %s<num> %s<ms> %s<str> %s<num> %s<num> "
+                    "%s{block|line}\n",
+            exec_name, steplimit_opt, timeout_opt, inp_prog_opt, input_opt,
+            seed_opt, output_opt);
+    fprintf(stderr, "JIT variants: %s<bytes> %s{flush|gen} %s %s\n",
+            jit_cache_opt, jit_evict_opt, jit_stats_opt, jit_thread_opt);
+    fprintf(stderr, "Decoding and JIT variants: %s<num>\n", decode_threads_opt);
+    fprintf(stderr, "Data stack: %s<words> %s\n", stack_size_opt, stack_grow_opt);
+    fprintf(stderr, "Checkpoints: %s<file> %s %s<file>\n",
+            checkpoint_opt, checkpoint_sync_opt, restore_opt);
+    fprintf(stderr, "Print to a binary file: %s<file>\n", out_bin_opt);
+    fprintf(stderr, "Many machines: %s<num> %s<steps> %s<num> %s<list file>\n",
+            vms_opt, slice_opt, threads_opt, batch_opt);
+    fprintf(stderr, "  machine i of them draws Rand from %s<num> plus i\n",
+            seed_opt);
+    fprintf(stderr, "Server and load generator: %s<path> %s %s<num>\n",
+            socket_opt, fork_opt, requests_opt);
     exit (ret_code);
 }
 
+static uint64_t program_words(uint64_t bytes) {
+    uint64_t words = (bytes + sizeof(Instr_t) - 1) / sizeof(Instr_t);
+    if (words > UINT32_MAX) {
+        fprintf(stderr, "Input program is too large.\n");
+        exit(2);
+    }
+    return words;
+}
+
+/* Anonymous memory of at least one word, zeroed */
+static Instr_t *alloc_program(uint64_t words) {
+    void *p = mmap(NULL, (words ? words : 1) * sizeof(Instr_t),
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate memory for input program.\n");
+        exit(2);
+    }
+    return p;
+}
+
+/* Pipes and other files without a size are read to their end */
+static Instr_t *read_stream(int fd, uint64_t *filelen) {
+    uint64_t capacity = 1 << 16, done_bytes = 0;
+    char *buf = malloc(capacity);
+    for (;;) {
+        if (buf == NULL) {
+            fprintf(stderr, "Failed to allocate memory for input program.\n");
+            exit(2);
+        }
+        const ssize_t done = read(fd, buf + done_bytes, capacity - done_bytes);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done < 0) {
+            perror("read");
+            exit(2);
+        }
+        if (done == 0)
+            break;
+        done_bytes += done;
+        if (done_bytes == capacity)
+            buf = realloc(buf, capacity *= 2);
+    }
+    Instr_t *program = alloc_program(program_words(done_bytes));
+    memcpy(program, buf, done_bytes);
+    free(buf);
+    /* As read-only as a mapped file */
+    if (mprotect(program, (done_bytes ? program_words(done_bytes) : 1)
+                          * sizeof(Instr_t), PROT_READ)) {
+        perror("mprotect");
+        exit(2);
+    }
+    *filelen = done_bytes;
+    return program;
+}
+
+/* Programs of read_program() that are still in use, with the number of
+   free_program() calls it takes to release each */
+typedef struct loaded_program {
+    const Instr_t *program;
+    int refs;
+    struct loaded_program *next;
+} loaded_program_t;
+
+static loaded_program_t *loaded_programs;
+static pthread_mutex_t loaded_programs_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void add_loaded_program(const Instr_t *program) {
+    loaded_program_t *lp = malloc(sizeof(loaded_program_t));
+    if (lp == NULL) {
+        fprintf(stderr, "Failed to allocate memory for input program.\n");
+        exit(2);
+    }
+    pthread_mutex_lock(&loaded_programs_lock);
+    *lp = (loaded_program_t){.program = program, .refs = 1,
+                             .next = loaded_programs};
+    loaded_programs = lp;
+    pthread_mutex_unlock(&loaded_programs_lock);
+}
+
+int retain_program(const Instr_t *program) {
+    if (program == DefProgram)
+        return 1;
+    int found = 0;
+    pthread_mutex_lock(&loaded_programs_lock);
+    for (loaded_program_t *lp = loaded_programs; lp; lp = lp->next) {
+        if (lp->program == program) {
+            lp->refs++;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&loaded_programs_lock);
+    return found;
+}
+
+Instr_t *read_program(const char *path, uint32_t *len) {
+    const int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        fprintf(stderr, "Cannot open target program file: %s\n", path);
+        exit(2);
+    }
+    Instr_t *program;
+    uint64_t filelen = st.st_size;
+    if (!S_ISREG(st.st_mode)) {
+        program = read_stream(fd, &filelen);
+    } else {
+        const uint64_t words = program_words(filelen);
+        program = words ? mmap(NULL, words * sizeof(Instr_t), PROT_READ,
+                               MAP_PRIVATE, fd, 0)
+                        : alloc_program(0);
+        if (program == MAP_FAILED) {
+            perror(path);
+            exit(2);
+        }
+    }
+    close(fd);
+    if (filelen >= sizeof(Instr_t) && program[0] == CONTAINER_MAGIC)
+        program = open_container(program, filelen, len, path);
+    else
+        *len = program_words(filelen);
+    add_loaded_program(program);
+    return program;
+}
+
+void free_program(Instr_t *program, uint32_t len) {
+    if (program == NULL || program == DefProgram)
+        return;
+    pthread_mutex_lock(&loaded_programs_lock);
+    for (loaded_program_t **link = &loaded_programs; *link;
+         link = &(*link)->next) {
+        loaded_program_t *lp = *link;
+        if (lp->program == program) {
+            if (--lp->refs) {
+                pthread_mutex_unlock(&loaded_programs_lock);
+                return;
+            }
+            *link = lp->next;
+            free(lp);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&loaded_programs_lock);
+    if (!release_container(program))
+        munmap(program, (len ? len : 1) * sizeof(Instr_t));
+}
+
+uint64_t hash_program(const Instr_t *program, uint32_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (uint32_t i = 0; i < len; i++) {
+        h ^= program[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
 uint64_t parse_args(int argc, char** argv) {
-    uint64_t steplimit = LLONG_MAX;
-    FILE *prog_file = NULL;
+    uint64_t steplimit = UNLIMITED_STEPS;
+    const char *prog_path = NULL;
 
     for (int i = 1; i < argc; ++i) {
         if (!strcmp(argv[i], "--help"))
@@ -205,12 +596,129 @@ uint64_t parse_args(int argc, char** argv) {
                 fprintf(stderr, "Invalid steplimit: %s\n", argv[i]);
                 report_usage_and_exit(argv[0], 2);
             }
-        } else if (!strncmp(argv[i], inp_prog_opt, strlen(inp_prog_opt))) {
-            prog_file = fopen(argv[i] + strlen(inp_prog_opt), "rb");
-            if (errno || prog_file == NULL) {
-                fprintf(stderr, "Cannot open target program file: %s\n", argv[i]);
+        } else if (!strncmp(argv[i], jit_cache_opt, strlen(jit_cache_opt))) {
+            char *endptr = NULL;
+            Options.jit_cache_size = strtoull(argv[i] + strlen(jit_cache_opt), &endptr, 10);
+            if (errno || (*endptr != '\0')) {
+                fprintf(stderr, "Invalid code cache size: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+        } else if (!strncmp(argv[i], jit_evict_opt, strlen(jit_evict_opt))) {
+            const char *policy = argv[i] + strlen(jit_evict_opt);
+            if (!strcmp(policy, "flush"))
+                Options.jit_evict = Jit_Evict_Flush;
+            else if (!strcmp(policy, "gen"))
+                Options.jit_evict = Jit_Evict_Generational;
+            else {
+                fprintf(stderr, "Unknown eviction policy: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+        } else if (!strncmp(argv[i], output_opt, strlen(output_opt))) {
+            const char *mode = argv[i] + strlen(output_opt);
+            if (!strcmp(mode, "block"))
+                Options.output = Output_Block;
+            else if (!strcmp(mode, "line"))
+                Options.output = Output_Line;
+            else {
+                fprintf(stderr, "Unknown output mode: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+        } else if (!strncmp(argv[i], out_bin_opt, strlen(out_bin_opt))) {
+            Options.out_bin = argv[i] + strlen(out_bin_opt);
+        } else if (!strcmp(argv[i], jit_stats_opt)) {
+            Options.jit_stats = 1;
+        } else if (!strcmp(argv[i], jit_thread_opt)) {
+            Options.jit_thread = 1;
+        } else if (!strncmp(argv[i], stack_size_opt, strlen(stack_size_opt))) {
+            char *endptr = NULL;
+            uint64_t size = strtoull(argv[i] + strlen(stack_size_opt), &endptr, 10);
+            if (errno || (*endptr != '\0') || size == 0
+                || size > STACK_MAX_CAPACITY) {
+                fprintf(stderr, "Invalid stack size: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            Options.stack_size = size;
+        } else if (!strcmp(argv[i], stack_grow_opt)) {
+            Options.stack_grow = 1;
+        } else if (!strncmp(argv[i], timeout_opt, strlen(timeout_opt))) {
+            char *endptr = NULL;
+            Options.timeout_ms = strtoull(argv[i] + strlen(timeout_opt), &endptr, 10);
+            if (errno || (*endptr != '\0')) {
+                fprintf(stderr, "Invalid timeout: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+        } else if (!strncmp(argv[i], vms_opt, strlen(vms_opt))) {
+            char *endptr = NULL;
+            uint64_t vms = strtoull(argv[i] + strlen(vms_opt), &endptr, 10);
+            if (errno || (*endptr != '\0') || vms == 0 || vms > UINT32_MAX) {
+                fprintf(stderr, "Invalid number of machines: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            Options.vms = vms;
+        } else if (!strncmp(argv[i], slice_opt, strlen(slice_opt))) {
+            char *endptr = NULL;
+            Options.slice = strtoull(argv[i] + strlen(slice_opt), &endptr, 10);
+            if (errno || (*endptr != '\0') || Options.slice == 0) {
+                fprintf(stderr, "Invalid time slice: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+        } else if (!strncmp(argv[i], threads_opt, strlen(threads_opt))) {
+            char *endptr = NULL;
+            uint64_t threads = strtoull(argv[i] + strlen(threads_opt), &endptr, 10);
+            if (errno || (*endptr != '\0') || threads > 4096) {
+                fprintf(stderr, "Invalid number of threads: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            Options.threads = threads;
+        } else if (!strncmp(argv[i], decode_threads_opt,
+                            strlen(decode_threads_opt))) {
+            char *endptr = NULL;
+            uint64_t threads = strtoull(argv[i] + strlen(decode_threads_opt),
+                                        &endptr, 10);
+            if (errno || (*endptr != '\0') || threads > 4096) {
+                fprintf(stderr, "Invalid number of threads: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            Options.decode_threads = threads;
+        } else if (!strncmp(argv[i], batch_opt, strlen(batch_opt))) {
+            Options.batch_list = argv[i] + strlen(batch_opt);
+        } else if (!strncmp(argv[i], socket_opt, strlen(socket_opt))) {
+            Options.socket_path = argv[i] + strlen(socket_opt);
+        } else if (!strncmp(argv[i], input_opt, strlen(input_opt))) {
+            char *endptr = NULL;
+            uint64_t input = strtoull(argv[i] + strlen(input_opt), &endptr, 0);
+            if (errno || (*endptr != '\0') || input > UINT32_MAX) {
+                fprintf(stderr, "Invalid input: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+            Options.has_input = 1;
+            Options.input = input;
+        } else if (!strncmp(argv[i], seed_opt, strlen(seed_opt))) {
+            char *endptr = NULL;
+            Options.seed = strtoull(argv[i] + strlen(seed_opt), &endptr, 0);
+            if (errno || (*endptr != '\0')) {
+                fprintf(stderr, "Invalid seed: %s\n", argv[i]);
+                report_usage_and_exit(argv[0], 2);
+            }
+        } else if (!strncmp(argv[i], checkpoint_opt, strlen(checkpoint_opt))) {
+            Options.checkpoint_path = argv[i] + strlen(checkpoint_opt);
+        } else if (!strcmp(argv[i], checkpoint_sync_opt)) {
+            Options.checkpoint_sync = 1;
+        } else if (!strncmp(argv[i], restore_opt, strlen(restore_opt))) {
+            Options.restore_path = argv[i] + strlen(restore_opt);
+        } else if (!strcmp(argv[i], fork_opt)) {
+            Options.fork_server = 1;
+        } else if (!strncmp(argv[i], requests_opt, strlen(requests_opt))) {
+            char *endptr = NULL;
+            uint64_t requests = strtoull(argv[i] + strlen(requests_opt), &endptr, 10);
+            if (errno || (*endptr != '\0') || requests == 0
+                || requests > UINT32_MAX) {
+                fprintf(stderr, "Invalid number of requests: %s\n", argv[i]);
                 report_usage_and_exit(argv[0], 2);
             }
+            Options.requests = requests;
+        } else if (!strncmp(argv[i], inp_prog_opt, strlen(inp_prog_opt))) {
+            prog_path = argv[i] + strlen(inp_prog_opt);
         } else {
             /* Handle positional arguments */
             /* For now, we only have steplimit */
@@ -223,28 +731,73 @@ uint64_t parse_args(int argc, char** argv) {
         }
     }
 
-    uint64_t filelen = 0;
-    if (prog_file != NULL) {
-        fseek(prog_file, 0, SEEK_END);  // Jump to the end of the file
-        filelen = ftell(prog_file);     // Get the current byte offset in the file
-        rewind(prog_file);              // Jump back to the beginning of the file
-        if (filelen > PROGRAM_SIZE * sizeof(Instr_t)) {
-            fprintf(stderr, "Input program size exceeds allocated memory.\n");
-            exit(2);
-        }
-        LoadedProgram = (Instr_t*) calloc(filelen, sizeof(Instr_t)); // Enough memory for file
-        if (LoadedProgram == NULL) {
-            fprintf(stderr, "Failed to allocate memory for input program.\n");
-            exit(2);
-        }
-        size_t act_read = fread(LoadedProgram, 1, filelen, prog_file); // Read in the entire file
-        assert(filelen == act_read);
-        fclose(prog_file);
+    if (prog_path != NULL && Options.restore_path != NULL) {
+        fprintf(stderr, "A checkpoint brings its own program, "
+                        "do not combine %s with %s\n", restore_opt, inp_prog_opt);
+        report_usage_and_exit(argv[0], 2);
     }
+    if (prog_path != NULL)
+        LoadedProgram = read_program(prog_path, &LoadedProgramSize);
 
+    set_output_mode(Options.output);
+    if (Options.out_bin)
+        set_output_file(Options.out_bin,
+                        LoadedProgram
+                        ? hash_program(LoadedProgram, LoadedProgramSize)
+                        : hash_program(DefProgram, DefProgramSize));
+    Options.steplimit = steplimit;
     return steplimit;
 }
 
+volatile sig_atomic_t Preempted = 0;
+static void (*preempt_hook)(void *);
+static void *preempt_arg;
+
+static void timeout_handler(int sig) {
+    (void)sig;
+    static const char msg[] = "Timeout\n";
+    if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0) {
+        /* Nothing to do about it in a signal handler */
+    }
+    Preempted = 1;
+    if (preempt_hook)
+        preempt_hook(preempt_arg);
+}
+
+void arm_timeout (void (*hook)(void *), void *arg) {
+    if (Options.timeout_ms == 0)
+        return;
+    preempt_hook = hook;
+    preempt_arg = arg;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = timeout_handler;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGALRM, &sa, NULL)) {
+        perror("sigaction");
+        exit(2);
+    }
+
+    timer_t timer;
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_SIGNAL;
+    sev.sigev_signo = SIGALRM;
+    if (timer_create(CLOCK_MONOTONIC, &sev, &timer)) {
+        perror("timer_create");
+        exit(2);
+    }
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = Options.timeout_ms / 1000;
+    its.it_value.tv_nsec = (Options.timeout_ms % 1000) * 1000000;
+    if (timer_settime(timer, 0, &its, NULL)) {
+        perror("timer_settime");
+        exit(2);
+    }
+}
+
 void write_program (Instr_t* program, size_t program_size, const char* out_file) {
     FILE *prog_file = fopen(out_file, "wb");
     if (errno || prog_file == NULL) {
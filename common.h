@@ -29,6 +29,7 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include <stdio.h>
 #include <stdint.h>
+#include <signal.h>
 
 #ifndef COMMON_H_
 #define COMMON_H_
@@ -78,14 +79,22 @@ typedef enum {
 
 typedef uint32_t Instr_t;
 
-/* The code for target program for an interpreter to simulate */
+/* Size of built-in programs. Programs loaded from files may be of any size */
 #define PROGRAM_SIZE 512
 
+/* The code for target program for an interpreter to simulate */
 extern const Instr_t* DefProgram;
+extern const uint32_t DefProgramSize;
 
 extern Instr_t* LoadedProgram;
+extern uint32_t LoadedProgramSize;
 
+/* Default capacity of the data stack, in words */
 #define STACK_CAPACITY 32
+
+/* The data stack never grows beyond this many words */
+#define STACK_MAX_CAPACITY (1 << 28)
+
 /* A struct to store information about a decoded instruction */
 typedef struct {
     Instr_t opcode; /* Used as an index in switch */
@@ -95,7 +104,8 @@ typedef struct {
     const void *sr; /* label to a service routine */
 } decode_t;
 
-/* Use up to 16 host bytes for one guest instruction in JIT variants */
+/* Initial size of generated code area in JIT variants, 16 host bytes for
+   one guest instruction. The area grows further on demand */
 #define JIT_CODE_SIZE (PROGRAM_SIZE * 16)
 
 /* Simulated processor state */
@@ -104,12 +114,144 @@ typedef struct {
     int32_t sp; /* Stack Pointer */
     cpu_state_t state;
     uint64_t steps; /* Statistics - total number of instructions */
-    uint32_t stack[STACK_CAPACITY]; /* Data Stack */
+    uint64_t steplimit; /* Stop when steps reach it, lowered on preemption */
+    uint32_t *stack; /* Data Stack */
+    int32_t stack_capacity; /* Data Stack size in words */
+    int32_t stack_limit; /* Data Stack may grow up to this many words */
     const Instr_t *pmem; /* Program Memory */
+    uint32_t pmem_size; /* Program Memory size in words */
+    uint64_t random; /* State of the generator of Instr_Rand */
 } cpu_t;
 
-cpu_t init_cpu ();
+/* Eviction policies for the generated code cache of JIT variants */
+typedef enum {
+    Jit_Evict_Flush = 0,     /* Drop all code when the budget is exhausted */
+    Jit_Evict_Generational   /* Keep hot blocks in a separate generation */
+} jit_evict_t;
+
+/* How Print output reaches stdout, see output.h */
+typedef enum {
+    Output_Auto = 0, /* Line if stdout is a terminal, block otherwise */
+    Output_Block,    /* Queued and written in large blocks */
+    Output_Line      /* Written by every Print as it runs */
+} output_mode_t;
+
+/* Run-time options set by parse_args(). Not every engine uses all of them */
+typedef struct {
+    uint64_t jit_cache_size; /* Budget for generated code in bytes,
+                                zero means unlimited */
+    jit_evict_t jit_evict;
+    int jit_stats;           /* Report code cache counters on exit */
+    int jit_thread;          /* Translate hot code on a background thread
+                                and interpret the rest */
+    uint32_t decode_threads; /* Threads decoding a program before it runs,
+                                or translating all of it; zero to decode
+                                and translate lazily */
+    uint32_t stack_size;     /* Initial data stack capacity in words */
+    int stack_grow;          /* Enlarge the data stack instead of overflowing */
+    uint64_t steplimit;      /* Steps of the whole run, UNLIMITED_STEPS
+                                if not counted */
+    uint64_t timeout_ms;     /* Wall clock limit, zero means none */
+    uint32_t vms;            /* Copies of the program run by the scheduler
+                                or the batch runner */
+    uint64_t slice;          /* Steps a machine runs at a time */
+    uint32_t threads;        /* Workers of the batch runner, zero for one
+                                per online CPU */
+    const char *batch_list;  /* File listing programs to run in a batch */
+    const char *socket_path; /* Unix socket of the server, NULL for stdin */
+    uint32_t requests;       /* Requests sent by the load generator */
+    int fork_server;         /* Serve every request in a child process */
+    int has_input;           /* Push input onto the data stack at start */
+    uint32_t input;          /* The lanes engine gives input + i to
+                                instance i */
+    const char *checkpoint_path; /* Where to save the state at the end */
+    int checkpoint_sync;         /* fsync() it to survive a system crash */
+    const char *restore_path;    /* Checkpoint to resume from */
+    output_mode_t output;
+    const char *out_bin;     /* Binary file for values of Print, if any */
+    uint64_t seed;           /* Of the generator of Instr_Rand */
+} options_t;
+
+extern options_t Options;
+extern const options_t DefOptions;
+
+/* Options may be NULL for defaults */
+cpu_t init_cpu (const Instr_t *program, uint32_t len, const options_t *opts);
+void destroy_cpu (cpu_t *pcpu);
+int grow_stack (cpu_t *pcpu);
+
+/* Preemption. arm_timeout() starts the --timeout timer, if one was requested.
+   When it expires, Preempted is set and hook is called with arg from the
+   signal handler, normally to vm_preempt() the running machine. */
+extern volatile sig_atomic_t Preempted;
+void arm_timeout (void (*hook)(void *), void *arg);
+
+/* Budget of a run without a step limit, the default of --steplimit. Such
+   a run does not count steps, they keep their value, and checks for
+   preemption only where control may go back, see vm_run() in vm.h */
+#define UNLIMITED_STEPS UINT64_MAX
+
+/* Step limit for a run of budget more steps, saturated */
+static inline uint64_t run_steplimit(const cpu_t *pcpu, uint64_t budget) {
+    return budget > UINT64_MAX - pcpu->steps ? UINT64_MAX
+                                             : pcpu->steps + budget;
+}
+
+/* Instr_Rand draws from a PCG32 generator of its own machine, so machines
+   on different threads neither contend nor disturb each other's sequence.
+   The same --seed gives the same values in every variant. */
+#define RANDOM_MULTIPLIER 6364136223846793005ull
+#define RANDOM_INCREMENT 1442695040888963407ull
+
+static inline uint64_t seed_random(uint64_t seed) {
+    return (RANDOM_INCREMENT + seed) * RANDOM_MULTIPLIER + RANDOM_INCREMENT;
+}
+
+/* Advance the state, returns a word of it */
+static inline uint32_t next_random(uint64_t *state) {
+    const uint64_t old = *state;
+    *state = old * RANDOM_MULTIPLIER + RANDOM_INCREMENT;
+    const uint32_t xorshifted = ((old >> 18) ^ old) >> 27;
+    const uint32_t rot = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << (-rot & 31));
+}
+
+/* Step limit as seen by loops that do not call out of line code, read from
+   memory every time because the timer may lower it asynchronously. Runs
+   without counting compare steps to it too: preemption drops it to zero */
+#define STEPLIMIT(pcpu) (*(volatile const uint64_t *)&(pcpu)->steplimit)
+
+#ifdef STACK_GUARD
+/* The data stack lies between inaccessible guard pages, and push() does not
+   check bounds. A fault there of the watched cpu prints the usual diagnostic,
+   sets Cpu_Break and returns to STACK_FAULT_CAUGHT() with a nonzero value and
+   pc and steps of the faulting instruction. The stack ends at the upper page
+   but need not start at the lower one, so pop() still checks for underflow */
+#include <setjmp.h>
+
+extern _Thread_local sigjmp_buf StackFaultEnv;
+void watch_stack (cpu_t *pcpu);
+#define STACK_FAULT_CAUGHT() sigsetjmp(StackFaultEnv, 0)
+/* Keeps pc and steps of the current instruction in memory for the handler */
+#define STACK_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+#define watch_stack(pcpu) ((void)(pcpu))
+#define STACK_FAULT_CAUGHT() 0
+#define STACK_BARRIER() ((void)0)
+#endif
 uint64_t parse_args(int argc, char** argv);
+/* Map a raw program file read-only, or read it if it cannot be mapped,
+   such as a pipe. A trailing incomplete word is padded with zeroes. For a
+   container of container.h, returns its code section. Exits the process
+   on errors. Released by free_program() */
+Instr_t *read_program (const char *path, uint32_t *len);
+void free_program (Instr_t *program, uint32_t len);
+/* Keep a program of read_program(), which is read-only, alive until one
+   more free_program() of it, or the built-in one for good. Returns zero,
+   taking no reference, for any other program */
+int retain_program (const Instr_t *program);
+/* FNV-1a over the words of a program */
+uint64_t hash_program (const Instr_t *program, uint32_t len);
 void write_program (Instr_t* program, size_t program_size, const char* out_file);
 
 #endif /* COMMON_H_ */
@@ -0,0 +1,166 @@
+/*  compact.h - variable-length encoding of programs for a stack virtual
+    machine
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdint.h>
+
+#include "common.h"
+
+#ifndef COMPACT_H_
+#define COMPACT_H_
+
+/* Compact code takes a byte per opcode instead of a word, so that more of
+   a large program fits in caches:
+   - Instructions without an immediate are their opcode.
+   - Push, JNE, JE and Jump are their opcode followed by the immediate in
+     signed LEB128, 1 to 5 bytes.
+   - COMPACT_NEAR + JNE, JE or Jump is followed by a signed byte.
+   - Bytes from COMPACT_SMALL_PUSH up push themselves minus
+     COMPACT_PUSH_BIAS, that is -16 to 111.
+   Branch displacements count bytes from the next instruction and always
+   lead to the start of an instruction or to the end of the code. Other
+   bytes are undefined instructions and equal to Break. */
+#define COMPACT_NEAR 0x20
+#define COMPACT_SMALL_PUSH 0x80
+#define COMPACT_PUSH_BIAS 0x90
+
+/* Longest encoding of an instruction */
+#define COMPACT_MAX_LENGTH 6
+
+/* Compact code and maps between its PCs and those of the same program as
+   words, used when a run starts and ends. A container with compact code
+   is decoded into words when loaded, see container.h. */
+typedef struct {
+    const uint8_t *code;
+    uint32_t size;            /* Bytes */
+    uint32_t len;             /* Words of the same program */
+    const uint32_t *word_pc;  /* For size + 1 byte PCs, the PC of the word
+                                 instruction, UINT32_MAX inside one */
+    const uint32_t *byte_pc;  /* For len + 1 word PCs, the byte PC,
+                                 UINT32_MAX inside an instruction */
+} compact_t;
+
+/* Opcodes followed by an immediate in signed LEB128 */
+#define COMPACT_LONG ((1u << Instr_Push) | (1u << Instr_JNE) \
+                      | (1u << Instr_JE) | (1u << Instr_Jump))
+
+/* Decode the instruction at pc, which must be inside the code. length is
+   in bytes. The code is checked to end with a whole instruction when it
+   is loaded, so immediates are read without bound checks. */
+static inline decode_t decode_compact(const compact_t *c, uint32_t pc) {
+    const uint8_t *p = c->code + pc;
+    decode_t result = {.opcode = p[0], .length = 1};
+    switch (p[0]) {
+    case Instr_Push:
+    case Instr_JNE:
+    case Instr_JE:
+    case Instr_Jump: {
+        uint32_t value = 0;
+        int shift = 0;
+        uint8_t byte;
+        do {
+            byte = p[result.length++];
+            value |= (uint32_t)(byte & 0x7f) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+        if (shift < 32 && (byte & 0x40))
+            value |= ~0u << shift; /* Sign extension */
+        result.immediate = (int32_t)value;
+        break;
+    }
+    case COMPACT_NEAR + Instr_JNE:
+    case COMPACT_NEAR + Instr_JE:
+    case COMPACT_NEAR + Instr_Jump:
+        result.opcode = p[0] - COMPACT_NEAR;
+        result.length = 2;
+        result.immediate = (int8_t)p[1];
+        break;
+    case COMPACT_SMALL_PUSH ... 0xff:
+        result.opcode = Instr_Push;
+        result.immediate = (int32_t)p[0] - COMPACT_PUSH_BIAS;
+        break;
+    case Instr_Break:
+    case Instr_Nop:
+    case Instr_Halt:
+    case Instr_Print:
+    case Instr_Swap:
+    case Instr_Dup:
+    case Instr_Inc:
+    case Instr_Add:
+    case Instr_Sub:
+    case Instr_Mul:
+    case Instr_Rand:
+    case Instr_Dec:
+    case Instr_Drop:
+    case Instr_Over:
+    case Instr_Mod:
+    case Instr_And:
+    case Instr_Or:
+    case Instr_Xor:
+    case Instr_SHL:
+    case Instr_SHR:
+    case Instr_Rot:
+    case Instr_SQRT:
+    case Instr_Pick:
+        break;
+    default: /* Undefined instructions equal to Break */
+        result.opcode = Instr_Break;
+        break;
+    }
+    return result;
+}
+
+/* Byte PC of a word PC, UINT32_MAX if there is none */
+static inline uint32_t to_byte_pc(const compact_t *c, uint32_t pc) {
+    return pc <= c->len ? c->byte_pc[pc] : UINT32_MAX;
+}
+
+/* Word PC of the start of an instruction. PCs past the end, where a
+   Break leaves them, keep their distance from it. */
+static inline uint32_t to_word_pc(const compact_t *c, uint32_t pc) {
+    return pc <= c->size ? c->word_pc[pc] : c->len + (pc - c->size);
+}
+
+/* Switch pcpu to the byte PC for a run of compact code c. Returns c, or
+   NULL when c is NULL or the PC is not at an instruction of it, so that
+   the run is to execute words. */
+static inline const compact_t *enter_compact(const compact_t *c,
+                                             cpu_t *pcpu) {
+    if (c == NULL || to_byte_pc(c, pcpu->pc) == UINT32_MAX)
+        return NULL;
+    pcpu->pc = to_byte_pc(c, pcpu->pc);
+    return c;
+}
+
+/* Back to the word PC after a run that enter_compact() started */
+static inline void leave_compact(const compact_t *c, cpu_t *pcpu) {
+    if (c)
+        pcpu->pc = to_word_pc(c, pcpu->pc);
+}
+
+#endif /* COMPACT_H_ */
@@ -0,0 +1,336 @@
+/*  container.c - program files with precomputed analysis for a stack
+    virtual machine
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* make STACK_GUARD=1 defines it too */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "common.h"
+#include "container.h"
+
+typedef struct container {
+    void *base;
+    size_t size;
+    const Instr_t *code;
+    program_info_t info;
+    compact_t compact;
+    Instr_t *words;          /* Decoded from compact code, and its maps */
+    uint32_t *word_pc;
+    uint32_t *byte_pc;
+    struct container *next;
+} container_t;
+
+static container_t *containers;
+static pthread_mutex_t containers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a continued over more words */
+static uint64_t add_to_hash(uint64_t h, const uint32_t *words, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        h ^= words[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static void invalid(const char *path) {
+    fprintf(stderr, "Not a valid program container: %s\n", path);
+    exit(2);
+}
+
+/* PCs a section lists must be inside the program */
+static void check_pcs(const uint32_t *pcs, uint32_t n, uint32_t len,
+                      const char *path) {
+    for (uint32_t i = 0; i < n; i++)
+        if (pcs[i] >= len)
+            invalid(path);
+}
+
+static void *alloc_or_exit(size_t n) {
+    void *p = malloc(n ? n : 1);
+    if (p == NULL) {
+        fprintf(stderr, "Failed to allocate memory for input program.\n");
+        exit(2);
+    }
+    return p;
+}
+
+/* Of a decoded instruction, so opcode is at most Instr_Pick */
+static bool has_immediate(Instr_t opcode) {
+    return (COMPACT_LONG >> opcode) & 1;
+}
+
+/* Bytes of the instruction at b of compact code, zero if it does not end
+   before size or its immediate is too long */
+static uint32_t compact_length(const compact_t *compact, uint32_t b) {
+    const uint8_t op = compact->code[b];
+    uint32_t length = 1;
+    if (op == COMPACT_NEAR + Instr_JNE || op == COMPACT_NEAR + Instr_JE
+        || op == COMPACT_NEAR + Instr_Jump) {
+        length = 2;
+    } else if (op < COMPACT_NEAR && ((COMPACT_LONG >> op) & 1)) {
+        do {
+            if (b + length >= compact->size || length == COMPACT_MAX_LENGTH)
+                return 0;
+        } while (compact->code[b + length++] & 0x80);
+    }
+    return b + length <= compact->size ? length : 0;
+}
+
+/* Decode the compact code of a section into words of c. Instructions
+   must be whole and branches lead to the start of one or to the end. */
+static void expand_compact(container_t *c, const uint32_t *section,
+                           uint32_t count, const char *path) {
+    if (count == 0 || section[0] > (uint64_t)(count - 1) * sizeof(uint32_t)
+        || section[0] > UINT32_MAX / 2 - 1)
+        invalid(path);
+    compact_t *compact = &c->compact;
+    compact->code = (const uint8_t *)(section + 1);
+    compact->size = section[0];
+    const uint32_t size = compact->size;
+
+    uint32_t *word_pc = alloc_or_exit((size + 1ull) * sizeof(uint32_t));
+    for (uint32_t b = 0; b <= size; b++)
+        word_pc[b] = UINT32_MAX;
+    uint32_t len = 0;
+    for (uint32_t b = 0; b < size; ) {
+        if (compact_length(compact, b) == 0)
+            invalid(path);
+        const decode_t d = decode_compact(compact, b);
+        word_pc[b] = len;
+        len += has_immediate(d.opcode) ? 2 : 1;
+        b += d.length;
+    }
+    word_pc[size] = len;
+
+    Instr_t *words = alloc_or_exit((size_t)len * sizeof(Instr_t));
+    uint32_t *byte_pc = alloc_or_exit((len + 1ull) * sizeof(uint32_t));
+    for (uint32_t w = 0; w <= len; w++)
+        byte_pc[w] = UINT32_MAX;
+    for (uint32_t b = 0, w = 0; b < size; ) {
+        const decode_t d = decode_compact(compact, b);
+        byte_pc[w] = b;
+        words[w] = d.opcode;
+        if (d.opcode == Instr_Push) {
+            words[w + 1] = d.immediate;
+        } else if (has_immediate(d.opcode)) {
+            const int64_t target = (int64_t)b + d.length + d.immediate;
+            if (target < 0 || target > size
+                || word_pc[target] == UINT32_MAX)
+                invalid(path);
+            words[w + 1] = word_pc[target] - (w + 2);
+        }
+        w += has_immediate(d.opcode) ? 2 : 1;
+        b += d.length;
+    }
+    byte_pc[len] = size;
+
+    compact->len = len;
+    compact->word_pc = word_pc;
+    compact->byte_pc = byte_pc;
+    c->words = words;
+    c->word_pc = word_pc;
+    c->byte_pc = byte_pc;
+    c->code = words;
+}
+
+Instr_t *open_container(void *base, size_t size, uint32_t *len,
+                        const char *path) {
+    const container_header_t *header = base;
+    if (size < sizeof(*header) || header->magic != CONTAINER_MAGIC
+        || header->version != CONTAINER_VERSION || header->reserved
+        || (size - sizeof(*header)) % sizeof(uint32_t)
+        || header->nsections > (size - sizeof(*header)) / sizeof(section_t))
+        invalid(path);
+    const uint32_t *words = (const uint32_t *)(header + 1);
+    if (add_to_hash(0xcbf29ce484222325ull, words,
+                    (size - sizeof(*header)) / sizeof(uint32_t))
+        != header->checksum) {
+        fprintf(stderr, "Corrupted program container: %s\n", path);
+        exit(2);
+    }
+
+    const section_t *sections = (const section_t *)(header + 1);
+    const uint64_t data = sizeof(*header)
+                          + header->nsections * sizeof(section_t);
+    const uint32_t *contents[Section_Compact + 1] = {NULL};
+    uint32_t counts[Section_Compact + 1] = {0};
+    for (uint32_t s = 0; s < header->nsections; s++) {
+        const section_t *sec = &sections[s];
+        if (sec->offset % sizeof(uint32_t) || sec->offset < data
+            || sec->offset > size
+            || sec->count > (size - sec->offset) / sizeof(uint32_t))
+            invalid(path);
+        if (sec->type < Section_Code || sec->type > Section_Compact)
+            continue; /* Of a later version */
+        if (contents[sec->type])
+            invalid(path);
+        contents[sec->type] = (const uint32_t *)((const char *)base
+                                                 + sec->offset);
+        counts[sec->type] = sec->count;
+    }
+    if (!contents[Section_Code] == !contents[Section_Compact])
+        invalid(path);
+    container_t *c = alloc_or_exit(sizeof(container_t));
+    *c = (container_t){.base = base, .size = size,
+                       .code = contents[Section_Code]};
+    uint32_t n = counts[Section_Code];
+    if (contents[Section_Compact]) {
+        expand_compact(c, contents[Section_Compact],
+                       counts[Section_Compact], path);
+        n = c->compact.len;
+    }
+    if ((contents[Section_StackDepth] && counts[Section_StackDepth] != n)
+        || counts[Section_Hints] % 3)
+        invalid(path);
+    check_pcs(contents[Section_Blocks], counts[Section_Blocks], n, path);
+    check_pcs(contents[Section_HotPCs], counts[Section_HotPCs], n, path);
+
+    c->info = (program_info_t){
+        .blocks = contents[Section_Blocks],
+        .nblocks = counts[Section_Blocks],
+        .stack_depth = (const int32_t *)contents[Section_StackDepth],
+        .hot_pcs = contents[Section_HotPCs],
+        .nhot_pcs = counts[Section_HotPCs],
+        .hints = contents[Section_Hints],
+        .nhints = counts[Section_Hints] / 3,
+        .compact = contents[Section_Compact] ? &c->compact : NULL};
+    pthread_mutex_lock(&containers_lock);
+    c->next = containers;
+    containers = c;
+    pthread_mutex_unlock(&containers_lock);
+    *len = n;
+    return (Instr_t *)c->code;
+}
+
+int release_container(const Instr_t *program) {
+    pthread_mutex_lock(&containers_lock);
+    for (container_t **p = &containers; *p; p = &(*p)->next) {
+        container_t *c = *p;
+        if (c->code == program) {
+            *p = c->next;
+            pthread_mutex_unlock(&containers_lock);
+            munmap(c->base, c->size);
+            free(c->words);
+            free(c->word_pc);
+            free(c->byte_pc);
+            free(c);
+            return 1;
+        }
+    }
+    pthread_mutex_unlock(&containers_lock);
+    return 0;
+}
+
+const program_info_t *program_info(const Instr_t *program) {
+    const program_info_t *info = NULL;
+    pthread_mutex_lock(&containers_lock);
+    for (const container_t *c = containers; c; c = c->next)
+        if (c->code == program)
+            info = &c->info;
+    pthread_mutex_unlock(&containers_lock);
+    return info;
+}
+
+typedef struct {
+    section_type_t type;
+    const void *words;
+    uint32_t count;
+} section_data_t;
+
+int write_container(const char *path, const Instr_t *code, uint32_t len,
+                    const program_info_t *info) {
+    /* Compact code is stored after its size, padded to whole words */
+    uint32_t *packed = NULL;
+    uint32_t npacked = 0;
+    if (info->compact) {
+        npacked = 1 + (info->compact->size + 3) / sizeof(uint32_t);
+        packed = calloc(npacked, sizeof(uint32_t));
+        if (packed == NULL)
+            return -1;
+        packed[0] = info->compact->size;
+        memcpy(packed + 1, info->compact->code, info->compact->size);
+    }
+    const section_data_t present[] = {
+        packed ? (section_data_t){Section_Compact, packed, npacked}
+               : (section_data_t){Section_Code, code, len},
+        {Section_Blocks, info->blocks, info->nblocks},
+        {Section_StackDepth, info->stack_depth,
+                             info->stack_depth ? len : 0},
+        {Section_HotPCs, info->hot_pcs, info->nhot_pcs},
+        {Section_Hints, info->hints, 3 * info->nhints}};
+    const uint32_t npresent = sizeof(present) / sizeof(present[0]);
+
+    uint32_t used[sizeof(present) / sizeof(present[0])];
+    container_header_t header = {.magic = CONTAINER_MAGIC,
+                                 .version = CONTAINER_VERSION};
+    for (uint32_t s = 0; s < npresent; s++)
+        if (s == 0 || present[s].words) /* Code is always there */
+            used[header.nsections++] = s;
+
+    section_t sections[sizeof(present) / sizeof(present[0])];
+    uint64_t offset = sizeof(header) + header.nsections * sizeof(section_t);
+    for (uint32_t i = 0; i < header.nsections; i++) {
+        sections[i] = (section_t){.type = present[used[i]].type,
+                                  .count = present[used[i]].count,
+                                  .offset = offset};
+        offset += (uint64_t)present[used[i]].count * sizeof(uint32_t);
+    }
+    uint32_t table[sizeof(sections) / sizeof(uint32_t)];
+    memcpy(table, sections, header.nsections * sizeof(section_t));
+    uint64_t h = add_to_hash(0xcbf29ce484222325ull, table,
+                             header.nsections * sizeof(section_t)
+                             / sizeof(uint32_t));
+    for (uint32_t i = 0; i < header.nsections; i++)
+        h = add_to_hash(h, present[used[i]].words, present[used[i]].count);
+    header.checksum = h;
+
+    int ret = -1;
+    FILE *f = fopen(path, "wb");
+    if (f != NULL) {
+        fwrite(&header, sizeof(header), 1, f);
+        fwrite(sections, sizeof(section_t), header.nsections, f);
+        for (uint32_t i = 0; i < header.nsections; i++)
+            fwrite(present[used[i]].words, sizeof(uint32_t),
+                   present[used[i]].count, f);
+        ret = ferror(f) ? -1 : 0;
+        if (fclose(f))
+            ret = -1;
+    }
+    free(packed);
+    return ret;
+}
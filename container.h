@@ -0,0 +1,117 @@
+/*  container.h - program files with precomputed analysis for a stack
+    virtual machine
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+#include "compact.h"
+
+#ifndef CONTAINER_H_
+#define CONTAINER_H_
+
+#define CONTAINER_MAGIC 0x47504d56u /* "VMPG" */
+#define CONTAINER_VERSION 1
+
+/* A container is this header, a table of nsections sections and their
+   contents, all in host byte order. Sections are arrays of 32-bit words
+   at offsets that are multiples of 4, and only the code is required, as
+   words or as compact code. Unknown section types are skipped, so new kinds of analysis
+   need no new version. The checksum covers everything after the header.
+   read_program() of common.h recognizes containers by the magic, which
+   as the first word of a raw program would only be a Break. */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nsections;
+    uint32_t reserved;  /* Zero */
+    uint64_t checksum;
+} container_header_t;
+
+typedef enum {
+    Section_Code = 1,   /* The program, Instr_t words */
+    Section_Blocks,     /* Sorted PCs where basic blocks start */
+    Section_StackDepth, /* For every word of code, the stack depth before
+                           the instruction starting there relative to the
+                           start of the program, or STACK_DEPTH_UNKNOWN */
+    Section_HotPCs,     /* PCs expected to run most, hottest first */
+    Section_Hints,      /* Triples of two opcodes that often follow each
+                           other in a block and how often, most first:
+                           candidates for superinstructions */
+    Section_Compact     /* Instead of Section_Code, the program as compact
+                           code of compact.h: the number of bytes, then
+                           the bytes. PCs of other sections are those of
+                           words. */
+} section_type_t;
+
+#define STACK_DEPTH_UNKNOWN INT32_MIN
+
+typedef struct {
+    uint32_t type;
+    uint32_t count;     /* Words */
+    uint64_t offset;    /* From the start of the file */
+} section_t;
+
+/* Analysis found in the container of a program, NULL and zero for
+   sections it does not have */
+typedef struct {
+    const uint32_t *blocks;
+    uint32_t nblocks;
+    const int32_t *stack_depth; /* As many as words of code */
+    const uint32_t *hot_pcs;
+    uint32_t nhot_pcs;
+    const uint32_t *hints;
+    uint32_t nhints;            /* Triples */
+    const compact_t *compact;   /* The program as compact code, if it came
+                                   as such */
+} program_info_t;
+
+/* Check a container of size bytes at base, which read_program() mapped,
+   and return its code section. Compact code is decoded into words, so
+   that every engine can run it, and the maps between the PCs of both
+   are built. The mapping then belongs to the container
+   until release_container(). Exits the process on a malformed one. */
+Instr_t *open_container(void *base, size_t size, uint32_t *len,
+                        const char *path);
+
+/* Returns zero if program is not the code of an open container,
+   otherwise unmaps it */
+int release_container(const Instr_t *program);
+
+/* Analysis of a program loaded from a container, NULL for other programs.
+   Engines look their program up with it in vm_create(). */
+const program_info_t *program_info(const Instr_t *program);
+
+/* Write a container with the code and the sections of info that are
+   present. With info->compact, the code is written as compact code
+   only. Returns zero on success, -1 with errno set otherwise. */
+int write_container(const char *path, const Instr_t *code, uint32_t len,
+                    const program_info_t *info);
+
+#endif /* CONTAINER_H_ */
@@ -0,0 +1,110 @@
+/*  driver.c - command line front end shared by interpreters written
+    for a stack virtual machine.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#include "common.h"
+#include "checkpoint.h"
+#include "output.h"
+#include "vm.h"
+
+static void preempt(void *vm) {
+    vm_preempt(vm);
+}
+
+int main(int argc, char **argv) {
+    uint64_t steplimit = parse_args(argc, argv);
+    /* Steps are counted only when they matter: for --steplimit, or to
+       store them in a checkpoint */
+    const int counted = steplimit != UNLIMITED_STEPS
+                        || Options.checkpoint_path;
+    if (counted && steplimit == UNLIMITED_STEPS)
+        steplimit--; /* As good as no limit, but counted */
+    vm_t *vm;
+    cpu_t saved = {.stack = NULL, .pmem = NULL};
+    if (Options.restore_path) {
+        saved = read_checkpoint(Options.restore_path);
+        vm = vm_create(saved.pmem, saved.pmem_size, &Options);
+        if (Options.out_bin)
+            set_output_file(Options.out_bin,
+                            hash_program(saved.pmem, saved.pmem_size));
+        if (!vm_restore(vm, &saved)) {
+            fprintf(stderr, "Stack of the checkpoint does not fit, "
+                            "use --stack-size or --stack-grow.\n");
+            exit(2);
+        }
+    } else {
+        vm = LoadedProgram
+             ? vm_create(LoadedProgram, LoadedProgramSize, &Options)
+             : vm_create(DefProgram, DefProgramSize, &Options);
+    }
+    const uint64_t start = vm_cpu(vm)->steps;
+
+    arm_timeout(preempt, vm);
+    vm_run(vm, steplimit);
+    flush_output(); /* Print output of the guest goes before its state */
+
+    const cpu_t cpu = *vm_cpu(vm);
+    const uint64_t executed = cpu.steps - start;
+    assert(cpu.state != Cpu_Running || executed == steplimit || Preempted);
+    if (Options.checkpoint_path
+        && write_checkpoint(&cpu, Options.checkpoint_path,
+                            Options.checkpoint_sync)) {
+        perror(Options.checkpoint_path);
+        exit(2);
+    }
+    /* Print CPU state */
+    const char *state = cpu.state == Cpu_Halted? "Halted":
+                        cpu.state == Cpu_Running? "Running": "Break";
+    if (counted)
+        printf("CPU executed %ld steps. End state \"%s\".\n",
+                cpu.steps, state);
+    else
+        printf("CPU did not count steps. End state \"%s\".\n", state);
+    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
+    printf("Stack: ");
+    for (int32_t i=cpu.sp; i >= 0 ; i--) {
+        printf("%#10x ", cpu.stack[i]);
+    }
+    printf("%s\n", cpu.sp == -1? "(empty)": "");
+
+    vm_report(vm);
+    vm_destroy(vm);
+    free_program(LoadedProgram, LoadedProgramSize);
+    free((Instr_t *)saved.pmem);
+    free(saved.stack);
+
+    return cpu.state == Cpu_Halted ||
+           (cpu.state == Cpu_Running &&
+            executed == steplimit)?0:1;
+}
@@ -0,0 +1,549 @@
+/*  lanes.c - interpreter running many instances of one program for a
+    stack virtual machine in lock-step, one instance per lane of a host
+    vector register.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* For clock_gettime() */
+#define _ISOC11_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "common.h"
+#include "output.h"
+
+/* Instances per host vector: 8 fill an AVX2 register, 16 an AVX-512 one */
+#ifndef LANES
+#define LANES 8
+#endif
+
+/* One word of every lane. Comparisons give all ones in lanes where they
+   hold, and such vectors serve as lane masks. */
+typedef uint32_t lanes_t __attribute__((vector_size(LANES * sizeof(uint32_t))));
+
+/* Lanes at the same pc with the same stack depth execute together as a
+   group. Stacks are laid out as stack[depth][lane], so an instruction
+   reads and writes whole rows, masked to the lanes of its group. */
+typedef struct {
+    uint32_t pc;
+    int32_t sp;
+    lanes_t mask;
+    uint64_t executed; /* Instructions not yet added to steps of the lanes */
+} group_t;
+
+/* Why a group stopped running */
+typedef struct {
+    lanes_t leaving;    /* Lanes which end with state */
+    cpu_state_t state;
+    int32_t leaving_sp; /* sp of the leaving lanes */
+    lanes_t taken;      /* Lanes which branched away from the group */
+    uint32_t taken_pc;
+} event_t;
+
+typedef struct {
+    const decode_t *code;
+    uint32_t len;
+    lanes_t *stack;
+    int32_t stack_capacity;
+    int32_t stack_limit;
+    uint64_t steplimit;
+    group_t groups[LANES];
+    int ngroups;
+    /* Final state of every lane */
+    cpu_state_t state[LANES];
+    uint32_t pc[LANES];
+    int32_t sp[LANES];
+    uint64_t steps[LANES];
+    uint64_t random[LANES]; /* Instr_Rand generator of every lane */
+} batch_t;
+
+static inline lanes_t splat(uint32_t v) {
+    return (lanes_t){0} + v;
+}
+
+static inline bool none(lanes_t v) {
+    uint64_t words[LANES / 2];
+    memcpy(words, &v, sizeof(words));
+    uint64_t any = 0;
+    for (int i = 0; i < LANES / 2; i++)
+        any |= words[i];
+    return any == 0;
+}
+
+/* Lanes of mask take v, the others keep old */
+static inline lanes_t blend(lanes_t mask, lanes_t v, lanes_t old) {
+    return (v & mask) | (old & ~mask);
+}
+
+static void print_lanes(lanes_t mask, const char *msg) {
+    for (int l = 0; l < LANES; l++)
+        if (mask[l])
+            print_message(msg);
+}
+
+static int grow_lanes_stack(batch_t *b) {
+    if (b->stack_capacity >= b->stack_limit)
+        return 0;
+    int32_t capacity = b->stack_capacity * 2;
+    if (capacity > b->stack_limit)
+        capacity = b->stack_limit;
+    /* Rows are aligned for vector loads, which realloc() does not promise */
+    lanes_t *stack = aligned_alloc(sizeof(lanes_t), capacity * sizeof(lanes_t));
+    if (stack == NULL)
+        return 0;
+    memcpy(stack, b->stack, b->stack_capacity * sizeof(lanes_t));
+    free(b->stack);
+    b->stack = stack;
+    b->stack_capacity = capacity;
+    return 1;
+}
+
+static inline decode_t decode_at_address(const Instr_t* prog,
+                                         uint32_t len, uint32_t addr) {
+    assert(addr < len);
+    decode_t result = {0};
+    Instr_t raw_instr = prog[addr];
+    result.opcode = raw_instr;
+    switch (raw_instr) {
+    case Instr_Nop:
+    case Instr_Halt:
+    case Instr_Print:
+    case Instr_Swap:
+    case Instr_Dup:
+    case Instr_Inc:
+    case Instr_Add:
+    case Instr_Sub:
+    case Instr_Mul:
+    case Instr_Rand:
+    case Instr_Dec:
+    case Instr_Drop:
+    case Instr_Over:
+    case Instr_Mod:
+    case Instr_And:
+    case Instr_Or:
+    case Instr_Xor:
+    case Instr_SHL:
+    case Instr_SHR:
+    case Instr_Rot:
+    case Instr_SQRT:
+    case Instr_Pick:
+        result.length = 1;
+        break;
+    case Instr_Push:
+    case Instr_JNE:
+    case Instr_JE:
+    case Instr_Jump:
+        result.length = 2;
+        if (!(addr+1 < len)) {
+            result.length = 1;
+            result.opcode = Instr_Break;
+            break;
+        }
+        result.immediate = (int32_t)prog[addr+1];
+        break;
+    case Instr_Break:
+    default: /* Undefined instructions equal to Break */
+        result.length = 1;
+        result.opcode = Instr_Break;
+        break;
+    }
+    return result;
+}
+
+/* Check that an instruction popping pops and then pushing pushes words
+   fits into the stack, otherwise the whole group stops */
+#define NEED(pops, pushes) \
+    if (sp + 1 < (pops)) { \
+        print_lanes(mask, "Stack underflow\n"); \
+        ev.leaving = mask; ev.state = Cpu_Break; ev.leaving_sp = -1; \
+        break; \
+    } \
+    while (sp - (pops) + (pushes) >= b->stack_capacity) { \
+        if (!grow_lanes_stack(b)) { \
+            print_lanes(mask, "Stack overflow\n"); \
+            ev.leaving = mask; ev.state = Cpu_Break; \
+            ev.leaving_sp = b->stack_capacity - 1; \
+            break; \
+        } \
+        stack = b->stack; \
+    } \
+    if (!none(ev.leaving)) \
+        break;
+
+#define SET(row, v) (row) = blend(mask, (v), (row))
+
+/* Binary operation on the two top rows, top is the left operand */
+#define BINARY(expr) do { \
+    NEED(2, 1); \
+    const lanes_t a = stack[sp], c = stack[sp - 1]; \
+    SET(stack[sp - 1], (expr)); \
+    sp--; \
+} while (0)
+
+/* Run a group until it diverges, some of its lanes stop, it reaches the pc
+   of another group or its budget of steps is over */
+static event_t run_group(batch_t *b, group_t *g, uint32_t limit_pc,
+                         uint64_t budget) {
+    const decode_t *code = b->code;
+    lanes_t *stack = b->stack;
+    uint32_t pc = g->pc;
+    int32_t sp = g->sp;
+    const lanes_t mask = g->mask;
+    uint64_t executed = 0;
+    event_t ev = {.leaving = {0}, .taken = {0}};
+
+    while (executed < budget) {
+        if (!(pc < b->len)) {
+            print_lanes(mask, "PC out of bounds\n");
+            ev.leaving = mask;
+            ev.state = Cpu_Break;
+            ev.leaving_sp = sp;
+            break; /* Neither advances pc nor counts as a step */
+        }
+        const decode_t decoded = code[pc];
+        lanes_t taken = {0};
+        switch (decoded.opcode) {
+        case Instr_Nop:
+            break;
+        case Instr_Halt:
+            ev.leaving = mask;
+            ev.state = Cpu_Halted;
+            ev.leaving_sp = sp;
+            break;
+        case Instr_Push:
+            NEED(0, 1);
+            sp++;
+            SET(stack[sp], splat(decoded.immediate));
+            break;
+        case Instr_Print:
+            NEED(1, 0);
+            for (int l = 0; l < LANES; l++)
+                if (mask[l])
+                    print_value(stack[sp][l]);
+            sp--;
+            break;
+        case Instr_Swap: {
+            NEED(2, 2);
+            const lanes_t a = stack[sp], c = stack[sp - 1];
+            SET(stack[sp], c);
+            SET(stack[sp - 1], a);
+            break;
+        }
+        case Instr_Dup:
+            NEED(1, 2);
+            SET(stack[sp + 1], stack[sp]);
+            sp++;
+            break;
+        case Instr_Over:
+            NEED(2, 3);
+            SET(stack[sp + 1], stack[sp - 1]);
+            sp++;
+            break;
+        case Instr_Inc:
+            NEED(1, 1);
+            SET(stack[sp], stack[sp] + 1);
+            break;
+        case Instr_Dec:
+            NEED(1, 1);
+            SET(stack[sp], stack[sp] - 1);
+            break;
+        case Instr_Add: BINARY(a + c); break;
+        case Instr_Sub: BINARY(a - c); break;
+        case Instr_Mul: BINARY(a * c); break;
+        case Instr_And: BINARY(a & c); break;
+        case Instr_Or:  BINARY(a | c); break;
+        case Instr_Xor: BINARY(a ^ c); break;
+        /* Host shifts use the low 5 bits of the count, as scalar engines do */
+        case Instr_SHL: BINARY(a << (c & 31)); break;
+        case Instr_SHR: BINARY(a >> (c & 31)); break;
+        case Instr_Mod: {
+            NEED(2, 1);
+            /* No vector division, and a zero divisor stops single lanes */
+            lanes_t r = stack[sp - 1];
+            for (int l = 0; l < LANES; l++) {
+                if (!mask[l])
+                    continue;
+                if (stack[sp - 1][l] == 0)
+                    ev.leaving[l] = ~0u;
+                else
+                    r[l] = stack[sp][l] % stack[sp - 1][l];
+            }
+            stack[sp - 1] = r;
+            sp--;
+            ev.state = Cpu_Break;
+            ev.leaving_sp = sp - 1;
+            break;
+        }
+        case Instr_Rand:
+            NEED(0, 1);
+            sp++;
+            for (int l = 0; l < LANES; l++)
+                if (mask[l])
+                    stack[sp][l] = next_random(&b->random[l]);
+            break;
+        case Instr_Drop:
+            NEED(1, 0);
+            sp--;
+            break;
+        case Instr_JE:
+        case Instr_JNE:
+            NEED(1, 0);
+            taken = mask & (decoded.opcode == Instr_JE
+                            ? (lanes_t)(stack[sp] == 0)
+                            : (lanes_t)(stack[sp] != 0));
+            sp--;
+            if (none(taken))
+                break;
+            if (none(taken ^ mask)) {
+                pc += decoded.immediate;
+                taken = (lanes_t){0};
+                if (Preempted)
+                    budget = executed + 1;
+                break;
+            }
+            ev.taken = taken;
+            ev.taken_pc = pc + decoded.immediate + decoded.length;
+            break;
+        case Instr_Jump:
+            pc += decoded.immediate;
+            if (Preempted)
+                budget = executed + 1;
+            break;
+        case Instr_Rot: {
+            NEED(3, 3);
+            const lanes_t a = stack[sp], c = stack[sp - 1], d = stack[sp - 2];
+            SET(stack[sp - 2], a);
+            SET(stack[sp - 1], d);
+            SET(stack[sp], c);
+            break;
+        }
+        case Instr_SQRT:
+            NEED(1, 1);
+            for (int l = 0; l < LANES; l++)
+                if (mask[l])
+                    stack[sp][l] = sqrt(stack[sp][l]);
+            break;
+        case Instr_Pick:
+            NEED(1, 1);
+            for (int l = 0; l < LANES; l++) {
+                if (!mask[l])
+                    continue;
+                int32_t pos = stack[sp][l];
+                if (sp - 2 < pos) {
+                    print_message("Out of bound picking\n");
+                    ev.leaving[l] = ~0u;
+                    stack[sp][l] = 0;
+                } else {
+                    stack[sp][l] = stack[sp - 1 - pos][l];
+                }
+            }
+            ev.state = Cpu_Break;
+            ev.leaving_sp = sp;
+            break;
+        case Instr_Break:
+            ev.leaving = mask;
+            ev.state = Cpu_Break;
+            ev.leaving_sp = sp;
+            break;
+        default:
+            assert("Unreachable" && false);
+            break;
+        }
+        pc += decoded.length; /* Advance PC */
+        executed++;
+        if (!none(ev.leaving | ev.taken) || pc >= limit_pc)
+            break;
+    }
+
+    g->pc = pc;
+    g->sp = sp;
+    g->executed += executed;
+    return ev;
+}
+
+static void flush_steps(batch_t *b, group_t *g) {
+    for (int l = 0; l < LANES; l++)
+        if (g->mask[l])
+            b->steps[l] += g->executed;
+    g->executed = 0;
+}
+
+static void retire(batch_t *b, group_t *g, lanes_t lanes, cpu_state_t state,
+                   int32_t sp) {
+    flush_steps(b, g);
+    for (int l = 0; l < LANES; l++) {
+        if (lanes[l]) {
+            b->state[l] = state;
+            b->pc[l] = g->pc;
+            b->sp[l] = sp;
+        }
+    }
+    g->mask &= ~lanes;
+}
+
+/* Groups run in the order of their pc, lowest first, which brings lanes
+   that took different paths together again at the first pc where they
+   meet: after an if-else, or after the loop some of them left earlier. */
+static void run_batch(batch_t *b) {
+    while (b->ngroups) {
+        int first = 0;
+        for (int i = 1; i < b->ngroups; i++)
+            if (b->groups[i].pc < b->groups[first].pc)
+                first = i;
+        group_t g = b->groups[first];
+        b->groups[first] = b->groups[--b->ngroups];
+
+        flush_steps(b, &g);
+        uint32_t limit_pc = UINT32_MAX;
+        for (int i = 0; i < b->ngroups; i++) {
+            group_t *other = &b->groups[i];
+            if (other->pc == g.pc && other->sp == g.sp) { /* Reconverge */
+                flush_steps(b, other);
+                g.mask |= other->mask;
+                *other = b->groups[--b->ngroups];
+                i--;
+            } else if (other->pc < limit_pc) {
+                limit_pc = other->pc;
+            }
+        }
+
+        /* Lanes at the step limit stop, the others may go on */
+        uint64_t budget = UINT64_MAX;
+        lanes_t done = {0};
+        for (int l = 0; l < LANES; l++) {
+            if (!g.mask[l])
+                continue;
+            if (b->steps[l] >= b->steplimit || Preempted)
+                done[l] = ~0u;
+            else if (b->steplimit - b->steps[l] < budget)
+                budget = b->steplimit - b->steps[l];
+        }
+        retire(b, &g, done, Cpu_Running, g.sp);
+        if (none(g.mask))
+            continue;
+
+        const event_t ev = run_group(b, &g, limit_pc, budget);
+        if (!none(ev.leaving))
+            retire(b, &g, ev.leaving, ev.state, ev.leaving_sp);
+        if (!none(ev.taken)) {
+            flush_steps(b, &g);
+            b->groups[b->ngroups++] = (group_t){.pc = ev.taken_pc, .sp = g.sp,
+                                                .mask = ev.taken,
+                                                .executed = 0};
+            g.mask &= ~ev.taken;
+        }
+        if (!none(g.mask))
+            b->groups[b->ngroups++] = g;
+    }
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Runs --vms instances of the program, LANES at a time. With --input=<num>,
+   instance i starts with num + i on its stack. --steplimit applies to every
+   instance, --timeout to the whole run. */
+int main(int argc, char **argv) {
+    uint64_t steplimit = parse_args(argc, argv);
+    const Instr_t *program = LoadedProgram ? LoadedProgram : DefProgram;
+    const uint32_t len = LoadedProgram ? LoadedProgramSize : DefProgramSize;
+    const uint32_t n = Options.vms;
+
+    decode_t *code = malloc(len * sizeof(decode_t));
+    batch_t *b = aligned_alloc(sizeof(lanes_t), sizeof(batch_t));
+    if ((!code && len) || !b) {
+        fprintf(stderr, "Failed to allocate memory for decoded program.\n");
+        exit(2);
+    }
+    for (uint32_t i = 0; i < len; i++)
+        code[i] = decode_at_address(program, len, i);
+    b->code = code;
+    b->len = len;
+    b->stack_capacity = Options.stack_size;
+    b->stack_limit = Options.stack_grow ? STACK_MAX_CAPACITY
+                                        : (int32_t)Options.stack_size;
+    b->stack = aligned_alloc(sizeof(lanes_t),
+                             b->stack_capacity * sizeof(lanes_t));
+    if (b->stack == NULL) {
+        fprintf(stderr, "Failed to allocate memory for data stack.\n");
+        exit(2);
+    }
+    b->steplimit = steplimit;
+
+    arm_timeout(NULL, NULL);
+    uint64_t steps = 0;
+    uint32_t halted = 0, broken = 0, finished = 0;
+    const uint64_t start = now_ns();
+    for (uint32_t first = 0; first < n; first += LANES) {
+        group_t g = {.pc = 0, .sp = Options.has_input ? 0 : -1,
+                     .mask = {0}, .executed = 0};
+        for (int l = 0; l < LANES && first + l < n; l++) {
+            g.mask[l] = ~0u;
+            b->stack[0][l] = Options.input + first + l;
+            b->steps[l] = 0;
+            b->random[l] = seed_random(Options.seed + first + l);
+        }
+        b->groups[0] = g;
+        b->ngroups = 1;
+        run_batch(b);
+        flush_output();
+
+        for (int l = 0; l < LANES && first + l < n; l++) {
+            printf("Instance %u: %s after %lu steps, PC = %#x, SP = %d\n",
+                   first + l, b->state[l] == Cpu_Halted? "Halted":
+                              b->state[l] == Cpu_Running? "Running": "Break",
+                   b->steps[l], b->pc[l], b->sp[l]);
+            steps += b->steps[l];
+            halted += b->state[l] == Cpu_Halted;
+            broken += b->state[l] == Cpu_Break;
+            finished += b->state[l] != Cpu_Running
+                        || b->steps[l] == steplimit;
+        }
+        fflush(stdout); /* Before output of the next instances */
+    }
+    const uint64_t elapsed = now_ns() - start;
+    printf("Executed %lu steps of %u instances in %d lanes in %.3f s, "
+           "%.1f MIPS\n", steps, n, LANES, elapsed / 1e9,
+           elapsed ? steps / (elapsed / 1e3) : 0.0);
+
+    free(b->stack);
+    free(b);
+    free(code);
+    free_program(LoadedProgram, LoadedProgramSize);
+    return finished == n && broken == 0 ? 0 : 1;
+}
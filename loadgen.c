@@ -0,0 +1,180 @@
+/*  loadgen.c - load generator for the server of a stack virtual machine.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* For clock_gettime() */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "common.h"
+#include "server.h"
+
+typedef struct {
+    pthread_t thread;
+    uint32_t first;    /* Index of its first request */
+    uint32_t count;    /* Requests sent over its connection */
+    reply_t reply;     /* Reply to the first request */
+    int failed;
+} client_t;
+
+static const Instr_t *program;
+static uint32_t len;
+static uint64_t steplimit;
+static uint64_t *latency; /* ns, per request */
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int connect_to(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+        perror("connect");
+        exit(2);
+    }
+    return fd;
+}
+
+/* Read and drop the variable part of a reply */
+static int skip(int fd, size_t len) {
+    char buf[4096];
+    while (len) {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if (!read_full(fd, buf, n))
+            return 0;
+        len -= n;
+    }
+    return 1;
+}
+
+static void *client_main(void *arg) {
+    client_t *self = arg;
+    int fd = connect_to(Options.socket_path);
+    const request_t req = {.magic = REQUEST_MAGIC, .len = len,
+                           .steplimit = steplimit};
+    for (uint32_t i = 0; i < self->count; i++) {
+        const uint64_t start = now_ns();
+        reply_t rep;
+        if (!write_full(fd, &req, sizeof(req))
+            || !write_full(fd, program, len * sizeof(Instr_t))
+            || !read_full(fd, &rep, sizeof(rep)) || rep.magic != REPLY_MAGIC
+            || !skip(fd, (rep.sp + 1) * sizeof(uint32_t) + rep.output_len)) {
+            self->failed = 1;
+            break;
+        }
+        latency[self->first + i] = now_ns() - start;
+        if (i == 0)
+            self->reply = rep;
+    }
+    close(fd);
+    return NULL;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile of n sorted values, in milliseconds */
+static double percentile_ms(const uint64_t *sorted, uint32_t n, unsigned p) {
+    uint64_t rank = ((uint64_t)p * n + 99) / 100;
+    return sorted[rank ? rank - 1 : 0] / 1e6;
+}
+
+/* Sends --requests copies of the usual program to the server at
+   --socket=<path> over --threads connections, each waiting for a reply
+   before sending the next request */
+int main(int argc, char **argv) {
+    steplimit = parse_args(argc, argv);
+    if (Options.socket_path == NULL) {
+        fprintf(stderr, "Load generator needs %s<path>\n", "--socket=");
+        exit(2);
+    }
+    program = LoadedProgram ? LoadedProgram : DefProgram;
+    len = LoadedProgram ? LoadedProgramSize : DefProgramSize;
+    const uint32_t n = Options.requests;
+    const uint32_t nclients = Options.threads ? Options.threads : 1;
+
+    client_t *clients = calloc(nclients, sizeof(client_t));
+    latency = calloc(n, sizeof(uint64_t));
+    if (!clients || !latency) {
+        fprintf(stderr, "Failed to allocate memory for load generator.\n");
+        exit(2);
+    }
+
+    const uint64_t start = now_ns();
+    for (uint32_t c = 0; c < nclients; c++) {
+        clients[c].first = (uint64_t)n * c / nclients;
+        clients[c].count = (uint64_t)n * (c + 1) / nclients - clients[c].first;
+        if (pthread_create(&clients[c].thread, NULL, client_main, &clients[c])) {
+            perror("pthread_create");
+            exit(2);
+        }
+    }
+    int failed = 0;
+    for (uint32_t c = 0; c < nclients; c++) {
+        pthread_join(clients[c].thread, NULL);
+        failed |= clients[c].failed;
+    }
+    const uint64_t elapsed = now_ns() - start;
+    if (failed) {
+        fprintf(stderr, "Server closed a connection.\n");
+        exit(1);
+    }
+
+    const reply_t *rep = &clients[0].reply;
+    printf("Reply: %s after %lu steps, PC = %#x, SP = %d, %u bytes of output\n",
+           rep->state == Cpu_Halted? "Halted":
+           rep->state == Cpu_Running? "Running": "Break",
+           rep->steps, rep->pc, rep->sp, rep->output_len);
+    printf("Sent %u requests over %u connections in %.3f s, %.0f requests/s\n",
+           n, nclients, elapsed / 1e9, elapsed ? n / (elapsed / 1e9) : 0.0);
+    qsort(latency, n, sizeof(uint64_t), compare_u64);
+    printf("Latency, ms: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+           percentile_ms(latency, n, 50), percentile_ms(latency, n, 90),
+           percentile_ms(latency, n, 99), percentile_ms(latency, n, 100));
+
+    free(clients);
+    free(latency);
+    free_program(LoadedProgram, LoadedProgramSize);
+    return 0;
+}
@@ -0,0 +1,43 @@
+#!/usr/bin/env bash
+# A script to run a batch runner with a growing number of threads
+# and tabulate aggregate throughput.
+# Dependencies: awk
+# Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+# Set THREADS to numbers of worker threads to try, up to all CPUs by default
+NCPU=`getconf _NPROCESSORS_ONLN`
+THREADS=${THREADS:-`awk -v n=$NCPU 'BEGIN {for (t = 1; t < n; t *= 2) printf "%d ", t; print n}'`}
+
+# Copies of the program to run
+VMS=${VMS:-64}
+
+# OPTS come from enviroment, e.g. OPTS=--inp-prog=factorial.raw
+OPTS=${OPTS:---steplimit=100000000}
+
+### End of options ###
+set -e
+trap "exit" INT
+
+export LANG=C
+
+if [ -n "$1" ]
+then
+    VARIANTS=$@
+else
+    VARIANTS="batch-switched batch-predecoded batch-translated"
+fi
+
+echo "# $VMS copies, OPTS: $OPTS"
+for V in $VARIANTS
+do
+    echo "# $V"
+    echo "# threads MIPS speedup"
+    for T in $THREADS
+    do
+        ./$V --vms=$VMS --threads=$T ${OPTS} | awk -v t=$T '
+            /^Executed/ { mips = $7 }
+            END { print t, mips }'
+    done | awk '
+        NR == 1 { base = $2 }
+        { printf "%d %.1f %.2f\n", $1, $2, $2 / base }'
+done
@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+# A script to compare the lanes engine running many inputs of one program
+# in lock-step against running a scalar engine once per input.
+# Dependencies: awk, date
+# Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+# Instance i gets BASE + i on its stack
+PROG=${PROG:-primes-nmax.raw}
+BASE=${BASE:-2000}
+VMS=${VMS:-64}
+
+# OPTS come from enviroment, e.g. OPTS=--steplimit=1000000
+OPTS=${OPTS:-}
+
+### End of options ###
+set -e
+trap "exit" INT
+
+export LANG=C
+
+if [ -n "$1" ]
+then
+    VARIANTS=$@
+else
+    VARIANTS="switched predecoded translated"
+fi
+
+echo "# $VMS instances of $PROG from input $BASE, OPTS: $OPTS"
+echo "# variant MIPS"
+./lanes --inp-prog=$PROG --input=$BASE --vms=$VMS $OPTS | awk '
+    /^Executed/ { printf "lanes(%d) %s\n", $8, $13 }'
+for V in $VARIANTS
+do
+    # Process start is included, keep the runs long enough to hide it
+    START=`date +%s%N`
+    for I in `seq 0 $((VMS - 1))`
+    do
+        ./$V --inp-prog=$PROG --input=$((BASE + I)) $OPTS
+    done | awk -v v=$V -v start=$START '
+        /^CPU executed/ { steps += $3 }
+        END {
+            "date +%s%N" | getline end
+            printf "%s %.1f\n", v, steps / ((end - start) / 1e3)
+        }'
+done
@@ -0,0 +1,41 @@
+#!/usr/bin/env bash
+# A script to run a scheduler binary with a growing number of machines
+# and tabulate throughput and latency of machines finishing.
+# Dependencies: awk
+# Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+# Set COUNTS to numbers of machines to try
+COUNTS=${COUNTS:-"1 10 100 1000 10000 100000"}
+
+# Guest program run by every machine
+PROG=${PROG:-factorial.raw}
+
+# OPTS come from enviroment, e.g. OPTS=--slice=100
+# OPTS=
+
+### End of options ###
+set -e
+trap "exit" INT
+
+export LANG=C
+
+if [ -n "$1" ]
+then
+    VARIANTS=$@
+else
+    VARIANTS="sched-switched sched-predecoded sched-translated"
+fi
+
+echo "# Program: $PROG, OPTS: $OPTS"
+for V in $VARIANTS
+do
+    echo "# $V"
+    echo "# vms steps/s p50_ms p90_ms p99_ms max_ms"
+    for N in $COUNTS
+    do
+        ./$V --vms=$N --inp-prog=$PROG ${OPTS} | awk -v vms=$N '
+            /^Executed/ { rate = $7 }
+            /^Latency/ { p50 = $4; p90 = $6; p99 = $8; max = $10 }
+            END { print vms, rate, p50, p90, p99, max }'
+    done
+done
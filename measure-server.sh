@@ -0,0 +1,52 @@
+#!/usr/bin/env bash
+# A script to compare the cost of one run of a program in a new process,
+# in a child of a fork server and inside a long-lived server.
+# Dependencies: awk, date
+# Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+# Set NRUN to number of runs for each way
+NRUN=${NRUN:-1000}
+
+# OPTS are given to the variants and to loadgen. The default program
+# uses only instructions supported by all variants.
+OPTS=${OPTS:---steplimit=1000}
+
+SOCKET=/tmp/interpreters-comparison-$$.sock
+
+### End of options ###
+set -e
+trap "rm -f $SOCKET; exit" INT
+
+export LANG=C
+
+if [ -n "$1" ]
+then
+    VARIANTS=$@
+else
+    VARIANTS="switched threaded predecoded subroutined threaded-cached tailrecursive asmopt asmexp translated"
+fi
+
+# Microseconds per request reported by loadgen
+serve() {
+    ./server-$1 --socket=$SOCKET $2 2>/dev/null &
+    local PID=$!
+    while [ ! -S $SOCKET ]; do sleep 0.01; done
+    ./loadgen --socket=$SOCKET --requests=$NRUN ${OPTS} \
+        | awk '/^Sent/ { printf "%.1f", 1e6 / $10 }'
+    kill $PID
+    wait $PID || true
+}
+
+echo "# $NRUN runs, OPTS: $OPTS, microseconds per run"
+echo "# variant exec fork server"
+for V in $VARIANTS
+do
+    START=`date +%s%N`
+    for N in `seq 1 $NRUN`
+    do
+        ./$V ${OPTS} > /dev/null || true
+    done
+    END=`date +%s%N`
+    EXEC=`echo $START $END $NRUN | awk '{printf "%.1f", ($2 - $1) / 1e3 / $3}'`
+    echo $V $EXEC `serve $V --fork` `serve $V`
+done
@@ -0,0 +1,58 @@
+#!/usr/bin/env bash
+# A script to measure how long variants take to prepare a large program,
+# decoding or translating it on a growing number of threads.
+# Dependencies: awk, date
+# Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+# Set THREADS to numbers of threads to try, up to all CPUs by default
+NCPU=`getconf _NPROCESSORS_ONLN`
+THREADS=${THREADS:-`awk -v n=$NCPU 'BEGIN {for (t = 1; t < n; t *= 2) printf "%d ", t; print n}'`}
+
+# The large program is PROG repeated 2^DOUBLINGS times
+PROG=${PROG:-factorial.raw}
+DOUBLINGS=${DOUBLINGS:-16}
+
+# Runs of every configuration, the fastest one is reported
+RUNS=${RUNS:-3}
+
+### End of options ###
+set -e
+trap 'rm -f $BIG $BIG.tmp; exit' INT EXIT
+
+export LANG=C
+
+if [ -n "$1" ]
+then
+    VARIANTS=$@
+else
+    VARIANTS="predecoded threaded-cached translated"
+fi
+
+BIG=`mktemp`
+cp $PROG $BIG
+for I in `seq 1 $DOUBLINGS`
+do
+    cat $BIG $BIG > $BIG.tmp
+    mv $BIG.tmp $BIG
+done
+
+echo "# $PROG x 2^$DOUBLINGS, `stat -c %s $BIG` bytes, one step"
+for V in $VARIANTS
+do
+    echo "# $V"
+    echo "# threads ms"
+    # Zero threads is the default: lazy decoding and translation
+    for T in 0 $THREADS
+    do
+        BEST=
+        for R in `seq 1 $RUNS`
+        do
+            START=`date +%s%N`
+            ./$V --inp-prog=$BIG --steplimit=1 --decode-threads=$T > /dev/null
+            END=`date +%s%N`
+            BEST=`echo $START $END $BEST | awk '{
+                t = ($2 - $1) / 1e6; if ($3 != "" && $3 < t) t = $3; printf "%.1f\n", t }'`
+        done
+        echo $T $BEST
+    done
+done
@@ -0,0 +1,488 @@
+/*  output.c - output of the Print instruction, written by a thread of
+    its own
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* make STACK_GUARD=1 defines it too */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "output.h"
+
+/* Entries in the ring of one thread, a power of two */
+#define RING_ENTRIES 4096
+
+/* Formatted output is written in blocks of up to this many bytes */
+#define OUTPUT_BUFFER (64 * 1024)
+
+/* The writer empties the rings this often, or as soon as one of them is
+   half full */
+#define WRITER_PERIOD_NS 10000000
+
+typedef struct {
+    const char *msg; /* NULL for a value */
+    int32_t value;
+} entry_t;
+
+typedef struct ring {
+    entry_t entries[RING_ENTRIES];
+    /* Entries queued, advanced by the owner only */
+    uint64_t tail __attribute__((aligned(64)));
+    /* Entries taken by the writer, advanced by it only */
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t written; /* Of those, entries out of the process */
+    int free;         /* The owner has exited, under lock */
+    struct ring *next;
+} ring_t;
+
+/* Guards the list of rings, the state of the writer and written counts */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+/* Broadcast after every write, to threads waiting for room or a flush */
+static pthread_cond_t progress = PTHREAD_COND_INITIALIZER;
+static ring_t *rings; /* Never unlinked, a new one goes first */
+static output_mode_t mode = Output_Auto; /* Resolved by the first Print */
+static int no_rings; /* Set once Print is known to write or store itself */
+static int started;
+static int direct; /* No writer thread, threads write out their own rings */
+static int registered;
+static int stopping;
+static pthread_t writer;
+static sem_t wake;
+static pthread_key_t ring_key; /* Frees the ring of an exiting thread */
+static _Thread_local ring_t *own;
+
+/* Used by the writer only, or in direct mode with drain_lock held */
+static char buffer[OUTPUT_BUFFER];
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void write_all(const char *buf, size_t len) {
+    while (len) {
+        ssize_t done = write(STDOUT_FILENO, buf, len);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            /* The writer blocks all signals, give SIGPIPE to the process
+               as a write of the guest thread would */
+            if (errno == EPIPE)
+                kill(getpid(), SIGPIPE);
+            return;
+        }
+        buf += done;
+        len -= done;
+    }
+}
+
+/* "00" to "99" for formatting two digits at a time */
+static const char digit_pairs[201] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+size_t format_value(char *out, int32_t value) {
+    char text[MAX_VALUE_TEXT];
+    char *p = text + sizeof(text);
+    *--p = '\n';
+    *--p = ']';
+    uint32_t u = value < 0 ? -(uint32_t)value : (uint32_t)value;
+    while (u >= 100) {
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * (u % 100), 2);
+        u /= 100;
+    }
+    if (u >= 10) {
+        p -= 2;
+        memcpy(p, digit_pairs + 2 * u, 2);
+    } else {
+        *--p = '0' + u;
+    }
+    if (value < 0)
+        *--p = '-';
+    *--p = '[';
+    const size_t len = text + sizeof(text) - p;
+    memcpy(out, p, len);
+    return len;
+}
+
+/* Write what is in the buffer, then let waiting threads know which of
+   their entries are out */
+static size_t write_out(ring_t *list, size_t len) {
+    write_all(buffer, len);
+    pthread_mutex_lock(&lock);
+    for (ring_t *r = list; r; r = r->next)
+        __atomic_store_n(&r->written, r->head, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&progress);
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+static void drain(void) {
+    pthread_mutex_lock(&lock);
+    ring_t *const list = rings;
+    pthread_mutex_unlock(&lock);
+
+    size_t len = 0;
+    for (ring_t *r = list; r; r = r->next) {
+        const uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        for (uint64_t head = r->head; head != tail; head++) {
+            const entry_t e = r->entries[head % RING_ENTRIES];
+            if (e.msg) {
+                const size_t n = strlen(e.msg);
+                if (len + n > OUTPUT_BUFFER)
+                    len = write_out(list, len);
+                if (n > OUTPUT_BUFFER) {
+                    write_all(e.msg, n);
+                } else {
+                    memcpy(buffer + len, e.msg, n);
+                    len += n;
+                }
+            } else {
+                if (len + MAX_VALUE_TEXT > OUTPUT_BUFFER)
+                    len = write_out(list, len);
+                len += format_value(buffer + len, e.value);
+            }
+            __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    write_out(list, len);
+}
+
+/* Without a writer any thread may drain, one at a time: drain() owns
+   buffer and the heads of all rings */
+static void drain_direct(void) {
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void *writer_main(void *arg) {
+    (void)arg;
+    for (;;) {
+        const int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+        drain();
+        if (stop)
+            return NULL;
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += WRITER_PERIOD_NS;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        while (sem_timedwait(&wake, &deadline) && errno == EINTR)
+            ;
+    }
+}
+
+/* Wait until the writer has everything queued in r so far out */
+static void flush_ring(ring_t *r) {
+    const uint64_t tail = r->tail;
+    if (__atomic_load_n(&r->written, __ATOMIC_ACQUIRE) == tail)
+        return;
+    if (direct) {
+        drain_direct();
+        return;
+    }
+    sem_post(&wake);
+    pthread_mutex_lock(&lock);
+    while (__atomic_load_n(&r->written, __ATOMIC_ACQUIRE) != tail)
+        pthread_cond_wait(&progress, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+void flush_output(void) {
+    if (own)
+        flush_ring(own);
+}
+
+static void release_ring(void *arg) {
+    ring_t *r = arg;
+    flush_ring(r);
+    pthread_mutex_lock(&lock);
+    r->free = 1;
+    pthread_mutex_unlock(&lock);
+}
+
+static void stop_writer(void) {
+    pthread_mutex_lock(&lock);
+    const int running = started;
+    started = 0;
+    pthread_mutex_unlock(&lock);
+    if (direct)
+        drain_direct();
+    if (!running)
+        return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    sem_post(&wake);
+    pthread_join(writer, NULL);
+}
+
+/* Everything queued goes out before a fork. The child has no writer
+   thread and does not start one, which would cost more than a short-lived
+   child saves: its threads write out their rings when they flush or the
+   ring is full */
+static void before_fork(void) {
+    pthread_mutex_lock(&drain_lock); /* Not in the middle of a drain */
+    pthread_mutex_lock(&lock);
+    if (!started)
+        return;
+    sem_post(&wake);
+    for (ring_t *r = rings; r; r = r->next) {
+        const uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        while (__atomic_load_n(&r->written, __ATOMIC_ACQUIRE) < tail)
+            pthread_cond_wait(&progress, &lock);
+    }
+}
+
+static void after_fork_in_parent(void) {
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+static void after_fork_in_child(void) {
+    started = 0;
+    direct = 1;
+    own = NULL;
+    for (ring_t *r = rings; r; r = r->next)
+        r->free = 1;
+    pthread_cond_init(&progress, NULL);
+    pthread_mutex_unlock(&lock);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+/* Called with lock held */
+static void start_writer(void) {
+    if (!registered) {
+        if (pthread_key_create(&ring_key, release_ring)) {
+            fprintf(stderr, "Failed to create a thread key.\n");
+            exit(2);
+        }
+        atexit(stop_writer);
+        pthread_atfork(before_fork, after_fork_in_parent,
+                       after_fork_in_child);
+        registered = 1;
+    }
+    stopping = 0;
+    sem_init(&wake, 0, 0);
+    /* Signals such as the timeout are for the threads running guests */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    errno = pthread_create(&writer, NULL, writer_main, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (errno) {
+        perror("pthread_create");
+        exit(2);
+    }
+    started = 1;
+}
+
+/* The binary output file is mapped into a range of address space reserved
+   up front, one step at a time. Mapped memory never moves, so threads store
+   values without a lock */
+#define OUTPUT_FILE_RESERVE (1ull << 36)
+#define OUTPUT_FILE_STEP (4u << 20)
+
+static const char *file_path;
+static uint64_t file_hash;
+static int file_fd = -1;
+static char *file_base;   /* Header of the file, then the values */
+static size_t file_mapped; /* Bytes of it mapped */
+
+static output_header_t *file_header(void) {
+    return (output_header_t *)file_base;
+}
+
+/* Map more of the file until end bytes are mapped, called with lock held */
+static void grow_file(size_t end) {
+    while (file_mapped < end) {
+        const size_t size = file_mapped + OUTPUT_FILE_STEP;
+        struct stat st;
+        if (size > OUTPUT_FILE_RESERVE || fstat(file_fd, &st)
+            || ((size_t)st.st_size < size && ftruncate(file_fd, size))
+            || mmap(file_base + file_mapped, OUTPUT_FILE_STEP,
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, file_fd,
+                    file_mapped) == MAP_FAILED) {
+            perror(file_path);
+            exit(2);
+        }
+        __atomic_store_n(&file_mapped, size, __ATOMIC_RELEASE);
+    }
+}
+
+static void open_file(void);
+
+/* Cut the file to the values stored and let go of it */
+static void close_file(void) {
+    pthread_mutex_lock(&lock);
+    if (!file_base)
+        open_file(); /* Nothing was printed */
+    if (file_base) {
+        const uint64_t count = file_header()->count;
+        if (ftruncate(file_fd, sizeof(output_header_t)
+                               + count * sizeof(int32_t)))
+            perror(file_path);
+        munmap(file_base, OUTPUT_FILE_RESERVE);
+        close(file_fd);
+        file_base = NULL;
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+/* Called with lock held */
+static void open_file(void) {
+    file_fd = open(file_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (file_fd < 0) {
+        perror(file_path);
+        exit(2);
+    }
+    file_base = mmap(NULL, OUTPUT_FILE_RESERVE, PROT_NONE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (file_base == MAP_FAILED) {
+        perror("mmap");
+        exit(2);
+    }
+    grow_file(sizeof(output_header_t));
+    *file_header() = (output_header_t){.magic = OUTPUT_FILE_MAGIC,
+                                       .version = OUTPUT_FILE_VERSION,
+                                       .hash = file_hash, .count = 0};
+}
+
+static void store_value(int32_t value) {
+    const uint64_t slot = __atomic_fetch_add(&file_header()->count, 1,
+                                             __ATOMIC_RELAXED);
+    const size_t end = sizeof(output_header_t) + (slot + 1) * sizeof(int32_t);
+    if (end > __atomic_load_n(&file_mapped, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&lock);
+        grow_file(end);
+        pthread_mutex_unlock(&lock);
+    }
+    ((int32_t *)(file_header() + 1))[slot] = value;
+}
+
+void set_output_file(const char *path, uint64_t program_hash) {
+    if (file_path == NULL)
+        atexit(close_file);
+    file_path = path;
+    file_hash = program_hash;
+}
+
+void set_output_mode(output_mode_t m) {
+    mode = m;
+}
+
+/* Returns NULL if Print does not go through the rings */
+static ring_t *attach_ring(void) {
+    if (__atomic_load_n(&no_rings, __ATOMIC_ACQUIRE))
+        return NULL;
+    pthread_mutex_lock(&lock);
+    if (file_path && !file_base)
+        open_file();
+    if (mode == Output_Auto)
+        mode = isatty(STDOUT_FILENO) ? Output_Line : Output_Block;
+    if (file_path || mode == Output_Line) {
+        __atomic_store_n(&no_rings, 1, __ATOMIC_RELEASE);
+        pthread_mutex_unlock(&lock);
+        return NULL;
+    }
+    if (!started && !direct)
+        start_writer();
+    ring_t *r = rings;
+    while (r && !r->free)
+        r = r->next;
+    if (r) {
+        r->free = 0;
+    } else {
+        void *mem = NULL;
+        if (posix_memalign(&mem, 64, sizeof(ring_t))) {
+            fprintf(stderr, "Failed to allocate memory for output.\n");
+            exit(2);
+        }
+        r = memset(mem, 0, sizeof(ring_t));
+        r->next = rings;
+        rings = r;
+    }
+    pthread_mutex_unlock(&lock);
+    pthread_setspecific(ring_key, r);
+    own = r;
+    return r;
+}
+
+static void wait_for_room(ring_t *r, uint64_t tail) {
+    if (direct) {
+        drain_direct();
+        return;
+    }
+    sem_post(&wake);
+    pthread_mutex_lock(&lock);
+    while (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_ENTRIES)
+        pthread_cond_wait(&progress, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+static inline void put(const char *msg, int32_t value) {
+    ring_t *r = own;
+    if (r == NULL && (r = attach_ring()) == NULL) {
+        char text[MAX_VALUE_TEXT];
+        if (msg)
+            write_all(msg, strlen(msg));
+        else if (file_path)
+            store_value(value);
+        else
+            write_all(text, format_value(text, value));
+        return;
+    }
+    const uint64_t tail = r->tail;
+    if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == RING_ENTRIES)
+        wait_for_room(r, tail);
+    r->entries[tail % RING_ENTRIES] = (entry_t){.msg = msg, .value = value};
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    if ((tail + 1) % (RING_ENTRIES / 2) == 0 && !direct)
+        sem_post(&wake);
+}
+
+void print_value(int32_t value) {
+    put(NULL, value);
+}
+
+void print_message(const char *msg) {
+    put(msg, 0);
+}
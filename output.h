@@ -0,0 +1,84 @@
+/*  output.h - output of the Print instruction, written by a thread of
+    its own
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#ifndef OUTPUT_H_
+#define OUTPUT_H_
+
+/* Print only stores a value in a ring buffer of the calling thread. A
+   writer thread empties the rings of all threads, formats the values as
+   "[%d]\n" and writes them to stdout in large blocks. Nothing in the
+   rings is locked: each has one producer, its thread, and one consumer,
+   the writer. That is the block mode. In line mode, for interactive use,
+   Print formats its value and writes it at once, with no thread. */
+void print_value(int32_t value);
+
+/* Queue a string to go out in order with the values, for diagnostics of
+   guests. It must stay valid until written, a literal is fine */
+void print_message(const char *msg);
+
+/* Wait until everything the calling thread queued has been written.
+   Variants call it when a guest halts or breaks, and anything left in
+   the rings is written at exit. */
+void flush_output(void);
+
+/* Make Print store raw values in a binary file instead, see below. The
+   file is created by the first Print or at exit. Diagnostics still go to
+   stdout as text. parse_args() calls it for --out-bin */
+void set_output_file(const char *path, uint64_t program_hash);
+
+/* Choose the mode before anything is printed. parse_args() sets the one of
+   --output, and Output_Auto picks line mode if stdout is a terminal */
+void set_output_mode(output_mode_t mode);
+
+/* A binary output file is this header and count int32_t values in host
+   byte order. The file is mapped into memory and grows in large steps,
+   so a value costs a store and no system call. readbin turns it into the
+   text Print writes otherwise. */
+#define OUTPUT_FILE_MAGIC 0x54554f56u /* "VOUT" */
+#define OUTPUT_FILE_VERSION 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t hash;  /* hash_program() of the program printing */
+    uint64_t count; /* Values that follow */
+} output_header_t;
+
+/* Longest text of a value, "[-2147483648]\n" */
+#define MAX_VALUE_TEXT 14
+
+/* Put the text of a value at out, returns its length */
+size_t format_value(char *out, int32_t value);
+
+#endif /* OUTPUT_H_ */
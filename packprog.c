@@ -0,0 +1,466 @@
+/*  packprog.c - converts raw programs of a stack virtual machine into
+    containers with precomputed analysis, and back.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "common.h"
+#include "container.h"
+
+/* Superinstruction candidates kept in a container */
+#define MAX_HINTS 16
+
+#define NUM_OPCODES (Instr_Pick + 1)
+
+static inline decode_t decode_at_address(const Instr_t* prog,
+                                         uint32_t len, uint32_t addr) {
+    decode_t result = {0};
+    Instr_t raw_instr = prog[addr];
+    result.opcode = raw_instr;
+    switch (raw_instr) {
+    case Instr_Nop:
+    case Instr_Halt:
+    case Instr_Print:
+    case Instr_Swap:
+    case Instr_Dup:
+    case Instr_Inc:
+    case Instr_Add:
+    case Instr_Sub:
+    case Instr_Mul:
+    case Instr_Rand:
+    case Instr_Dec:
+    case Instr_Drop:
+    case Instr_Over:
+    case Instr_Mod:
+    case Instr_And:
+    case Instr_Or:
+    case Instr_Xor:
+    case Instr_SHL:
+    case Instr_SHR:
+    case Instr_Rot:
+    case Instr_SQRT:
+    case Instr_Pick:
+        result.length = 1;
+        break;
+    case Instr_Push:
+    case Instr_JNE:
+    case Instr_JE:
+    case Instr_Jump:
+        result.length = 2;
+        if (!(addr+1 < len)) {
+            result.length = 1;
+            result.opcode = Instr_Break;
+            break;
+        }
+        result.immediate = (int32_t)prog[addr+1];
+        break;
+    case Instr_Break:
+    default: /* Undefined instructions equal to Break */
+        result.length = 1;
+        result.opcode = Instr_Break;
+        break;
+    }
+    return result;
+}
+
+/* Words an instruction leaves on the stack minus those it takes */
+static int stack_effect(Instr_t opcode) {
+    switch (opcode) {
+    case Instr_Push: case Instr_Dup: case Instr_Over: case Instr_Rand:
+        return 1;
+    case Instr_Print: case Instr_JE: case Instr_JNE: case Instr_Drop:
+    case Instr_Add: case Instr_Sub: case Instr_Mul: case Instr_Mod:
+    case Instr_And: case Instr_Or: case Instr_Xor:
+    case Instr_SHL: case Instr_SHR:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+static bool is_branch(Instr_t opcode) {
+    return opcode == Instr_JE || opcode == Instr_JNE || opcode == Instr_Jump;
+}
+
+static bool ends_block(Instr_t opcode) {
+    return is_branch(opcode) || opcode == Instr_Halt
+           || opcode == Instr_Break;
+}
+
+/* Target of a branch at pc, or len if it leaves the program */
+static uint32_t branch_target(uint32_t pc, const decode_t *d, uint32_t len) {
+    const int64_t target = (int64_t)pc + d->length + d->immediate;
+    return target >= 0 && target < len ? (uint32_t)target : len;
+}
+
+static void *alloc_or_exit(size_t n, size_t size) {
+    void *p = calloc(n ? n : 1, size);
+    if (p == NULL) {
+        fprintf(stderr, "Failed to allocate memory for analysis.\n");
+        exit(2);
+    }
+    return p;
+}
+
+/* Instruction starts are found by decoding from PC 0 on, as the engines
+   do. Blocks start at PC 0, at branch targets and after instructions that
+   end a block. */
+static uint32_t *find_blocks(const Instr_t *code, uint32_t len,
+                             uint32_t *nblocks) {
+    bool *leader = alloc_or_exit(len + 1, sizeof(bool));
+    if (len)
+        leader[0] = true;
+    for (uint32_t pc = 0; pc < len; ) {
+        const decode_t d = decode_at_address(code, len, pc);
+        if (is_branch(d.opcode))
+            leader[branch_target(pc, &d, len)] = true;
+        pc += d.length;
+        if (ends_block(d.opcode))
+            leader[pc < len ? pc : len] = true;
+    }
+    uint32_t n = 0;
+    for (uint32_t pc = 0; pc < len; pc++)
+        n += leader[pc];
+    uint32_t *blocks = alloc_or_exit(n, sizeof(uint32_t));
+    n = 0;
+    for (uint32_t pc = 0; pc < len; pc++)
+        if (leader[pc])
+            blocks[n++] = pc;
+    free(leader);
+    *nblocks = n;
+    return blocks;
+}
+
+/* Stack depth before every instruction reachable from PC 0. Where paths
+   with different depths meet, the depth is unknown from there on */
+static int32_t *find_stack_depths(const Instr_t *code, uint32_t len) {
+    int32_t *depth = alloc_or_exit(len, sizeof(int32_t));
+    bool *seen = alloc_or_exit(len, sizeof(bool));
+    uint32_t *work = alloc_or_exit(len, sizeof(uint32_t));
+    bool *queued = alloc_or_exit(len, sizeof(bool));
+    for (uint32_t pc = 0; pc < len; pc++)
+        depth[pc] = STACK_DEPTH_UNKNOWN;
+    uint32_t nwork = 0;
+    if (len) {
+        seen[0] = queued[0] = true;
+        depth[0] = 0;
+        work[nwork++] = 0;
+    }
+    while (nwork) {
+        const uint32_t pc = work[--nwork];
+        queued[pc] = false;
+        const decode_t d = decode_at_address(code, len, pc);
+        const int32_t out = depth[pc] == STACK_DEPTH_UNKNOWN
+                            ? STACK_DEPTH_UNKNOWN
+                            : depth[pc] + stack_effect(d.opcode);
+        uint32_t next[2];
+        int nnext = 0;
+        if (d.opcode != Instr_Halt && d.opcode != Instr_Break
+            && d.opcode != Instr_Jump && pc + d.length < len)
+            next[nnext++] = pc + d.length;
+        if (is_branch(d.opcode) && branch_target(pc, &d, len) < len)
+            next[nnext++] = branch_target(pc, &d, len);
+        for (int i = 0; i < nnext; i++) {
+            const uint32_t to = next[i];
+            int32_t merged = out;
+            if (seen[to] && depth[to] != out)
+                merged = STACK_DEPTH_UNKNOWN;
+            if (seen[to] && depth[to] == merged)
+                continue;
+            seen[to] = true;
+            depth[to] = merged;
+            if (!queued[to]) {
+                queued[to] = true;
+                work[nwork++] = to;
+            }
+        }
+    }
+    free(seen);
+    free(work);
+    free(queued);
+    return depth;
+}
+
+typedef struct {
+    uint32_t pc;
+    uint32_t size;
+} loop_t;
+
+static int by_size(const void *a, const void *b) {
+    const loop_t *x = a, *y = b;
+    return x->size != y->size ? (x->size > y->size) - (x->size < y->size)
+                              : (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+/* Without a profile, heads of loops are the best guess of hot code, and
+   inner loops are usually the smaller ones */
+static uint32_t *find_hot_pcs(const Instr_t *code, uint32_t len,
+                              uint32_t *nhot) {
+    loop_t *loops = alloc_or_exit(len, sizeof(loop_t));
+    uint32_t n = 0;
+    for (uint32_t pc = 0; pc < len; ) {
+        const decode_t d = decode_at_address(code, len, pc);
+        const uint32_t target = is_branch(d.opcode)
+                                ? branch_target(pc, &d, len) : len;
+        if (target <= pc)
+            loops[n++] = (loop_t){.pc = target, .size = pc - target};
+        pc += d.length;
+    }
+    qsort(loops, n, sizeof(loop_t), by_size);
+    uint32_t *hot = alloc_or_exit(n, sizeof(uint32_t));
+    bool *listed = alloc_or_exit(len, sizeof(bool));
+    uint32_t nh = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        if (!listed[loops[i].pc])
+            hot[nh++] = loops[i].pc;
+        listed[loops[i].pc] = true;
+    }
+    free(listed);
+    free(loops);
+    *nhot = nh;
+    return hot;
+}
+
+typedef struct {
+    uint32_t first, second, count;
+} pair_t;
+
+static int by_count(const void *a, const void *b) {
+    const pair_t *x = a, *y = b;
+    return (x->count < y->count) - (x->count > y->count);
+}
+
+/* Pairs of opcodes following each other within blocks, most frequent
+   first */
+static uint32_t *find_hints(const Instr_t *code, uint32_t len,
+                            const uint32_t *blocks, uint32_t nblocks,
+                            uint32_t *nhints) {
+    pair_t pairs[NUM_OPCODES * NUM_OPCODES];
+    for (int i = 0; i < NUM_OPCODES * NUM_OPCODES; i++)
+        pairs[i] = (pair_t){.first = i / NUM_OPCODES,
+                            .second = i % NUM_OPCODES, .count = 0};
+    uint32_t b = 0;
+    Instr_t prev = Instr_Break; /* Ends a block, so pairs with nothing */
+    for (uint32_t pc = 0; pc < len; ) {
+        while (b < nblocks && blocks[b] < pc)
+            b++;
+        const decode_t d = decode_at_address(code, len, pc);
+        if (!(b < nblocks && blocks[b] == pc) && !ends_block(prev))
+            pairs[prev * NUM_OPCODES + d.opcode].count++;
+        prev = d.opcode;
+        pc += d.length;
+    }
+    qsort(pairs, NUM_OPCODES * NUM_OPCODES, sizeof(pair_t), by_count);
+    uint32_t n = 0;
+    while (n < MAX_HINTS && pairs[n].count > 1)
+        n++;
+    uint32_t *hints = alloc_or_exit(3 * n, sizeof(uint32_t));
+    for (uint32_t i = 0; i < n; i++) {
+        hints[3 * i] = pairs[i].first;
+        hints[3 * i + 1] = pairs[i].second;
+        hints[3 * i + 2] = pairs[i].count;
+    }
+    *nhints = n;
+    return hints;
+}
+
+/* Bytes of the shortest signed LEB128 of v */
+static uint32_t sleb_length(int64_t v) {
+    uint32_t n = 1;
+    while (v < -64 || v > 63) {
+        v >>= 7;
+        n++;
+    }
+    return n;
+}
+
+/* Signed LEB128 of v in exactly n bytes, which must be enough */
+static void put_sleb(uint8_t *p, int32_t v, uint32_t n) {
+    for (uint32_t i = 0; i + 1 < n; i++) {
+        p[i] = (v & 0x7f) | 0x80;
+        v >>= 7;
+    }
+    p[n - 1] = v & 0x7f;
+}
+
+/* Encode a program as compact code. Branches start near and only grow
+   until every displacement fits, so that the loop ends. Compact code
+   cannot express branches into an immediate or out of the program. */
+static uint8_t *make_compact(const Instr_t *code, uint32_t len,
+                             uint32_t *size) {
+    uint32_t *starts = alloc_or_exit(len + 1, sizeof(uint32_t));
+    uint32_t *index = alloc_or_exit(len + 1, sizeof(uint32_t));
+    decode_t *instrs = alloc_or_exit(len, sizeof(decode_t));
+    uint32_t n = 0;
+    for (uint32_t pc = 0; pc <= len; pc++)
+        index[pc] = UINT32_MAX;
+    for (uint32_t pc = 0; pc < len; ) {
+        index[pc] = n;
+        starts[n] = pc;
+        instrs[n] = decode_at_address(code, len, pc);
+        pc += instrs[n++].length;
+    }
+    index[len] = n;
+
+    uint32_t *target = alloc_or_exit(n, sizeof(uint32_t));
+    uint32_t *bytes = alloc_or_exit(n, sizeof(uint32_t));
+    uint64_t *offset = alloc_or_exit(n + 1, sizeof(uint64_t));
+    for (uint32_t i = 0; i < n; i++) {
+        const decode_t *d = &instrs[i];
+        bytes[i] = 1;
+        if (d->opcode == Instr_Push && (d->immediate < -16
+                                        || d->immediate > 111))
+            bytes[i] = 1 + sleb_length(d->immediate);
+        if (!is_branch(d->opcode))
+            continue;
+        const int64_t t = (int64_t)starts[i] + d->length + d->immediate;
+        if (t < 0 || t > len || index[t] == UINT32_MAX) {
+            fprintf(stderr, "The branch at PC %u leads to %lld, which "
+                            "compact code cannot express\n",
+                    starts[i], (long long)t);
+            exit(2);
+        }
+        target[i] = index[t];
+        bytes[i] = 2;
+    }
+    for (bool grown = true; grown; ) {
+        grown = false;
+        for (uint32_t i = 0; i < n; i++)
+            offset[i + 1] = offset[i] + bytes[i];
+        for (uint32_t i = 0; i < n; i++) {
+            if (!is_branch(instrs[i].opcode))
+                continue;
+            const int64_t disp = (int64_t)offset[target[i]] - offset[i + 1];
+            uint32_t need = 1 + sleb_length(disp);
+            if (bytes[i] == 2 && disp >= INT8_MIN && disp <= INT8_MAX)
+                need = 2;
+            else if (need < 3)
+                need = 3; /* Not near any more */
+            if (need > bytes[i]) {
+                bytes[i] = need;
+                grown = true;
+            }
+        }
+    }
+    if (offset[n] > UINT32_MAX / 2 - 1) {
+        fprintf(stderr, "The program is too large for compact code\n");
+        exit(2);
+    }
+
+    uint8_t *out = alloc_or_exit(offset[n], 1);
+    for (uint32_t i = 0; i < n; i++) {
+        const decode_t *d = &instrs[i];
+        uint8_t *p = out + offset[i];
+        const int32_t disp = is_branch(d->opcode)
+                             ? offset[target[i]] - offset[i + 1] : 0;
+        if (d->opcode == Instr_Push && bytes[i] == 1) {
+            p[0] = d->immediate + COMPACT_PUSH_BIAS;
+        } else if (d->opcode == Instr_Push) {
+            p[0] = Instr_Push;
+            put_sleb(p + 1, d->immediate, bytes[i] - 1);
+        } else if (is_branch(d->opcode) && bytes[i] == 2) {
+            p[0] = COMPACT_NEAR + d->opcode;
+            p[1] = (uint8_t)(int8_t)disp;
+        } else if (is_branch(d->opcode)) {
+            p[0] = d->opcode;
+            put_sleb(p + 1, disp, bytes[i] - 1);
+        } else {
+            p[0] = d->opcode;
+        }
+    }
+    *size = offset[n];
+    free(starts);
+    free(index);
+    free(instrs);
+    free(target);
+    free(bytes);
+    free(offset);
+    return out;
+}
+
+static void usage(const char *name, int ret) {
+    fprintf(stderr, "Usage: %s [--compact] <program> <container>\n"
+                    "       %s --raw <program or container> <raw program>\n",
+            name, name);
+    exit(ret);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && !strcmp(argv[1], "--help"))
+        usage(argv[0], 0);
+    const bool raw = argc == 4 && !strcmp(argv[1], "--raw");
+    const bool compact = argc == 4 && !strcmp(argv[1], "--compact");
+    if (argc != 3 && !raw && !compact)
+        usage(argv[0], 2);
+    const char *in = argv[argc - 2], *out = argv[argc - 1];
+
+    uint32_t len = 0;
+    Instr_t *code = read_program(in, &len);
+    if (raw) {
+        write_program(code, len, out);
+        free_program(code, len);
+        return 0;
+    }
+
+    program_info_t info = {0};
+    uint32_t *blocks = find_blocks(code, len, &info.nblocks);
+    int32_t *depth = find_stack_depths(code, len);
+    uint32_t *hot = find_hot_pcs(code, len, &info.nhot_pcs);
+    uint32_t *hints = find_hints(code, len, blocks, info.nblocks,
+                                 &info.nhints);
+    info.blocks = blocks;
+    info.stack_depth = depth;
+    info.hot_pcs = hot;
+    info.hints = hints;
+    compact_t bytes = {0};
+    if (compact) {
+        bytes.code = make_compact(code, len, &bytes.size);
+        bytes.len = len;
+        info.compact = &bytes;
+    }
+    if (write_container(out, code, len, &info)) {
+        perror(out);
+        exit(2);
+    }
+    printf("%u words, %u blocks, %u loop heads, %u superinstruction hints\n",
+           len, info.nblocks, info.nhot_pcs, info.nhints);
+    if (compact)
+        printf("%u bytes of compact code\n", bytes.size);
+
+    free(blocks);
+    free(depth);
+    free(hot);
+    free(hints);
+    free((void *)bytes.code);
+    free_program(code, len);
+    return 0;
+}
@@ -36,9 +36,22 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "checkpoint.h"
+#include "output.h"
+#include "sharedcode.h"
+#include "vm.h"
 
-static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
-    assert(addr < PROGRAM_SIZE);
+struct vm {
+    cpu_t cpu;
+    shared_code_t *shared; /* Decoded program, shared by all machines */
+    decode_t *decoded_cache;
+    cpu_t *volatile running; /* Copy of cpu used by vm_run(), if any */
+    volatile sig_atomic_t preempted;
+};
+
+static inline decode_t decode_at_address(const Instr_t* prog,
+                                         uint32_t len, uint32_t addr) {
+    assert(addr < len);
     decode_t result = {0};
     Instr_t raw_instr = prog[addr];
     result.opcode = raw_instr;
@@ -72,7 +85,7 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
     case Instr_JE:
     case Instr_Jump:
         result.length = 2;
-        if (!(addr+1 < PROGRAM_SIZE)) {
+        if (!(addr+1 < len)) {
             result.length = 1;
             result.opcode = Instr_Break;
             break;
@@ -89,22 +102,25 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
 }
 
 /*** Service routines ***/
-#define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) break;
+#define BAIL_ON_ERROR() if (pcpu->state != Cpu_Running) break;
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
+    STACK_BARRIER();
+#ifndef STACK_GUARD
+    if (pcpu->sp >= pcpu->stack_capacity-1 && !grow_stack(pcpu)) {
+        print_message("Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
     }
+#endif
     pcpu->stack[++pcpu->sp] = v;
 }
 
 static inline uint32_t pop(cpu_t *pcpu) {
     assert(pcpu);
     if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
+        print_message("Stack underflow\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -114,38 +130,113 @@ static inline uint32_t pop(cpu_t *pcpu) {
 static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
     assert(pcpu);
     if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
+        print_message("Out of bound picking\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
     return pcpu->stack[pcpu->sp - pos];
 }
 
-static void predecode_program(const Instr_t *prog,
-                           decode_t *dec, int len) {
-    assert(prog);
-    assert(dec);
-    /* The program is short, so we can decode it as a whole.
-       Otherwise, some sort of lazy decoding will be required */
-    for (int i=0; i < len; i++) {
-        dec[i] = decode_at_address(prog, i);
+/* Unless --decode-threads asks to decode the whole program first, an
+   address is decoded when it is first reached. Entries start zeroed, that
+   is as Break, and Break decodes its address again to tell whether it is
+   one. Machines of several threads may decode the same address at once.
+   They store the same values, the opcode last, so an entry read by
+   load_slot() with another opcode is complete */
+static inline decode_t load_slot(const decode_t *slot) {
+    decode_t result;
+    result.opcode = __atomic_load_n(&slot->opcode, __ATOMIC_ACQUIRE);
+    result.length = slot->length;
+    result.immediate = slot->immediate;
+    return result;
+}
+
+static void store_slot(decode_t *slot, decode_t decoded) {
+    slot->length = decoded.length;
+    slot->immediate = decoded.immediate;
+    __atomic_store_n(&slot->opcode, decoded.opcode, __ATOMIC_RELEASE);
+}
+
+typedef struct {
+    const Instr_t *program;
+    uint32_t len;
+    decode_t *decoded;
+} decode_job_t;
+
+/* Every address is decoded on its own, so parts need no stitching */
+static void decode_part(void *arg, int part, uint32_t begin, uint32_t end) {
+    const decode_job_t *job = arg;
+    (void)part;
+    for (uint32_t i = begin; i < end; i++)
+        job->decoded[i] = decode_at_address(job->program, job->len, i);
+}
+
+/* arg points to the number of threads to decode on, zero to decode lazily.
+   Fresh pages are zeroed, so a lazy cache costs nothing until it is used */
+static void *build_decoded(shared_code_t *sc, void *arg) {
+    const uint32_t nthreads = *(const uint32_t *)arg;
+    decode_t *decoded = alloc_sealable(sc->len * sizeof(decode_t));
+    if (nthreads == 0)
+        return decoded;
+    decode_job_t job = {.program = sc->program, .len = sc->len,
+                        .decoded = decoded};
+    uint32_t bounds[MAX_PARTS + 1];
+    const int nparts = partition(sc->len, nthreads, bounds);
+    run_parts(nparts, bounds, decode_part, &job);
+    seal(decoded, sc->len * sizeof(decode_t));
+    return decoded;
+}
+
+static void destroy_decoded(shared_code_t *sc) {
+    free_sealable(sc->data, sc->len * sizeof(decode_t));
+}
+
+vm_t *vm_create(const Instr_t *program, uint32_t len, const options_t *opts) {
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (vm == NULL) {
+        fprintf(stderr, "Failed to allocate memory for virtual machine.\n");
+        exit(2);
     }
+    vm->shared = get_shared_code(program, len, NULL, 0);
+    if (opts == NULL)
+        opts = &DefOptions;
+    vm->decoded_cache = shared_code_data(vm->shared, build_decoded,
+                                         (void *)&opts->decode_threads);
+    vm->cpu = init_cpu(vm->shared->program, len, opts);
+    vm->running = NULL;
+    vm->preempted = 0;
+    return vm;
 }
 
-int main(int argc, char **argv) {
-    uint64_t steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
+void vm_preempt(vm_t *vm) {
+    vm->preempted = 1;
+    cpu_t *pcpu = vm->running;
+    if (pcpu)
+        pcpu->steplimit = 0;
+}
 
-    decode_t decoded_cache[PROGRAM_SIZE];
-    predecode_program(cpu.pmem, decoded_cache, PROGRAM_SIZE);
+/* Without counting, preemption is checked on taken branches only, as
+   every loop of the guest goes through one */
+#define TAKEN_BRANCH() \
+    if (!counted && pcpu->steps >= STEPLIMIT(pcpu)) { \
+        pcpu->pc += decoded.length; \
+        return; \
+    }
 
-    while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
-        if (!(cpu.pc < PROGRAM_SIZE)) {
-            printf("PC out of bounds\n");
-            cpu.state = Cpu_Break;
+/* The interpreter loop, vm_run() has a copy of it that counts steps and
+   one that does not */
+static inline __attribute__((always_inline))
+void interpret(cpu_t *pcpu, decode_t *decoded_cache, const int counted) {
+    if (!counted && pcpu->steps >= STEPLIMIT(pcpu))
+        return;
+    while (pcpu->state == Cpu_Running
+           && (!counted || pcpu->steps < STEPLIMIT(pcpu))) {
+        if (!(pcpu->pc < pcpu->pmem_size)) {
+            print_message("PC out of bounds\n");
+            pcpu->state = Cpu_Break;
             break;
         }
-        decode_t decoded = decoded_cache[cpu.pc];
+        decode_t decoded = load_slot(&decoded_cache[pcpu->pc]);
         uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
         /* Execute - a big switch */
         switch(decoded.opcode) {
@@ -153,171 +244,213 @@ int main(int argc, char **argv) {
             /* Do nothing */
             break;
         case Instr_Halt:
-            cpu.state = Cpu_Halted;
+            pcpu->state = Cpu_Halted;
             break;
         case Instr_Push:
-            push(&cpu, decoded.immediate);
+            push(pcpu, decoded.immediate);
             break;
         case Instr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
+            tmp1 = pop(pcpu); BAIL_ON_ERROR();
+            print_value(tmp1);
             break;
         case Instr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            push(pcpu, tmp1);
+            push(pcpu, tmp2);
             break;
         case Instr_Dup:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
+            push(pcpu, tmp1);
+            push(pcpu, tmp1);
             break;
         case Instr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            push(pcpu, tmp2);
+            push(pcpu, tmp1);
+            push(pcpu, tmp2);
             break;
         case Instr_Inc:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
+            push(pcpu, tmp1+1);
             break;
         case Instr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
+            push(pcpu, tmp1 + tmp2);
             break;
         case Instr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
+            push(pcpu, tmp1 - tmp2);
             break;
         case Instr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
             if (tmp2 == 0) {
-                cpu.state = Cpu_Break;
+                pcpu->state = Cpu_Break;
                 break;
             }
-            push(&cpu, tmp1 % tmp2);
+            push(pcpu, tmp1 % tmp2);
             break;
         case Instr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
+            push(pcpu, tmp1 * tmp2);
             break;
         case Instr_Rand:
-            tmp1 = rand();
-            push(&cpu, tmp1);
+            tmp1 = next_random(&pcpu->random);
+            push(pcpu, tmp1);
             break;
         case Instr_Dec:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
+            push(pcpu, tmp1-1);
             break;
         case Instr_Drop:
-            (void)pop(&cpu);
+            (void)pop(pcpu);
             break;
         case Instr_JE:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            if (tmp1 == 0)
-                cpu.pc += decoded.immediate;
+            if (tmp1 == 0) {
+                pcpu->pc += decoded.immediate;
+                TAKEN_BRANCH();
+            }
             break;
         case Instr_JNE:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            if (tmp1 != 0)
-                cpu.pc += decoded.immediate;
+            if (tmp1 != 0) {
+                pcpu->pc += decoded.immediate;
+                TAKEN_BRANCH();
+            }
             break;
         case Instr_Jump:
-            cpu.pc += decoded.immediate;
+            pcpu->pc += decoded.immediate;
+            TAKEN_BRANCH();
             break;
         case Instr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
+            push(pcpu, tmp1 & tmp2);
             break;
         case Instr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
+            push(pcpu, tmp1 | tmp2);
             break;
         case Instr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
+            push(pcpu, tmp1 ^ tmp2);
             break;
         case Instr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
+            push(pcpu, tmp1 << tmp2);
             break;
         case Instr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
+            push(pcpu, tmp1 >> tmp2);
             break;
         case Instr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
+            tmp3 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
+            push(pcpu, tmp1);
+            push(pcpu, tmp3);
+            push(pcpu, tmp2);
             break;
         case Instr_SQRT:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
+            push(pcpu, sqrt(tmp1));
             break;
         case Instr_Pick:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
+            push(pcpu, pick(pcpu, tmp1));
             break;
         case Instr_Break:
-            cpu.state = Cpu_Break;
+            decoded = decode_at_address(pcpu->pmem, pcpu->pmem_size, pcpu->pc);
+            if (decoded.opcode != Instr_Break) {
+                /* Not decoded yet, no step is taken */
+                store_slot(&decoded_cache[pcpu->pc], decoded);
+                continue;
+            }
+            pcpu->state = Cpu_Break;
             break;
         default:
             assert("Unreachable" && false);
             break;
         }
-        cpu.pc += decoded.length; /* Advance PC */
-        cpu.steps++;
+        pcpu->pc += decoded.length; /* Advance PC */
+        if (counted)
+            pcpu->steps++;
     }
+}
+
+cpu_state_t vm_run(vm_t *vm, uint64_t budget) {
+    const int counted = budget != UNLIMITED_STEPS;
+    cpu_t cpu = vm->cpu;
+    cpu.steplimit = run_steplimit(&cpu, budget);
+    vm->running = &cpu;
+    if (vm->preempted)
+        cpu.steplimit = cpu.steps;
+    decode_t *decoded_cache = vm->decoded_cache;
 
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %ld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
+    watch_stack(&cpu);
+    if (STACK_FAULT_CAUGHT()) {
+        /* The instruction that overflowed counts as executed, as with the
+           checks in push() */
+        cpu.pc += load_slot(&decoded_cache[cpu.pc]).length;
+        cpu.steps += counted;
     }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
 
-    free(LoadedProgram);
+    if (counted)
+        interpret(&cpu, decoded_cache, 1);
+    else
+        interpret(&cpu, decoded_cache, 0);
+
+    if (cpu.state != Cpu_Running)
+        flush_output(); /* All output of a finished guest is out */
+    vm->running = NULL;
+    vm->preempted = 0;
+    vm->cpu = cpu;
+    return cpu.state;
+}
+
+const cpu_t *vm_cpu(const vm_t *vm) {
+    return &vm->cpu;
+}
+
+int vm_restore(vm_t *vm, const cpu_t *state) {
+    return restore_cpu(&vm->cpu, state);
+}
+
+void vm_report(const vm_t *vm) {
+    (void)vm;
+}
 
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+void vm_destroy(vm_t *vm) {
+    put_shared_code(vm->shared, destroy_decoded);
+    destroy_cpu(&vm->cpu);
+    free(vm);
 }
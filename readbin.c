@@ -0,0 +1,116 @@
+/*  readbin.c - converts Print output stored by --out-bin to text.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* make STACK_GUARD=1 defines it too */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "common.h"
+#include "output.h"
+
+#define TEXT_BUFFER (64 * 1024)
+
+static char text[TEXT_BUFFER];
+
+static void write_text(size_t len) {
+    const char *p = text;
+    while (len) {
+        ssize_t done = write(STDOUT_FILENO, p, len);
+        if (done < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("write");
+            exit(2);
+        }
+        p += done;
+        len -= done;
+    }
+}
+
+/* Write the values of a file of --out-bin as Print would have */
+static void convert(const char *path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) {
+        perror(path);
+        exit(2);
+    }
+    output_header_t header;
+    if ((size_t)st.st_size < sizeof(header)
+        || pread(fd, &header, sizeof(header), 0) != sizeof(header)
+        || header.magic != OUTPUT_FILE_MAGIC
+        || header.version != OUTPUT_FILE_VERSION
+        || header.count > (st.st_size - sizeof(header)) / sizeof(int32_t)) {
+        fprintf(stderr, "Not a complete output file: %s\n", path);
+        exit(2);
+    }
+    if (header.count == 0) {
+        close(fd);
+        return;
+    }
+    const size_t size = sizeof(header) + header.count * sizeof(int32_t);
+    const char *base = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        perror(path);
+        exit(2);
+    }
+    madvise((void *)base, size, MADV_SEQUENTIAL);
+    const int32_t *values = (const int32_t *)(base + sizeof(header));
+    size_t len = 0;
+    for (uint64_t i = 0; i < header.count; i++) {
+        if (len + MAX_VALUE_TEXT > TEXT_BUFFER) {
+            write_text(len);
+            len = 0;
+        }
+        len += format_value(text + len, values[i]);
+    }
+    write_text(len);
+    munmap((void *)base, size);
+    close(fd);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || !strcmp(argv[1], "--help")) {
+        fprintf(stderr, "Usage: %s <file of --out-bin>...\n", argv[0]);
+        return argc < 2 ? 2 : 0;
+    }
+    for (int i = 1; i < argc; i++)
+        convert(argv[i]);
+    return 0;
+}
@@ -0,0 +1,154 @@
+/*  sched.c - cooperative scheduler running many virtual machines
+    on one thread.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* For clock_gettime() */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "common.h"
+#include "output.h"
+#include "vm.h"
+
+/* The machine inside vm_run(), if any */
+static vm_t *volatile current;
+
+static void preempt_current(void *arg) {
+    (void)arg;
+    vm_t *vm = current;
+    if (vm)
+        vm_preempt(vm);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Nearest-rank percentile of n sorted values, in milliseconds */
+static double percentile_ms(const uint64_t *sorted, uint32_t n, unsigned p) {
+    uint64_t rank = ((uint64_t)p * n + 99) / 100;
+    return sorted[rank ? rank - 1 : 0] / 1e6;
+}
+
+/* Runs --vms copies of the program round robin, --slice steps at a time.
+   --steplimit applies to every machine, --timeout to the whole run. */
+int main(int argc, char **argv) {
+    uint64_t steplimit = parse_args(argc, argv);
+    const Instr_t *program = LoadedProgram ? LoadedProgram : DefProgram;
+    const uint32_t len = LoadedProgram ? LoadedProgramSize : DefProgramSize;
+    const uint32_t n = Options.vms;
+
+    vm_t **vms = malloc(n * sizeof(vm_t *));
+    /* Run queue: a ring of machines waiting for a slice. A machine is
+       either queued or finished, so the ring never overflows */
+    uint32_t *queue = malloc(n * sizeof(uint32_t));
+    /* Time from the start to the end of every finished machine. Recorded
+       in the order machines finish, so it is sorted */
+    uint64_t *latency = malloc(n * sizeof(uint64_t));
+    if (!vms || !queue || !latency) {
+        fprintf(stderr, "Failed to allocate memory for scheduler.\n");
+        exit(2);
+    }
+    /* Machines share decoded or translated code of the program where the
+       variant supports it. Machine i draws from the generator seeded with
+       --seed plus i, so the copies differ */
+    options_t opts = Options;
+    for (uint32_t i = 0; i < n; i++) {
+        opts.seed = Options.seed + i;
+        vms[i] = vm_create(program, len, &opts);
+        queue[i] = i;
+    }
+    uint32_t head = 0, queued = n, finished = 0;
+    uint64_t switches = 0;
+
+    arm_timeout(preempt_current, NULL);
+    const uint64_t start = now_ns();
+    while (queued && !Preempted) {
+        const uint32_t i = queue[head];
+        head = head + 1 == n ? 0 : head + 1;
+        queued--;
+
+        const cpu_t *pcpu = vm_cpu(vms[i]);
+        uint64_t budget = steplimit - pcpu->steps;
+        if (budget > Options.slice)
+            budget = Options.slice;
+        current = vms[i];
+        const cpu_state_t state = vm_run(vms[i], budget);
+        current = NULL;
+        switches++;
+
+        if (state == Cpu_Running && pcpu->steps < steplimit) {
+            queue[(head + queued) % n] = i;
+            queued++;
+        } else {
+            latency[finished++] = now_ns() - start;
+        }
+    }
+    const uint64_t elapsed = now_ns() - start;
+    flush_output();
+
+    uint64_t steps = 0;
+    uint32_t halted = 0, broken = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        const cpu_t *pcpu = vm_cpu(vms[i]);
+        steps += pcpu->steps;
+        halted += pcpu->state == Cpu_Halted;
+        broken += pcpu->state == Cpu_Break;
+    }
+
+    printf("Scheduled %u machines in slices of %lu steps, %lu switches.\n",
+           n, Options.slice, switches);
+    printf("Halted %u, Break %u, Running %u.\n", halted, broken,
+           n - halted - broken);
+    printf("Executed %lu steps in %.3f s, %.0f steps/s\n", steps,
+           elapsed / 1e9, elapsed ? steps / (elapsed / 1e9) : 0.0);
+    if (finished) {
+        printf("Latency, ms: p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+               percentile_ms(latency, finished, 50),
+               percentile_ms(latency, finished, 90),
+               percentile_ms(latency, finished, 99),
+               percentile_ms(latency, finished, 100));
+    }
+
+    /* Shared code is reported once, through the first machine */
+    vm_report(vms[0]);
+    for (uint32_t i = 0; i < n; i++)
+        vm_destroy(vms[i]);
+    free(vms);
+    free(queue);
+    free(latency);
+    free_program(LoadedProgram, LoadedProgramSize);
+
+    return finished == n && broken == 0 ? 0 : 1;
+}
@@ -0,0 +1,415 @@
+/*  server.c - long-lived server running programs for a stack virtual
+    machine on request.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* For dup(), ftruncate(), pread(), fork() and sigaction() */
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "common.h"
+#include "output.h"
+#include "vm.h"
+#include "server.h"
+
+/* Programs seen recently, looked up by hash and compared word by word.
+   Each keeps an idle machine, which holds on to decoded or translated code
+   shared with the machines later created for the same copy */
+#define WARM_PROGRAMS 256
+
+typedef struct {
+    uint64_t hash;
+    uint32_t len;
+    Instr_t *program;  /* NULL for a free slot */
+    vm_t *anchor;
+    uint64_t last_use;
+} warm_program_t;
+
+static warm_program_t warm[WARM_PROGRAMS];
+static uint64_t use_clock;
+
+/* Statistics */
+static uint64_t requests, hits, misses;
+
+static uint64_t server_steplimit;
+static volatile sig_atomic_t stopping;
+
+/* A request of a socket client being received, read as it arrives */
+typedef struct {
+    char *buf;   /* The header, then the program */
+    size_t size;
+    size_t used;
+} conn_t;
+
+/* Buffers of connections larger than this are not kept between requests */
+#define CONN_KEEP_BYTES (1u << 20)
+
+/* Scratch buffers reused by all requests */
+static Instr_t *program_buf;
+static size_t program_buf_size;
+static char *output_buf;
+static size_t output_buf_size;
+
+static void *reserve(void *buf, size_t *size, size_t needed) {
+    if (needed <= *size)
+        return buf;
+    if (needed < 2 * *size)
+        needed = 2 * *size;
+    buf = realloc(buf, needed);
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate memory for request.\n");
+        exit(2);
+    }
+    *size = needed;
+    return buf;
+}
+
+/* Print output of the guest goes to stdout, which points to a temporary
+   file. Take what was written there during the last run */
+static uint32_t take_output(void) {
+    flush_output();
+    fflush(stdout);
+    off_t len = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    if (len < 0 || len > UINT32_MAX)
+        len = 0;
+    output_buf = reserve(output_buf, &output_buf_size, len);
+    if (len && pread(STDOUT_FILENO, output_buf, len, 0) != len)
+        len = 0;
+    if (ftruncate(STDOUT_FILENO, 0) || lseek(STDOUT_FILENO, 0, SEEK_SET)) {
+        perror("ftruncate");
+        exit(2);
+    }
+    return len;
+}
+
+static int wait_child(pid_t pid) {
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("waitpid");
+            exit(2);
+        }
+    }
+    return status;
+}
+
+static pid_t fork_child(void) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(2);
+    }
+    return pid;
+}
+
+/* Try the warm-up run in a child first, so that a guest crashing its
+   engine cannot take the server down */
+static int survives_warm_up(vm_t *vm) {
+    pid_t pid = fork_child();
+    if (pid == 0) {
+        vm_run(vm, Options.slice);
+        _exit(0);
+    }
+    int status = wait_child(pid);
+    take_output();
+    return WIFEXITED(status);
+}
+
+static warm_program_t *find_warm(const Instr_t *program, uint32_t len) {
+    const uint64_t hash = hash_program(program, len);
+    warm_program_t *victim = &warm[0];
+    for (int i = 0; i < WARM_PROGRAMS; i++) {
+        warm_program_t *wp = &warm[i];
+        if (wp->program && wp->hash == hash && wp->len == len
+            && !memcmp(wp->program, program, len * sizeof(Instr_t))) {
+            hits++;
+            wp->last_use = ++use_clock;
+            return wp;
+        }
+        if (!wp->program || (victim->program
+                             && wp->last_use < victim->last_use))
+            victim = wp;
+    }
+
+    misses++;
+    if (victim->program) { /* Evict the least recently used one */
+        vm_destroy(victim->anchor);
+        free(victim->program);
+    }
+    victim->program = malloc(len ? len * sizeof(Instr_t) : 1);
+    if (victim->program == NULL) {
+        fprintf(stderr, "Failed to allocate memory for input program.\n");
+        exit(2);
+    }
+    memcpy(victim->program, program, len * sizeof(Instr_t));
+    victim->hash = hash;
+    victim->len = len;
+    victim->anchor = vm_create(victim->program, len, &Options);
+    victim->last_use = ++use_clock;
+    if (Options.fork_server && survives_warm_up(victim->anchor)) {
+        /* Code generated by a child is lost with it. Run the program for a
+           while to translate its hot blocks once, in the parent */
+        vm_run(victim->anchor, Options.slice);
+        take_output();
+    }
+    return victim;
+}
+
+static int run_request(const warm_program_t *wp, uint64_t steplimit, int out) {
+    vm_t *vm = vm_create(wp->program, wp->len, &Options);
+    vm_run(vm, steplimit);
+
+    const cpu_t *pcpu = vm_cpu(vm);
+    reply_t rep = {.magic = REPLY_MAGIC, .state = pcpu->state,
+                   .steps = pcpu->steps, .pc = pcpu->pc, .sp = pcpu->sp,
+                   .output_len = take_output(), .reserved = 0};
+    int ok = write_full(out, &rep, sizeof(rep))
+             && write_full(out, pcpu->stack, (pcpu->sp + 1) * sizeof(uint32_t))
+             && write_full(out, output_buf, rep.output_len);
+    vm_destroy(vm);
+    return ok;
+}
+
+/* The child starts from a copy-on-write image of the server with the
+   program prepared, and a crash of the guest does not take the server
+   down. One child runs at a time, as translated children add code to the
+   code arena, which is shared memory. */
+static int fork_request(const warm_program_t *wp, uint64_t steplimit, int out) {
+    pid_t pid = fork_child();
+    if (pid == 0)
+        _exit(run_request(wp, steplimit, out) ? 0 : 1);
+
+    int status = wait_child(pid);
+    if (WIFEXITED(status))
+        return WEXITSTATUS(status) == 0;
+    /* Died before it could reply */
+    fprintf(stderr, "Request killed by signal %d.\n", WTERMSIG(status));
+    take_output();
+    reply_t rep = {.magic = REPLY_MAGIC, .state = Cpu_Break, .steps = 0,
+                   .pc = 0, .sp = -1, .output_len = 0, .reserved = 0};
+    return write_full(out, &rep, sizeof(rep));
+}
+
+static int valid_request(const request_t *req) {
+    if (req->magic != REQUEST_MAGIC || req->len > REQUEST_MAX_LEN) {
+        fprintf(stderr, "Invalid request, closing connection.\n");
+        return 0;
+    }
+    return 1;
+}
+
+/* Run a received request and reply to out. Returns zero when the
+   connection should be closed */
+static int dispatch_request(const request_t *req, const Instr_t *program,
+                            int out) {
+    requests++;
+    warm_program_t *wp = find_warm(program, req->len);
+    uint64_t steplimit = server_steplimit;
+    if (req->steplimit && req->steplimit < steplimit)
+        steplimit = req->steplimit;
+    return Options.fork_server ? fork_request(wp, steplimit, out)
+                               : run_request(wp, steplimit, out);
+}
+
+/* Run one request from in and reply to out. Returns zero when the
+   connection should be closed */
+static int serve_request(int in, int out) {
+    request_t req;
+    if (!read_full(in, &req, sizeof(req)) || !valid_request(&req))
+        return 0;
+    const size_t bytes = req.len * sizeof(Instr_t);
+    program_buf = reserve(program_buf, &program_buf_size, bytes);
+    if (!read_full(in, program_buf, bytes))
+        return 0;
+    return dispatch_request(&req, program_buf, out);
+}
+
+/* Take what a readable client sent, with a single read() so as not to
+   block, and run its request once all of it is in. Reads stop at the end
+   of the request, the next one stays in the socket until then. Returns
+   zero when the connection should be closed */
+static int receive_request(int fd, conn_t *c) {
+    size_t need = sizeof(request_t);
+    if (c->used >= need)
+        need += ((const request_t *)c->buf)->len * sizeof(Instr_t);
+    c->buf = reserve(c->buf, &c->size, need);
+    ssize_t n = read(fd, c->buf + c->used, need - c->used);
+    if (n < 0 && errno == EINTR)
+        return 1;
+    if (n <= 0)
+        return 0;
+    c->used += n;
+    if (c->used == sizeof(request_t)) {
+        if (!valid_request((const request_t *)c->buf))
+            return 0;
+        need += ((const request_t *)c->buf)->len * sizeof(Instr_t);
+    }
+    if (c->used < need)
+        return 1;
+
+    const request_t req = *(const request_t *)c->buf;
+    int ok = dispatch_request(&req, (const Instr_t *)(c->buf + sizeof(req)),
+                              fd);
+    c->used = 0;
+    if (c->size > CONN_KEEP_BYTES) {
+        free(c->buf);
+        c->buf = NULL;
+        c->size = 0;
+    }
+    return ok;
+}
+
+static void stop_handler(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static int listen_on(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long: %s\n", path);
+        exit(2);
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(path);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr))
+        || listen(fd, 64)) {
+        perror("listen");
+        exit(2);
+    }
+    return fd;
+}
+
+/* Connections are served one request at a time, in the order they become
+   readable. Requests are taken in pieces as they arrive, so a slow client
+   does not hold up others, and run once complete. conns[i] is the
+   connection of fds[i]. */
+static void serve_socket(const char *path) {
+    size_t fds_size = 0, conns_size = 0;
+    struct pollfd *fds = reserve(NULL, &fds_size, 16 * sizeof(struct pollfd));
+    conn_t *conns = reserve(NULL, &conns_size, 16 * sizeof(conn_t));
+    nfds_t nfds = 1;
+    fds[0] = (struct pollfd){.fd = listen_on(path), .events = POLLIN};
+
+    while (!stopping) {
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll");
+            exit(2);
+        }
+        for (nfds_t i = nfds; i-- > 1; ) {
+            if (!fds[i].revents)
+                continue;
+            if (!receive_request(fds[i].fd, &conns[i])) {
+                close(fds[i].fd);
+                free(conns[i].buf);
+                fds[i] = fds[--nfds];
+                conns[i] = conns[nfds];
+            }
+        }
+        if (fds[0].revents & POLLIN) {
+            int client = accept(fds[0].fd, NULL, NULL);
+            if (client < 0)
+                continue;
+            fds = reserve(fds, &fds_size, (nfds + 1) * sizeof(struct pollfd));
+            conns = reserve(conns, &conns_size, (nfds + 1) * sizeof(conn_t));
+            conns[nfds] = (conn_t){.buf = NULL, .size = 0, .used = 0};
+            fds[nfds++] = (struct pollfd){.fd = client, .events = POLLIN};
+        }
+    }
+    for (nfds_t i = 0; i < nfds; i++) {
+        close(fds[i].fd);
+        if (i)
+            free(conns[i].buf);
+    }
+    free(fds);
+    free(conns);
+    unlink(path);
+}
+
+/* Serves requests from --socket=<path>, or from stdin with replies on
+   stdout if there is no socket, until stopped by a signal or end of input.
+   --steplimit caps every request, REQUEST_DEFAULT_STEPLIMIT if not given. */
+int main(int argc, char **argv) {
+    server_steplimit = parse_args(argc, argv);
+    if (server_steplimit == UNLIMITED_STEPS)
+        server_steplimit = REQUEST_DEFAULT_STEPLIMIT;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &sa, NULL); /* Clients may go away */
+    sa.sa_handler = stop_handler;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* Capture Print output of guests */
+    int reply_fd = dup(STDOUT_FILENO);
+    FILE *capture = tmpfile();
+    if (reply_fd < 0 || capture == NULL
+        || dup2(fileno(capture), STDOUT_FILENO) < 0) {
+        perror("tmpfile");
+        exit(2);
+    }
+
+    if (Options.socket_path)
+        serve_socket(Options.socket_path);
+    else
+        while (!stopping && serve_request(STDIN_FILENO, reply_fd))
+            ;
+
+    fprintf(stderr, "Served %lu requests, %lu programs found warm, "
+            "%lu prepared anew.\n", requests, hits, misses);
+    for (int i = 0; i < WARM_PROGRAMS; i++) {
+        if (warm[i].program) {
+            vm_report(warm[i].anchor);
+            vm_destroy(warm[i].anchor);
+            free(warm[i].program);
+        }
+    }
+    free(program_buf);
+    free(output_buf);
+    fclose(capture);
+    close(reply_fd);
+    free_program(LoadedProgram, LoadedProgramSize);
+    return 0;
+}
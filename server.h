@@ -0,0 +1,95 @@
+/*  server.h - frames exchanged with a server of a stack virtual machine.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+
+#ifndef SERVER_H_
+#define SERVER_H_
+
+/* A client sends a request header followed by len program words and gets
+   a reply header followed by the stack and the output of the program.
+   Numbers are in host byte order, both ends are on the same host. */
+#define REQUEST_MAGIC 0x51524d56 /* "VMRQ" */
+#define REPLY_MAGIC   0x50524d56 /* "VMRP" */
+
+/* Longest program accepted by the server, in words */
+#define REQUEST_MAX_LEN (1u << 26)
+
+/* Steps a request may run for when the server has no --steplimit, so that
+   a guest that never halts cannot hold the server forever */
+#define REQUEST_DEFAULT_STEPLIMIT 1000000000ull
+
+typedef struct {
+    uint32_t magic;
+    uint32_t len;        /* Program words following the header */
+    uint64_t steplimit;  /* Zero for the server's own --steplimit */
+} request_t;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t state;      /* cpu_state_t at the end of the run */
+    uint64_t steps;
+    uint32_t pc;
+    int32_t sp;          /* sp + 1 stack words follow, bottom first */
+    uint32_t output_len; /* Bytes of Print output following the stack */
+    uint32_t reserved;
+} reply_t;
+
+/* Transfer exactly len bytes. Return zero on end of file or error */
+static inline int read_full(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static inline int write_full(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+#endif /* SERVER_H_ */
@@ -0,0 +1,231 @@
+/*  sharedcode.c - code derived from programs, shared by virtual machines
+    running the same program in any thread
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* make STACK_GUARD=1 defines it too */
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "sharedcode.h"
+
+static shared_code_t *shared_codes;
+static pthread_mutex_t shared_codes_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t shared_codes_built = PTHREAD_COND_INITIALIZER;
+
+static size_t round_to_pages(size_t size) {
+    const size_t page = sysconf(_SC_PAGESIZE);
+    return size ? (size + page - 1) & ~(page - 1) : page;
+}
+
+void *alloc_sealable(size_t size) {
+    void *p = mmap(NULL, round_to_pages(size), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate memory for shared code.\n");
+        exit(2);
+    }
+    return p;
+}
+
+/* A stray write to shared code faults instead of corrupting other machines */
+void seal(void *p, size_t size) {
+    if (mprotect(p, round_to_pages(size), PROT_READ)) {
+        perror("mprotect");
+        exit(2);
+    }
+}
+
+void free_sealable(void *p, size_t size) {
+    munmap(p, round_to_pages(size));
+}
+
+static int same_params(const shared_code_t *sc, const void *params,
+                       size_t params_size) {
+    return sc->params_size == params_size
+           && (!params_size || !memcmp(sc->params, params, params_size));
+}
+
+shared_code_t *get_shared_code(const Instr_t *program, uint32_t len,
+                               const void *params, size_t params_size) {
+    /* Machines of a program file usually run the very mapping an entry
+       keeps, which needs neither hashing nor comparing */
+    pthread_mutex_lock(&shared_codes_lock);
+    for (shared_code_t *sc = shared_codes; sc; sc = sc->next) {
+        if (sc->program == program && sc->len == len
+            && same_params(sc, params, params_size)) {
+            sc->refs++;
+            pthread_mutex_unlock(&shared_codes_lock);
+            return sc;
+        }
+    }
+    pthread_mutex_unlock(&shared_codes_lock);
+
+    /* Hashing may take a while for a large program, do it outside the lock */
+    const uint64_t hash = hash_program(program, len);
+    pthread_mutex_lock(&shared_codes_lock);
+    for (shared_code_t *sc = shared_codes; sc; sc = sc->next) {
+        if (sc->hash == hash && sc->len == len
+            && same_params(sc, params, params_size)
+            && !memcmp(sc->program, program, len * sizeof(Instr_t))) {
+            sc->refs++;
+            pthread_mutex_unlock(&shared_codes_lock);
+            return sc;
+        }
+    }
+    shared_code_t *sc = malloc(sizeof(shared_code_t) + params_size);
+    if (sc == NULL) {
+        fprintf(stderr, "Failed to allocate memory for shared code.\n");
+        exit(2);
+    }
+    /* The mapping of a program file is read-only already and outlives the
+       entry with a reference of its own */
+    const int retained = retain_program(program);
+    if (!retained) {
+        Instr_t *copy = alloc_sealable(len * sizeof(Instr_t));
+        memcpy(copy, program, len * sizeof(Instr_t));
+        seal(copy, len * sizeof(Instr_t));
+        program = copy;
+    }
+    if (params_size)
+        memcpy(sc + 1, params, params_size);
+    *sc = (shared_code_t){.hash = hash, .program = program, .len = len,
+                          .retained = retained,
+                          .params = sc + 1, .params_size = params_size,
+                          .data = NULL, .building = 0, .refs = 1,
+                          .next = shared_codes};
+    shared_codes = sc;
+    pthread_mutex_unlock(&shared_codes_lock);
+    return sc;
+}
+
+void *shared_code_data(shared_code_t *sc,
+                       void *(*build)(shared_code_t *sc, void *arg), void *arg) {
+    /* Published with release semantics once complete */
+    void *data = __atomic_load_n(&sc->data, __ATOMIC_ACQUIRE);
+    if (data)
+        return data;
+    pthread_mutex_lock(&shared_codes_lock);
+    while (sc->building)
+        pthread_cond_wait(&shared_codes_built, &shared_codes_lock);
+    if (sc->data == NULL) {
+        /* Other programs are not held up while this one is built */
+        sc->building = 1;
+        pthread_mutex_unlock(&shared_codes_lock);
+        data = build(sc, arg);
+        pthread_mutex_lock(&shared_codes_lock);
+        __atomic_store_n(&sc->data, data, __ATOMIC_RELEASE);
+        sc->building = 0;
+        pthread_cond_broadcast(&shared_codes_built);
+    }
+    data = sc->data;
+    pthread_mutex_unlock(&shared_codes_lock);
+    return data;
+}
+
+void put_shared_code(shared_code_t *sc, void (*destroy)(shared_code_t *sc)) {
+    pthread_mutex_lock(&shared_codes_lock);
+    if (--sc->refs) {
+        pthread_mutex_unlock(&shared_codes_lock);
+        return;
+    }
+    shared_code_t **link = &shared_codes;
+    while (*link != sc)
+        link = &(*link)->next;
+    *link = sc->next;
+    pthread_mutex_unlock(&shared_codes_lock);
+    if (sc->data)
+        destroy(sc);
+    if (sc->retained)
+        free_program((Instr_t *)sc->program, sc->len);
+    else
+        free_sealable((Instr_t *)sc->program, sc->len * sizeof(Instr_t));
+    free(sc);
+}
+
+int partition(uint32_t len, uint32_t nthreads, uint32_t *bounds) {
+    uint32_t nparts = len / MIN_PART_WORDS;
+    if (nparts > nthreads)
+        nparts = nthreads;
+    if (nparts > MAX_PARTS)
+        nparts = MAX_PARTS;
+    if (nparts < 1)
+        nparts = 1;
+    for (uint32_t p = 0; p <= nparts; p++)
+        bounds[p] = (uint64_t)len * p / nparts;
+    return nparts;
+}
+
+typedef struct {
+    void (*work)(void *arg, int part, uint32_t begin, uint32_t end);
+    void *arg;
+    int part;
+    uint32_t begin;
+    uint32_t end;
+    pthread_t thread;
+} part_t;
+
+static void *part_main(void *arg) {
+    part_t *part = arg;
+    part->work(part->arg, part->part, part->begin, part->end);
+    return NULL;
+}
+
+void run_parts(int nparts, const uint32_t *bounds,
+               void (*work)(void *arg, int part, uint32_t begin, uint32_t end),
+               void *arg) {
+    part_t parts[MAX_PARTS];
+    /* Signals such as the --timeout timer are for the running threads */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for (int p = 1; p < nparts; p++) {
+        parts[p] = (part_t){.work = work, .arg = arg, .part = p,
+                            .begin = bounds[p], .end = bounds[p + 1]};
+        errno = pthread_create(&parts[p].thread, NULL, part_main, &parts[p]);
+        if (errno) {
+            perror("pthread_create");
+            exit(2);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    /* The calling thread takes the first part */
+    work(arg, 0, bounds[0], bounds[1]);
+    for (int p = 1; p < nparts; p++)
+        pthread_join(parts[p].thread, NULL);
+}
@@ -0,0 +1,91 @@
+/*  sharedcode.h - code derived from programs, shared by virtual machines
+    running the same program in any thread
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "common.h"
+
+#ifndef SHAREDCODE_H_
+#define SHAREDCODE_H_
+
+/* Decoded or translated code of a program is the same for every machine
+   running it, so it is kept once per distinct program contents, found by a
+   hash of them, and shared by machines of all threads. The first machine
+   that needs it builds it while others wait, then it is only read, except
+   for entries that engines decoding lazily fill in as they run. */
+typedef struct shared_code {
+    uint64_t hash;
+    const Instr_t *program; /* Read-only contents, see get_shared_code() */
+    uint32_t len;
+    int retained;           /* program is of read_program(), not a copy */
+    const void *params;     /* Settings the code depends on, if any */
+    size_t params_size;
+    void *data;             /* Built by the engine, NULL until then */
+    int building;
+    int refs;
+    struct shared_code *next;
+} shared_code_t;
+
+/* Find or add the entry for program contents and params. A new entry
+   keeps a reference to the program if it comes from read_program(), or
+   else a sealed copy of it. Exits the process when out of memory, as
+   other setup code does. */
+shared_code_t *get_shared_code(const Instr_t *program, uint32_t len,
+                               const void *params, size_t params_size);
+
+/* Return the data of an entry, calling build(sc, arg) for it first if no
+   one did. Other threads asking for it meanwhile wait for the result. */
+void *shared_code_data(shared_code_t *sc,
+                       void *(*build)(shared_code_t *sc, void *arg), void *arg);
+
+/* Drop a reference. The last one calls destroy(sc) if data was built */
+void put_shared_code(shared_code_t *sc, void (*destroy)(shared_code_t *sc));
+
+/* Large programs are decoded or translated in parts, each on a thread of
+   its own. Parts are no smaller than this many words */
+#define MIN_PART_WORDS (1u << 16)
+#define MAX_PARTS 64
+
+/* Split [0, len) into parts for up to nthreads threads. Fills nparts + 1
+   bounds, the last of which is len, and returns nparts */
+int partition(uint32_t len, uint32_t nthreads, uint32_t *bounds);
+
+/* Call work(arg, p, bounds[p], bounds[p + 1]) for every part p, each on
+   a thread of its own, and wait until all of them are done */
+void run_parts(int nparts, const uint32_t *bounds,
+               void (*work)(void *arg, int part, uint32_t begin, uint32_t end),
+               void *arg);
+
+/* Page-granular zeroed memory for code, made read-only once built */
+void *alloc_sealable(size_t size);
+void seal(void *p, size_t size);
+void free_sealable(void *p, size_t size);
+
+#endif /* SHAREDCODE_H_ */
@@ -34,18 +34,28 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <errno.h>
 #include <limits.h>
 #include <math.h>
+#include <setjmp.h>
 
 #include "common.h"
+#include "checkpoint.h"
+#include "output.h"
+#include "vm.h"
+
+struct vm {
+    cpu_t cpu;
+    cpu_t *volatile running; /* Copy of cpu used by vm_run(), if any */
+    volatile sig_atomic_t preempted;
+};
 
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->pmem_size);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
-        printf("PC out of bounds\n");
+    if (!(pcpu->pc < pcpu->pmem_size)) {
+        print_message("PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
     }
@@ -85,8 +95,8 @@ static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
     case Instr_JNE:
     case Instr_JE:
     case Instr_Jump:
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
+        if (!(pcpu->pc+1 < pcpu->pmem_size)) {
+            print_message("PC+1 out of bounds\n");
             result.length = 1;
             result.opcode = Instr_Break;
             break;
@@ -112,18 +122,21 @@ static inline decode_t fetch_decode(cpu_t *pcpu) {
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
+    STACK_BARRIER();
+#ifndef STACK_GUARD
+    if (pcpu->sp >= pcpu->stack_capacity-1 && !grow_stack(pcpu)) {
+        print_message("Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
     }
+#endif
     pcpu->stack[++pcpu->sp] = v;
 }
 
 static inline uint32_t pop(cpu_t *pcpu) {
     assert(pcpu);
     if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
+        print_message("Stack underflow\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -133,7 +146,7 @@ static inline uint32_t pop(cpu_t *pcpu) {
 static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
     assert(pcpu);
     if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
+        print_message("Out of bound picking\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -142,6 +155,17 @@ static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
 
 typedef void (*service_routine_t)(cpu_t *pcpu, decode_t* pdecode);
 
+/* A run that does not count steps has its loop check nothing but the
+   state, so taken branches, which every loop of the guest goes through,
+   leave it here once preemption has lowered the step limit */
+static _Thread_local jmp_buf PreemptEnv;
+
+#define TAKEN_BRANCH() \
+    if (pcpu->steps >= STEPLIMIT(pcpu)) { \
+        pcpu->pc += pdecoded->length; \
+        longjmp(PreemptEnv, 1); \
+    }
+
 void sr_Nop(cpu_t *pcpu, decode_t *pdecoded) {
     /* Do nothing */
 }
@@ -158,7 +182,7 @@ void sr_Push(cpu_t *pcpu, decode_t *pdecoded) {
 void sr_Print(cpu_t *pcpu, decode_t *pdecoded) {
     uint32_t tmp1 = pop(pcpu);
     BAIL_ON_ERROR();
-    printf("[%d]\n", tmp1);
+    print_value(tmp1);
 }
 
 void sr_Swap(cpu_t *pcpu, decode_t *pdecoded) {
@@ -224,7 +248,7 @@ void sr_Mul(cpu_t *pcpu, decode_t *pdecoded) {
 }
 
 void sr_Rand(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = rand();
+    uint32_t tmp1 = next_random(&pcpu->random);
     push(pcpu, tmp1);
 }
 
@@ -241,15 +265,19 @@ void sr_Drop(cpu_t *pcpu, decode_t *pdecoded) {
 void sr_Je(cpu_t *pcpu, decode_t *pdecoded) {
     uint32_t tmp1 = pop(pcpu);
     BAIL_ON_ERROR();
-    if (tmp1 == 0)
+    if (tmp1 == 0) {
         pcpu->pc += pdecoded->immediate;
+        TAKEN_BRANCH();
+    }
 }
 
 void sr_Jne(cpu_t *pcpu, decode_t *pdecoded) {
     uint32_t tmp1 = pop(pcpu);
     BAIL_ON_ERROR();
-    if (tmp1 != 0)
+    if (tmp1 != 0) {
         pcpu->pc += pdecoded->immediate;
+        TAKEN_BRANCH();
+    }
 }
 
 void sr_And(cpu_t *pcpu, decode_t *pdecoded) {
@@ -299,6 +327,7 @@ void sr_Rot(cpu_t *pcpu, decode_t *pdecoded) {
 
 void sr_Jump(cpu_t *pcpu, decode_t *pdecoded) {
     pcpu->pc += pdecoded->immediate;
+    TAKEN_BRANCH();
 }
 
 void sr_SQRT(cpu_t *pcpu, decode_t *pdecoded) {
@@ -330,33 +359,86 @@ service_routine_t service_routines[] = {
         &sr_Rot, &sr_Pick
     };
 
-int main(int argc, char **argv) {
-    uint64_t steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
-
-    while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
-        decode_t decoded = fetch_decode(&cpu);
-        if (cpu.state != Cpu_Running) break;
-        service_routines[decoded.opcode](&cpu, &decoded); /* Call the SR */
-        cpu.pc += decoded.length; /* Advance PC */
-        cpu.steps++;
+vm_t *vm_create(const Instr_t *program, uint32_t len, const options_t *opts) {
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (vm == NULL) {
+        fprintf(stderr, "Failed to allocate memory for virtual machine.\n");
+        exit(2);
+    }
+    vm->cpu = init_cpu(program, len, opts);
+    vm->running = NULL;
+    vm->preempted = 0;
+    return vm;
+}
+
+void vm_preempt(vm_t *vm) {
+    vm->preempted = 1;
+    cpu_t *pcpu = vm->running;
+    if (pcpu)
+        pcpu->steplimit = 0;
+}
+
+cpu_state_t vm_run(vm_t *vm, uint64_t budget) {
+    const int counted = budget != UNLIMITED_STEPS;
+    cpu_t cpu = vm->cpu;
+    cpu.steplimit = run_steplimit(&cpu, budget);
+    vm->running = &cpu;
+    if (vm->preempted)
+        cpu.steplimit = cpu.steps;
+
+    watch_stack(&cpu);
+    if (STACK_FAULT_CAUGHT()) {
+        /* The instruction that overflowed counts as executed, as with the
+           checks in push() */
+        cpu.pc += fetch_decode(&cpu).length;
+        cpu.steps += counted;
+        goto stopped;
+    }
+    if (setjmp(PreemptEnv)) {
+        /* A branch taken after preemption, counted as executed */
+        cpu.steps += counted;
+        goto stopped;
     }
 
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %ld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
+    if (counted) {
+        while (cpu.state == Cpu_Running && cpu.steps < cpu.steplimit) {
+            decode_t decoded = fetch_decode(&cpu);
+            if (cpu.state != Cpu_Running) break;
+            service_routines[decoded.opcode](&cpu, &decoded); /* Call the SR */
+            cpu.pc += decoded.length; /* Advance PC */
+            cpu.steps++;
+        }
+    } else if (cpu.steps < cpu.steplimit) {
+        while (cpu.state == Cpu_Running) {
+            decode_t decoded = fetch_decode(&cpu);
+            if (cpu.state != Cpu_Running) break;
+            service_routines[decoded.opcode](&cpu, &decoded); /* Call the SR */
+            cpu.pc += decoded.length; /* Advance PC */
+        }
     }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
 
-    free(LoadedProgram);
+stopped:
+    if (cpu.state != Cpu_Running)
+        flush_output(); /* All output of a finished guest is out */
+    vm->running = NULL;
+    vm->preempted = 0;
+    vm->cpu = cpu;
+    return cpu.state;
+}
+
+const cpu_t *vm_cpu(const vm_t *vm) {
+    return &vm->cpu;
+}
+
+int vm_restore(vm_t *vm, const cpu_t *state) {
+    return restore_cpu(&vm->cpu, state);
+}
+
+void vm_report(const vm_t *vm) {
+    (void)vm;
+}
 
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+void vm_destroy(vm_t *vm) {
+    destroy_cpu(&vm->cpu);
+    free(vm);
 }
@@ -36,16 +36,28 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "checkpoint.h"
+#include "compact.h"
+#include "container.h"
+#include "output.h"
+#include "vm.h"
+
+struct vm {
+    cpu_t cpu;
+    const compact_t *compact; /* Run instead of the words, if present */
+    cpu_t *volatile running; /* Copy of cpu used by vm_run(), if any */
+    volatile sig_atomic_t preempted;
+};
 
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->pmem_size);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
-        printf("PC out of bounds\n");
+    if (!(pcpu->pc < pcpu->pmem_size)) {
+        print_message("PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
     }
@@ -87,8 +99,8 @@ static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
     case Instr_JE:
     case Instr_Jump:
         result.length = 2;
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
+        if (!(pcpu->pc+1 < pcpu->pmem_size)) {
+            print_message("PC+1 out of bounds\n");
             result.length = 1;
             result.opcode = Instr_Break;
             break;
@@ -104,23 +116,38 @@ static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
     return result;
 }
 
+/* From the words or, if compact is not NULL, from compact code */
+static inline decode_t fetch_decode(cpu_t *pcpu, const compact_t *compact) {
+    if (compact == NULL)
+        return decode(fetch_checked(pcpu), pcpu);
+    if (!(pcpu->pc < compact->size)) {
+        print_message("PC out of bounds\n");
+        pcpu->state = Cpu_Break;
+        return (decode_t){.opcode = Instr_Break, .length = 1};
+    }
+    return decode_compact(compact, pcpu->pc);
+}
+
 /*** Service routines ***/
-#define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) break;
+#define BAIL_ON_ERROR() if (pcpu->state != Cpu_Running) break;
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
+    STACK_BARRIER();
+#ifndef STACK_GUARD
+    if (pcpu->sp >= pcpu->stack_capacity-1 && !grow_stack(pcpu)) {
+        print_message("Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
     }
+#endif
     pcpu->stack[++pcpu->sp] = v;
 }
 
 static inline uint32_t pop(cpu_t *pcpu) {
     assert(pcpu);
     if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
+        print_message("Stack underflow\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -130,21 +157,53 @@ static inline uint32_t pop(cpu_t *pcpu) {
 static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
     assert(pcpu);
     if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
+        print_message("Out of bound picking\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
     return pcpu->stack[pcpu->sp - pos];
 }
 
-int main(int argc, char **argv) {
-    uint64_t steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
+vm_t *vm_create(const Instr_t *program, uint32_t len, const options_t *opts) {
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (vm == NULL) {
+        fprintf(stderr, "Failed to allocate memory for virtual machine.\n");
+        exit(2);
+    }
+    vm->cpu = init_cpu(program, len, opts);
+    const program_info_t *info = program_info(program);
+    vm->compact = info ? info->compact : NULL;
+    vm->running = NULL;
+    vm->preempted = 0;
+    return vm;
+}
+
+void vm_preempt(vm_t *vm) {
+    vm->preempted = 1;
+    cpu_t *pcpu = vm->running;
+    if (pcpu)
+        pcpu->steplimit = 0;
+}
 
-    while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
-        Instr_t raw_instr = fetch_checked(&cpu);
+/* Without counting, preemption is checked on taken branches only, as
+   every loop of the guest goes through one */
+#define TAKEN_BRANCH() \
+    if (!counted && pcpu->steps >= STEPLIMIT(pcpu)) { \
+        pcpu->pc += decoded.length; \
+        return; \
+    }
+
+/* The interpreter loop. vm_run() has copies of it for words and for
+   compact code, so that the copy for words is the same as without it, and
+   of each one that counts steps and one that does not. */
+static inline __attribute__((always_inline))
+void interpret(cpu_t *pcpu, const compact_t *compact, const int counted) {
+    if (!counted && pcpu->steps >= STEPLIMIT(pcpu))
+        return;
+    while (pcpu->state == Cpu_Running
+           && (!counted || pcpu->steps < STEPLIMIT(pcpu))) {
+        decode_t decoded = fetch_decode(pcpu, compact);
         BAIL_ON_ERROR();
-        decode_t decoded = decode(raw_instr, &cpu);
 
         uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
         /* Execute - a big switch */
@@ -153,171 +212,211 @@ int main(int argc, char **argv) {
             /* Do nothing */
             break;
         case Instr_Halt:
-            cpu.state = Cpu_Halted;
+            pcpu->state = Cpu_Halted;
             break;
         case Instr_Push:
-            push(&cpu, decoded.immediate);
+            push(pcpu, decoded.immediate);
             break;
         case Instr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
+            tmp1 = pop(pcpu); BAIL_ON_ERROR();
+            print_value(tmp1);
             break;
         case Instr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            push(pcpu, tmp1);
+            push(pcpu, tmp2);
             break;
         case Instr_Dup:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
+            push(pcpu, tmp1);
+            push(pcpu, tmp1);
             break;
         case Instr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
+            push(pcpu, tmp2);
+            push(pcpu, tmp1);
+            push(pcpu, tmp2);
             break;
         case Instr_Inc:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
+            push(pcpu, tmp1+1);
             break;
         case Instr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
+            push(pcpu, tmp1 + tmp2);
             break;
         case Instr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
+            push(pcpu, tmp1 - tmp2);
             break;
         case Instr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
             if (tmp2 == 0) {
-                cpu.state = Cpu_Break;
+                pcpu->state = Cpu_Break;
                 break;
             }
-            push(&cpu, tmp1 % tmp2);
+            push(pcpu, tmp1 % tmp2);
             break;
         case Instr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
+            push(pcpu, tmp1 * tmp2);
             break;
         case Instr_Rand:
-            tmp1 = rand();
-            push(&cpu, tmp1);
+            tmp1 = next_random(&pcpu->random);
+            push(pcpu, tmp1);
             break;
         case Instr_Dec:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
+            push(pcpu, tmp1-1);
             break;
         case Instr_Drop:
-            (void)pop(&cpu);
+            (void)pop(pcpu);
             break;
         case Instr_JE:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            if (tmp1 == 0)
-                cpu.pc += decoded.immediate;
+            if (tmp1 == 0) {
+                pcpu->pc += decoded.immediate;
+                TAKEN_BRANCH();
+            }
             break;
         case Instr_JNE:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            if (tmp1 != 0)
-                cpu.pc += decoded.immediate;
+            if (tmp1 != 0) {
+                pcpu->pc += decoded.immediate;
+                TAKEN_BRANCH();
+            }
             break;
         case Instr_Jump:
-            cpu.pc += decoded.immediate;
+            pcpu->pc += decoded.immediate;
+            TAKEN_BRANCH();
             break;
         case Instr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
+            push(pcpu, tmp1 & tmp2);
             break;
         case Instr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
+            push(pcpu, tmp1 | tmp2);
             break;
         case Instr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
+            push(pcpu, tmp1 ^ tmp2);
             break;
         case Instr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
+            push(pcpu, tmp1 << tmp2);
             break;
         case Instr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
+            push(pcpu, tmp1 >> tmp2);
             break;
         case Instr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
+            tmp1 = pop(pcpu);
+            tmp2 = pop(pcpu);
+            tmp3 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
+            push(pcpu, tmp1);
+            push(pcpu, tmp3);
+            push(pcpu, tmp2);
             break;
         case Instr_SQRT:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
+            push(pcpu, sqrt(tmp1));
             break;
         case Instr_Pick:
-            tmp1 = pop(&cpu);
+            tmp1 = pop(pcpu);
             BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
+            push(pcpu, pick(pcpu, tmp1));
             break;
         case Instr_Break:
-            cpu.state = Cpu_Break;
+            pcpu->state = Cpu_Break;
             break;
         default:
             assert("Unreachable" && false);
             break;
         }
-        cpu.pc += decoded.length; /* Advance PC */
-        cpu.steps++;
+        pcpu->pc += decoded.length; /* Advance PC */
+        if (counted)
+            pcpu->steps++;
     }
+}
 
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %ld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
+cpu_state_t vm_run(vm_t *vm, uint64_t budget) {
+    const int counted = budget != UNLIMITED_STEPS;
+    cpu_t cpu = vm->cpu;
+    cpu.steplimit = run_steplimit(&cpu, budget);
+    const compact_t *compact = enter_compact(vm->compact, &cpu);
+    vm->running = &cpu;
+    if (vm->preempted)
+        cpu.steplimit = cpu.steps;
+
+    watch_stack(&cpu);
+    if (STACK_FAULT_CAUGHT()) {
+        /* The instruction that overflowed counts as executed, as with the
+           checks in push() */
+        cpu.pc += fetch_decode(&cpu, compact).length;
+        cpu.steps += counted;
     }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
 
-    free(LoadedProgram);
+    if (compact && counted)
+        interpret(&cpu, compact, 1);
+    else if (compact)
+        interpret(&cpu, compact, 0);
+    else if (counted)
+        interpret(&cpu, NULL, 1);
+    else
+        interpret(&cpu, NULL, 0);
+
+    leave_compact(compact, &cpu);
+    if (cpu.state != Cpu_Running)
+        flush_output(); /* All output of a finished guest is out */
+    vm->running = NULL;
+    vm->preempted = 0;
+    vm->cpu = cpu;
+    return cpu.state;
+}
+
+const cpu_t *vm_cpu(const vm_t *vm) {
+    return &vm->cpu;
+}
+
+int vm_restore(vm_t *vm, const cpu_t *state) {
+    return restore_cpu(&vm->cpu, state);
+}
+
+void vm_report(const vm_t *vm) {
+    (void)vm;
+}
 
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+void vm_destroy(vm_t *vm) {
+    destroy_cpu(&vm->cpu);
+    free(vm);
 }
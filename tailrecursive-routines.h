@@ -0,0 +1,304 @@
+/*  tailrecursive-routines.h - service routines of the tail recursive
+    interpreter, included by tailrecursive.c counting steps or not
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Expects the macros LOOP_COUNTED, 1 to count steps against the limit and
+   0 not to, SR(name), the name of the routine of an instruction, and
+   ROUTINES, the name of their table, and undefines them. */
+
+service_routine_t ROUTINES[];
+
+void SR(Nop)(cpu_t *pcpu, decode_t *pdecoded) {
+    /* Do nothing */
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Halt)(cpu_t *pcpu, decode_t *pdecoded) {
+    pcpu->state = Cpu_Halted;
+    ADVANCE_PC();
+    return;
+}
+
+void SR(Push)(cpu_t *pcpu, decode_t *pdecoded) {
+    push(pcpu, pdecoded->immediate);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Print)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    BAIL_ON_ERROR();
+    print_value(tmp1);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Swap)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1);
+    push(pcpu, tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Dup)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1);
+    push(pcpu, tmp1);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Over)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp2);
+    push(pcpu, tmp1);
+    push(pcpu, tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Inc)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1+1);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Add)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1 + tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Sub)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1 - tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Mod)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    if (tmp2 == 0) {
+        pcpu->state = Cpu_Break;
+        return;
+    }
+    push(pcpu, tmp1 % tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Mul)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1 * tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Rand)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = next_random(&pcpu->random);
+    push(pcpu, tmp1);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Dec)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1-1);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Drop)(cpu_t *pcpu, decode_t *pdecoded) {
+    (void)pop(pcpu);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Je)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    BAIL_ON_ERROR();
+    if (tmp1 == 0)
+        pcpu->pc += pdecoded->immediate;
+    ADVANCE_PC_BRANCH();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Jne)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    BAIL_ON_ERROR();
+    if (tmp1 != 0)
+        pcpu->pc += pdecoded->immediate;
+    ADVANCE_PC_BRANCH();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Jump)(cpu_t *pcpu, decode_t *pdecoded) {
+    pcpu->pc += pdecoded->immediate;
+    ADVANCE_PC_BRANCH();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(And)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1 & tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Or)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1 | tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Xor)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1 ^ tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(SHL)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1 << tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(SHR)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1 >> tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Rot)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    uint32_t tmp3 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, tmp1);
+    push(pcpu, tmp3);
+    push(pcpu, tmp2);
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(SQRT)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, sqrt(tmp1));
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Pick)(cpu_t *pcpu, decode_t *pdecoded) {
+    uint32_t tmp1 = pop(pcpu);
+    BAIL_ON_ERROR();
+    push(pcpu, pick(pcpu, tmp1));
+    ADVANCE_PC();
+    *pdecoded = fetch_decode(pcpu);
+    DISPATCH();
+}
+
+void SR(Break)(cpu_t *pcpu, decode_t *pdecoded) {
+    pcpu->state = Cpu_Break;
+    ADVANCE_PC();
+    /* No need to dispatch after Break */
+    return;
+}
+
+service_routine_t ROUTINES[] = {
+        &SR(Break), &SR(Nop), &SR(Halt), &SR(Push), &SR(Print),
+        &SR(Jne), &SR(Swap), &SR(Dup), &SR(Je), &SR(Inc),
+        &SR(Add), &SR(Sub), &SR(Mul), &SR(Rand), &SR(Dec),
+        &SR(Drop), &SR(Over), &SR(Mod), &SR(Jump),
+        &SR(And), &SR(Or), &SR(Xor),
+        &SR(SHL), &SR(SHR),
+        &SR(SQRT),
+        &SR(Rot),
+        &SR(Pick)
+    };
+
+#undef LOOP_COUNTED
+#undef SR
+#undef ROUTINES
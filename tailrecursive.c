@@ -37,19 +37,26 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "checkpoint.h"
+#include "output.h"
+#include "vm.h"
+
+struct vm {
+    cpu_t cpu;
+    cpu_t *volatile running; /* Copy of cpu used by vm_run(), if any */
+    volatile sig_atomic_t preempted;
+};
 
-/* TODO:a global - not good. Should be moved into cpu state or somewhere else */
-static uint64_t steplimit = LLONG_MAX;
 
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->pmem_size);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
-        printf("PC out of bounds\n");
+    if (!(pcpu->pc < pcpu->pmem_size)) {
+        print_message("PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
     }
@@ -89,8 +96,8 @@ static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
     case Instr_JNE:
     case Instr_JE:
     case Instr_Jump:
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
+        if (!(pcpu->pc+1 < pcpu->pmem_size)) {
+            print_message("PC+1 out of bounds\n");
             result.length = 1;
             result.opcode = Instr_Break;
             break;
@@ -114,28 +121,43 @@ static inline decode_t fetch_decode(cpu_t *pcpu) {
 /*** Service routines ***/
 #define BAIL_ON_ERROR() if (pcpu->state != Cpu_Running) return;
 
-#define DISPATCH() service_routines[pdecoded->opcode](pcpu, pdecoded);
+#define DISPATCH() ROUTINES[pdecoded->opcode](pcpu, pdecoded);
 
+/* Routines are in tailrecursive-routines.h, once to count steps and once
+   not to. Those that do not count check for preemption only on branches,
+   which every loop of the guest goes through */
 #define ADVANCE_PC() do {\
     pcpu->pc += pdecoded->length;\
-    pcpu->steps++; \
-    if (pcpu->state != Cpu_Running || pcpu->steps >= steplimit) return;\
+    if (LOOP_COUNTED) \
+        pcpu->steps++; \
+    if (pcpu->state != Cpu_Running \
+        || (LOOP_COUNTED && pcpu->steps >= pcpu->steplimit)) return;\
+} while(0);
+
+#define ADVANCE_PC_BRANCH() do {\
+    pcpu->pc += pdecoded->length;\
+    if (LOOP_COUNTED) \
+        pcpu->steps++; \
+    if (pcpu->state != Cpu_Running || pcpu->steps >= STEPLIMIT(pcpu)) return;\
 } while(0);
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
+    STACK_BARRIER();
+#ifndef STACK_GUARD
+    if (pcpu->sp >= pcpu->stack_capacity-1 && !grow_stack(pcpu)) {
+        print_message("Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
     }
+#endif
     pcpu->stack[++pcpu->sp] = v;
 }
 
 static inline uint32_t pop(cpu_t *pcpu) {
     assert(pcpu);
     if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
+        print_message("Stack underflow\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -145,7 +167,7 @@ static inline uint32_t pop(cpu_t *pcpu) {
 static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
     assert(pcpu);
     if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
+        print_message("Out of bound picking\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -153,296 +175,81 @@ static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
 }
 
 typedef void (*service_routine_t)(cpu_t *pcpu, decode_t* pdecode);
-service_routine_t service_routines[];
-
-void sr_Nop(cpu_t *pcpu, decode_t *pdecoded) {
-    /* Do nothing */
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Halt(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->state = Cpu_Halted;
-    ADVANCE_PC();
-    return;
-}
-
-void sr_Push(cpu_t *pcpu, decode_t *pdecoded) {
-    push(pcpu, pdecoded->immediate);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Print(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    printf("[%d]\n", tmp1);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Swap(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
 
-void sr_Dup(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp1);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Over(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp2);
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Inc(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1+1);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Add(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 + tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Sub(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 - tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Mod(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp2 == 0) {
-        pcpu->state = Cpu_Break;
-        return;
+#define LOOP_COUNTED 1
+#define SR(name) sr_##name##_counted
+#define ROUTINES counted_routines
+#include "tailrecursive-routines.h"
+
+#define LOOP_COUNTED 0
+#define SR(name) sr_##name
+#define ROUTINES service_routines
+#include "tailrecursive-routines.h"
+
+vm_t *vm_create(const Instr_t *program, uint32_t len, const options_t *opts) {
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (vm == NULL) {
+        fprintf(stderr, "Failed to allocate memory for virtual machine.\n");
+        exit(2);
+    }
+    vm->cpu = init_cpu(program, len, opts);
+    vm->running = NULL;
+    vm->preempted = 0;
+    return vm;
+}
+
+void vm_preempt(vm_t *vm) {
+    vm->preempted = 1;
+    cpu_t *pcpu = vm->running;
+    if (pcpu)
+        pcpu->steplimit = 0;
+}
+
+cpu_state_t vm_run(vm_t *vm, uint64_t budget) {
+    const int counted = budget != UNLIMITED_STEPS;
+    const service_routine_t *routines = counted ? counted_routines
+                                                : service_routines;
+    cpu_t cpu = vm->cpu;
+    cpu.steplimit = run_steplimit(&cpu, budget);
+    vm->running = &cpu;
+    if (vm->preempted)
+        cpu.steplimit = cpu.steps;
+
+    watch_stack(&cpu);
+    /* Service routines only check the limit after an instruction */
+    if (cpu.state == Cpu_Running && cpu.steps < cpu.steplimit) {
+        if (!STACK_FAULT_CAUGHT()) {
+            decode_t decoded = fetch_decode(&cpu);
+            routines[decoded.opcode](&cpu, &decoded);
+        } else {
+            /* The instruction that overflowed counts as executed, as with
+               the checks in push() */
+            cpu.pc += fetch_decode(&cpu).length;
+            cpu.steps += counted;
+        }
     }
-    push(pcpu, tmp1 % tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Mul(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 * tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Rand(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = rand();
-    push(pcpu, tmp1);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Dec(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1-1);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Drop(cpu_t *pcpu, decode_t *pdecoded) {
-    (void)pop(pcpu);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Je(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp1 == 0)
-        pcpu->pc += pdecoded->immediate;
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Jne(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    if (tmp1 != 0)
-        pcpu->pc += pdecoded->immediate;
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Jump(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->pc += pdecoded->immediate;
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_And(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 & tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Or(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 | tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_Xor(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 ^ tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_SHL(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 << tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
-
-void sr_SHR(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1 >> tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
-}
 
-void sr_Rot(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    uint32_t tmp3 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, tmp1);
-    push(pcpu, tmp3);
-    push(pcpu, tmp2);
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
+    if (cpu.state != Cpu_Running)
+        flush_output(); /* All output of a finished guest is out */
+    vm->running = NULL;
+    vm->preempted = 0;
+    vm->cpu = cpu;
+    return cpu.state;
 }
 
-void sr_SQRT(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, sqrt(tmp1));
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
+const cpu_t *vm_cpu(const vm_t *vm) {
+    return &vm->cpu;
 }
 
-void sr_Pick(cpu_t *pcpu, decode_t *pdecoded) {
-    uint32_t tmp1 = pop(pcpu);
-    BAIL_ON_ERROR();
-    push(pcpu, pick(pcpu, tmp1));
-    ADVANCE_PC();
-    *pdecoded = fetch_decode(pcpu);
-    DISPATCH();
+int vm_restore(vm_t *vm, const cpu_t *state) {
+    return restore_cpu(&vm->cpu, state);
 }
 
-void sr_Break(cpu_t *pcpu, decode_t *pdecoded) {
-    pcpu->state = Cpu_Break;
-    ADVANCE_PC();
-    /* No need to dispatch after Break */
-    return;
+void vm_report(const vm_t *vm) {
+    (void)vm;
 }
 
-service_routine_t service_routines[] = {
-        &sr_Break, &sr_Nop, &sr_Halt, &sr_Push, &sr_Print,
-        &sr_Jne, &sr_Swap, &sr_Dup, &sr_Je, &sr_Inc,
-        &sr_Add, &sr_Sub, &sr_Mul, &sr_Rand, &sr_Dec,
-        &sr_Drop, &sr_Over, &sr_Mod, &sr_Jump,
-        &sr_And, &sr_Or, &sr_Xor,
-        &sr_SHL, &sr_SHR,
-        &sr_SQRT,
-        &sr_Rot,
-        &sr_Pick
-    };
-
-int main(int argc, char **argv) {
-    steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
-
-    decode_t decoded = fetch_decode(&cpu);
-    service_routines[decoded.opcode](&cpu, &decoded);
-
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %ld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
-    }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
-
-    free(LoadedProgram);
-
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+void vm_destroy(vm_t *vm) {
+    destroy_cpu(&vm->cpu);
+    free(vm);
 }
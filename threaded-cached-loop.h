@@ -0,0 +1,263 @@
+/*  threaded-cached-loop.h - the loop of the threaded interpreter with a
+    decoded cache, included by threaded-cached.c counting steps or not
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* The body of a function with vm and budget in scope. Expects the macro
+   LOOP_COUNTED, 1 to count steps against the limit and 0 not to, and
+   undefines it. Labels differ between the two, so each has a cache of its
+   own in vm->shared[LOOP_COUNTED]. */
+
+    const void* service_routines[] = {
+        &&sr_Break, &&sr_Nop, &&sr_Halt, &&sr_Push, &&sr_Print,
+        &&sr_Jne, &&sr_Swap, &&sr_Dup, &&sr_Je, &&sr_Inc,
+        &&sr_Add, &&sr_Sub, &&sr_Mul, &&sr_Rand, &&sr_Dec,
+        &&sr_Drop, &&sr_Over, &&sr_Mod, &&sr_Jump,
+        &&sr_And, &&sr_Or, &&sr_Xor,
+        &&sr_SHL, &&sr_SHR,
+        &&sr_SQRT, &&sr_Rot, &&sr_Pick, NULL /* This NULL seems to be essential to keep GCC from over-optimizing? */
+    };
+
+    /* Labels are only known here, so the cache is set up by the first run
+       of any machine with this program */
+    const char *decode_routine = &&sr_Decode;
+    decode_job_t job = {.service_routines = service_routines,
+                        .decode_routine = decode_routine,
+                        .nthreads = vm->decode_threads};
+    decode_t *decoded_cache =
+        shared_code_data(vm->shared[LOOP_COUNTED], build_decoded, &job);
+
+    cpu_t cpu = vm->cpu;
+    cpu.steplimit = run_steplimit(&cpu, budget);
+    vm->running = &cpu;
+    if (vm->preempted || cpu.state != Cpu_Running
+        || cpu.steps >= cpu.steplimit)
+        goto stopped;
+
+    watch_stack(&cpu);
+    if (STACK_FAULT_CAUGHT()) {
+        /* The instruction that overflowed counts as executed, as with the
+           checks in push() */
+        cpu.pc += load_slot(&decoded_cache[cpu.pc]).length;
+        cpu.steps += LOOP_COUNTED;
+        goto stopped;
+    }
+
+    uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
+    decode_t decoded = {0};
+    do {
+        DISPATCH();
+        sr_Nop:
+            /* Do nothing */
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Halt:
+            cpu.state = Cpu_Halted;
+            ADVANCE_PC();
+            /* No need to dispatch after Halt */
+        sr_Push:
+            push(&cpu, decoded.immediate);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Print:
+            tmp1 = pop(&cpu); BAIL_ON_ERROR();
+            print_value(tmp1);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Swap:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1);
+            push(&cpu, tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Dup:
+            tmp1 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1);
+            push(&cpu, tmp1);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Over:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp2);
+            push(&cpu, tmp1);
+            push(&cpu, tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Inc:
+            tmp1 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1+1);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Add:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1 + tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Sub:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1 - tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Mod:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            if (tmp2 == 0) {
+                cpu.state = Cpu_Break;
+                break;
+            }
+            push(&cpu, tmp1 % tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Mul:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1 * tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Rand:
+            tmp1 = next_random(&cpu.random);
+            push(&cpu, tmp1);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Dec:
+            tmp1 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1-1);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Drop:
+            (void)pop(&cpu);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Je:
+            tmp1 = pop(&cpu);
+            BAIL_ON_ERROR();
+            if (tmp1 == 0)
+                cpu.pc += decoded.immediate;
+            ADVANCE_PC_BRANCH();
+            DISPATCH();
+        sr_Jne:
+            tmp1 = pop(&cpu);
+            BAIL_ON_ERROR();
+            if (tmp1 != 0)
+                cpu.pc += decoded.immediate;
+            ADVANCE_PC_BRANCH();
+            DISPATCH();
+        sr_Jump:
+            cpu.pc += decoded.immediate;
+            ADVANCE_PC_BRANCH();
+            DISPATCH();
+        sr_And:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1 & tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Or:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1 | tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Xor:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1 ^ tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_SHL:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1 << tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_SHR:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1 >> tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Rot:
+            tmp1 = pop(&cpu);
+            tmp2 = pop(&cpu);
+            tmp3 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, tmp1);
+            push(&cpu, tmp3);
+            push(&cpu, tmp2);
+            ADVANCE_PC();
+            DISPATCH();
+        sr_SQRT:
+            tmp1 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, sqrt(tmp1));
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Pick:
+            tmp1 = pop(&cpu);
+            BAIL_ON_ERROR();
+            push(&cpu, pick(&cpu, tmp1));
+            ADVANCE_PC();
+            DISPATCH();
+        sr_Decode:
+            /* First dispatch to this address, no step is taken */
+            decoded = decode_slot(&decoded_cache[cpu.pc], cpu.pmem,
+                                  cpu.pmem_size, cpu.pc, service_routines,
+                                  decode_routine);
+            goto *(decode_routine + (uintptr_t)decoded.sr);
+        sr_Break:
+            cpu.state = Cpu_Break;
+            ADVANCE_PC();
+            /* No need to dispatch after Break */
+    } while(cpu.state == Cpu_Running);
+
+stopped:
+    if (cpu.state != Cpu_Running)
+        flush_output(); /* All output of a finished guest is out */
+    vm->running = NULL;
+    vm->preempted = 0;
+    vm->cpu = cpu;
+    return cpu.state;
+
+#undef LOOP_COUNTED
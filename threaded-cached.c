@@ -37,9 +37,23 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <math.h>
 
 #include "common.h"
+#include "checkpoint.h"
+#include "output.h"
+#include "sharedcode.h"
+#include "vm.h"
 
-static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
-    assert(addr < PROGRAM_SIZE);
+struct vm {
+    cpu_t cpu;
+    shared_code_t *shared[2]; /* Decoded program, shared by all machines,
+                                 for runs not counting steps and counting */
+    uint32_t decode_threads;
+    cpu_t *volatile running; /* Copy of cpu used by vm_run(), if any */
+    volatile sig_atomic_t preempted;
+};
+
+static inline decode_t decode_at_address(const Instr_t* prog,
+                                         uint32_t len, uint32_t addr) {
+    assert(addr < len);
     decode_t result = {0};
     Instr_t raw_instr = prog[addr];
     result.opcode = raw_instr;
@@ -72,8 +86,8 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
     case Instr_JNE:
     case Instr_JE:
     case Instr_Jump:
-        if (!(addr+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
+        if (!(addr+1 < len)) {
+            print_message("PC+1 out of bounds\n");
             result.length = 1;
             result.opcode = Instr_Break;
             break;
@@ -94,29 +108,47 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
 #define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) break;
 
 #define DISPATCH()\
-    if (!(cpu.pc < PROGRAM_SIZE)) {cpu.state = Cpu_Break; break;};\
-    decoded = decoded_cache[cpu.pc]; \
-    goto *decoded.sr;
+    if (!(cpu.pc < cpu.pmem_size)) {\
+        print_message("PC out of bounds\n");\
+        cpu.state = Cpu_Break;\
+        break;\
+    };\
+    decoded = load_slot(&decoded_cache[cpu.pc]); \
+    goto *(decode_routine + (uintptr_t)decoded.sr);
 
 #define ADVANCE_PC() \
     cpu.pc += decoded.length;\
-    cpu.steps++; \
-    if (cpu.state != Cpu_Running || cpu.steps >= steplimit) break;
+    if (LOOP_COUNTED) \
+        cpu.steps++; \
+    if (cpu.state != Cpu_Running \
+        || (LOOP_COUNTED && cpu.steps >= cpu.steplimit)) break;
+
+/* Every loop goes through a branch, so only branches read the step limit
+   from memory, where preemption lowers it. Without counting, steps keep
+   their value and only preemption brings the limit down to them */
+#define ADVANCE_PC_BRANCH() \
+    cpu.pc += decoded.length;\
+    if (LOOP_COUNTED) \
+        cpu.steps++; \
+    if (cpu.state != Cpu_Running || cpu.steps >= STEPLIMIT(&cpu)) break;
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
+    STACK_BARRIER();
+#ifndef STACK_GUARD
+    if (pcpu->sp >= pcpu->stack_capacity-1 && !grow_stack(pcpu)) {
+        print_message("Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
     }
+#endif
     pcpu->stack[++pcpu->sp] = v;
 }
 
 static inline uint32_t pop(cpu_t *pcpu) {
     assert(pcpu);
     if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
+        print_message("Stack underflow\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -126,240 +158,144 @@ static inline uint32_t pop(cpu_t *pcpu) {
 static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
     assert(pcpu);
     if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
+        print_message("Out of bound picking\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
     return pcpu->stack[pcpu->sp - pos];
 }
 
-static void predecode_program(const Instr_t *prog, const void* *in_sr,
-                           decode_t *dec, int len) {
-    assert(prog);
-    assert(in_sr);
-    assert(dec);
-    /* The program is short, so we can decode it as a whole.
-       Otherwise, some sort of lazy decoding will be required */
-    for (int i=0; i < len; i++) {
-        decode_t decoded = decode_at_address(prog, i);
-        decoded.sr = in_sr[decoded.opcode];
-        dec[i] = decoded;
-    }
+/* The sr of an entry is the distance of its service routine from
+   sr_Decode, so a zeroed entry dispatches to sr_Decode. Unless
+   --decode-threads asks to decode the whole program first, entries start
+   zeroed, and sr_Decode decodes an address when it is first reached and
+   dispatches again. Machines of several threads may decode the same
+   address at once. They store the same values, sr last, so an entry read
+   by load_slot() with a nonzero sr is complete */
+static inline decode_t load_slot(const decode_t *slot) {
+    decode_t result;
+    result.sr = __atomic_load_n(&slot->sr, __ATOMIC_ACQUIRE);
+    result.opcode = slot->opcode;
+    result.length = slot->length;
+    result.immediate = slot->immediate;
+    return result;
 }
 
+/* Inlined so that neither copy of the loop needs a frame pointer for the
+   call. */
+static inline __attribute__((always_inline))
+decode_t decode_slot(decode_t *slot, const Instr_t *prog, uint32_t len,
+                     uint32_t addr, const void **service_routines,
+                     const char *decode_routine) {
+    decode_t decoded = decode_at_address(prog, len, addr);
+    decoded.sr = (const void *)((uintptr_t)service_routines[decoded.opcode]
+                                - (uintptr_t)decode_routine);
+    slot->opcode = decoded.opcode;
+    slot->length = decoded.length;
+    slot->immediate = decoded.immediate;
+    __atomic_store_n(&slot->sr, decoded.sr, __ATOMIC_RELEASE);
+    return decoded;
+}
 
-int main(int argc, char **argv) {
-
-    const void* service_routines[] = {
-        &&sr_Break, &&sr_Nop, &&sr_Halt, &&sr_Push, &&sr_Print,
-        &&sr_Jne, &&sr_Swap, &&sr_Dup, &&sr_Je, &&sr_Inc,
-        &&sr_Add, &&sr_Sub, &&sr_Mul, &&sr_Rand, &&sr_Dec,
-        &&sr_Drop, &&sr_Over, &&sr_Mod, &&sr_Jump,
-        &&sr_And, &&sr_Or, &&sr_Xor,
-        &&sr_SHL, &&sr_SHR,
-        &&sr_SQRT, &&sr_Rot, &&sr_Pick, NULL /* This NULL seems to be essential to keep GCC from over-optimizing? */
-    };
+typedef struct {
+    const Instr_t *program;
+    uint32_t len;
+    decode_t *decoded;
+    const void **service_routines;
+    const char *decode_routine;
+    uint32_t nthreads;
+} decode_job_t;
 
-    uint64_t steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
+/* Every address is decoded on its own, so parts need no stitching */
+static void decode_part(void *arg, int part, uint32_t begin, uint32_t end) {
+    const decode_job_t *job = arg;
+    (void)part;
+    for (uint32_t i = begin; i < end; i++)
+        decode_slot(&job->decoded[i], job->program, job->len, i,
+                    job->service_routines, job->decode_routine);
+}
 
-    decode_t decoded_cache[PROGRAM_SIZE];
-    predecode_program(cpu.pmem, service_routines, decoded_cache, PROGRAM_SIZE);
+/* arg is the decode job with service routines filled in. Fresh pages are
+   zeroed, so a cache decoded lazily costs nothing until it is used */
+static void *build_decoded(shared_code_t *sc, void *arg) {
+    decode_job_t *job = arg;
+    decode_t *decoded = alloc_sealable(sc->len * sizeof(decode_t));
+    if (job->nthreads == 0)
+        return decoded;
+    job->program = sc->program;
+    job->len = sc->len;
+    job->decoded = decoded;
+    uint32_t bounds[MAX_PARTS + 1];
+    const int nparts = partition(sc->len, job->nthreads, bounds);
+    run_parts(nparts, bounds, decode_part, job);
+    seal(decoded, sc->len * sizeof(decode_t));
+    return decoded;
+}
 
-    uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
-    decode_t decoded = {0};
-    do {
-        DISPATCH();
-        sr_Nop:
-            /* Do nothing */
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Halt:
-            cpu.state = Cpu_Halted;
-            ADVANCE_PC();
-            /* No need to dispatch after Halt */
-        sr_Push:
-            push(&cpu, decoded.immediate);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Dup:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Inc:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp2 == 0) {
-                cpu.state = Cpu_Break;
-                break;
-            }
-            push(&cpu, tmp1 % tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Rand:
-            tmp1 = rand();
-            push(&cpu, tmp1);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Dec:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Drop:
-            (void)pop(&cpu);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Je:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 == 0)
-                cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Jne:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 != 0)
-                cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Jump:
-            cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            DISPATCH();
-        sr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            DISPATCH();
-        sr_SQRT:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Pick:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
-            ADVANCE_PC();
-            DISPATCH();
-        sr_Break:
-            cpu.state = Cpu_Break;
-            ADVANCE_PC();
-            /* No need to dispatch after Break */
-    } while(cpu.state == Cpu_Running);
+static void destroy_decoded(shared_code_t *sc) {
+    free_sealable(sc->data, sc->len * sizeof(decode_t));
+}
 
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %ld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
+vm_t *vm_create(const Instr_t *program, uint32_t len, const options_t *opts) {
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (vm == NULL) {
+        fprintf(stderr, "Failed to allocate memory for virtual machine.\n");
+        exit(2);
     }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
+    if (opts == NULL)
+        opts = &DefOptions;
+    for (int counted = 0; counted < 2; counted++)
+        vm->shared[counted] = get_shared_code(program, len, &counted,
+                                              sizeof(counted));
+    vm->cpu = init_cpu(vm->shared[0]->program, len, opts);
+    vm->decode_threads = opts->decode_threads;
+    vm->running = NULL;
+    vm->preempted = 0;
+    return vm;
+}
+
+/* The decoded program is shared, so instead of diverting dispatches the
+   running machine sees its step limit drop at the next branch */
+void vm_preempt(vm_t *vm) {
+    vm->preempted = 1;
+    cpu_t *pcpu = vm->running;
+    if (pcpu)
+        pcpu->steplimit = 0;
+}
+
+/* GCC does not inline functions with computed gotos, so the loop is in
+   threaded-cached-loop.h, included in a copy that counts steps and one
+   that does not */
+static cpu_state_t run_counted(vm_t *vm, uint64_t budget) {
+#define LOOP_COUNTED 1
+#include "threaded-cached-loop.h"
+}
+
+static cpu_state_t run_uncounted(vm_t *vm, uint64_t budget) {
+#define LOOP_COUNTED 0
+#include "threaded-cached-loop.h"
+}
+
+cpu_state_t vm_run(vm_t *vm, uint64_t budget) {
+    return budget != UNLIMITED_STEPS ? run_counted(vm, budget)
+                                     : run_uncounted(vm, budget);
+}
+
+const cpu_t *vm_cpu(const vm_t *vm) {
+    return &vm->cpu;
+}
 
-    free(LoadedProgram);
+int vm_restore(vm_t *vm, const cpu_t *state) {
+    return restore_cpu(&vm->cpu, state);
+}
+
+void vm_report(const vm_t *vm) {
+    (void)vm;
+}
 
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+void vm_destroy(vm_t *vm) {
+    put_shared_code(vm->shared[0], destroy_decoded);
+    put_shared_code(vm->shared[1], destroy_decoded);
+    destroy_cpu(&vm->cpu);
+    free(vm);
 }
@@ -31,21 +31,39 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 #include <stdbool.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <limits.h>
 #include <math.h>
 
 #include "common.h"
+#include "checkpoint.h"
+#include "compact.h"
+#include "container.h"
+#include "output.h"
+#include "vm.h"
+
+/* Guest opcodes and a terminating NULL */
+#define SR_TABLE_SIZE (Instr_Pick + 2)
+
+struct vm {
+    cpu_t cpu;
+    void *service_routines[SR_TABLE_SIZE];
+    void *preempt_target;
+    cpu_t *volatile running; /* Copy of cpu used by vm_run(), if any */
+    volatile sig_atomic_t preempted;
+    const compact_t *compact; /* Run instead of the words, if present */
+};
 
 static inline Instr_t fetch(const cpu_t *pcpu) {
     assert(pcpu);
-    assert(pcpu->pc < PROGRAM_SIZE);
+    assert(pcpu->pc < pcpu->pmem_size);
     return pcpu->pmem[pcpu->pc];
 };
 
 static inline Instr_t fetch_checked(cpu_t *pcpu) {
-    if (!(pcpu->pc < PROGRAM_SIZE)) {
-        printf("PC out of bounds\n");
+    if (!(pcpu->pc < pcpu->pmem_size)) {
+        print_message("PC out of bounds\n");
         pcpu->state = Cpu_Break;
         return Instr_Break;
     }
@@ -86,8 +104,8 @@ static inline decode_t decode(Instr_t raw_instr, const cpu_t *pcpu) {
     case Instr_JE:
     case Instr_Jump:
         result.length = 2;
-        if (!(pcpu->pc+1 < PROGRAM_SIZE)) {
-            printf("PC+1 out of bounds\n");
+        if (!(pcpu->pc+1 < pcpu->pmem_size)) {
+            print_message("PC+1 out of bounds\n");
             result.length = 1;
             result.opcode = Instr_Break;
             break;
@@ -107,6 +125,16 @@ static inline decode_t fetch_decode(cpu_t *pcpu) {
     return decode(fetch_checked(pcpu), pcpu);
 }
 
+/* The same for compact code */
+static inline decode_t fetch_compact(cpu_t *pcpu, const compact_t *compact) {
+    if (!(pcpu->pc < compact->size)) {
+        print_message("PC out of bounds\n");
+        pcpu->state = Cpu_Break;
+        return (decode_t){.opcode = Instr_Break, .length = 1};
+    }
+    return decode_compact(compact, pcpu->pc);
+}
+
 /*** Service routines ***/
 #define BAIL_ON_ERROR() if (cpu.state != Cpu_Running) break;
 
@@ -124,23 +152,28 @@ __asm__ __volatile__("nopl 0x55667788(%%rax)":::"memory");
 
 #define ADVANCE_PC() \
     cpu.pc += decoded.length;\
-    cpu.steps++; \
-    if (cpu.state != Cpu_Running || cpu.steps >= steplimit) break;
+    if (LOOP_COUNTED) \
+        cpu.steps++; \
+    if (cpu.state != Cpu_Running \
+        || (LOOP_COUNTED && cpu.steps >= cpu.steplimit)) break;
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
+    STACK_BARRIER();
+#ifndef STACK_GUARD
+    if (pcpu->sp >= pcpu->stack_capacity-1 && !grow_stack(pcpu)) {
+        print_message("Stack overflow\n");
         pcpu->state = Cpu_Break;
         return;
     }
+#endif
     pcpu->stack[++pcpu->sp] = v;
 }
 
 static inline uint32_t pop(cpu_t *pcpu) {
     assert(pcpu);
     if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
+        print_message("Stack underflow\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -150,7 +183,7 @@ static inline uint32_t pop(cpu_t *pcpu) {
 static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
     assert(pcpu);
     if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
+        print_message("Out of bound picking\n");
         pcpu->state = Cpu_Break;
         return 0;
     }
@@ -158,241 +191,91 @@ static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
 }
 
 
-int main(int argc, char **argv) {
-
-    static void* service_routines[] = {
-        &&sr_Break, &&sr_Nop, &&sr_Halt, &&sr_Push, &&sr_Print,
-        &&sr_Jne, &&sr_Swap, &&sr_Dup, &&sr_Je, &&sr_Inc,
-        &&sr_Add, &&sr_Sub, &&sr_Mul, &&sr_Rand, &&sr_Dec,
-        &&sr_Drop, &&sr_Over, &&sr_Mod, &&sr_Jump,
-        &&sr_And, &&sr_Or, &&sr_Xor,
-        &&sr_SHL, &&sr_SHR,
-        &&sr_SQRT, &&sr_Rot, &&sr_Pick, NULL /* This NULL seems to be essential to keep GCC from over-optimizing? */
-    };
-
-    uint64_t steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
-
-    uint32_t tmp1 = 0, tmp2 = 0, tmp3 = 0;
-    decode_t decoded = fetch_decode(&cpu);
-    DISPATCH();
-    do {
-
-        sr_Nop:
-            /* Do nothing */
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Halt:
-            cpu.state = Cpu_Halted;
-            ADVANCE_PC();
-            /* No need to dispatch after Halt */
-        sr_Push:
-            push(&cpu, decoded.immediate);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Print:
-            tmp1 = pop(&cpu); BAIL_ON_ERROR();
-            printf("[%d]\n", tmp1);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Swap:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Dup:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp1);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Over:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp2);
-            push(&cpu, tmp1);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Inc:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1+1);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Add:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 + tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Sub:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 - tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Mod:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp2 == 0) {
-                cpu.state = Cpu_Break;
-                break;
-            }
-            push(&cpu, tmp1 % tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Mul:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 * tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Rand:
-            tmp1 = rand();
-            push(&cpu, tmp1);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Dec:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1-1);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Drop:
-            (void)pop(&cpu);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Je:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 == 0)
-                cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Jne:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            if (tmp1 != 0)
-                cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Jump:
-            cpu.pc += decoded.immediate;
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_And:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 & tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Or:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 | tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Xor:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 ^ tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_SHL:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 << tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_SHR:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1 >> tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Rot:
-            tmp1 = pop(&cpu);
-            tmp2 = pop(&cpu);
-            tmp3 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, tmp1);
-            push(&cpu, tmp3);
-            push(&cpu, tmp2);
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_SQRT:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, sqrt(tmp1));
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Pick:
-            tmp1 = pop(&cpu);
-            BAIL_ON_ERROR();
-            push(&cpu, pick(&cpu, tmp1));
-            ADVANCE_PC();
-            decoded = fetch_decode(&cpu);
-            DISPATCH();
-        sr_Break:
-            cpu.state = Cpu_Break;
-            ADVANCE_PC();
-            /* No need to dispatch after Break */
-    } while(cpu.state == Cpu_Running);
-
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %ld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
+vm_t *vm_create(const Instr_t *program, uint32_t len, const options_t *opts) {
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (vm == NULL) {
+        fprintf(stderr, "Failed to allocate memory for virtual machine.\n");
+        exit(2);
     }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
+    vm->cpu = init_cpu(program, len, opts);
+    const program_info_t *info = program_info(program);
+    vm->compact = info ? info->compact : NULL;
+    vm->service_routines[0] = NULL;
+    vm->running = NULL;
+    vm->preempted = 0;
+    return vm;
+}
+
+/* Preemption diverts every dispatch to vm->preempt_target */
+void vm_preempt(vm_t *vm) {
+    vm->preempted = 1;
+    cpu_t *pcpu = vm->running;
+    if (!pcpu)
+        return;
+    pcpu->steplimit = 0;
+    for (int i = 0; vm->service_routines[i]; i++)
+        vm->service_routines[i] = vm->preempt_target;
+}
+
+/* GCC does not inline functions with computed gotos, so the loop is in
+   threaded-loop.h, included once for compact code and once for the words,
+   each in a copy that counts steps and one that does not. The latter needs
+   no check at all for preemption, which patches the dispatch table. */
+static cpu_state_t run_compact_counted(vm_t *vm, uint64_t budget) {
+#define LOOP_COUNTED 1
+#define LOOP_ENTER() \
+    const compact_t *compact = enter_compact(vm->compact, &cpu)
+#define LOOP_FETCH() fetch_compact(&cpu, compact)
+#define LOOP_LEAVE() leave_compact(compact, &cpu)
+#include "threaded-loop.h"
+}
 
-    free(LoadedProgram);
+static cpu_state_t run_compact(vm_t *vm, uint64_t budget) {
+#define LOOP_COUNTED 0
+#define LOOP_ENTER() \
+    const compact_t *compact = enter_compact(vm->compact, &cpu)
+#define LOOP_FETCH() fetch_compact(&cpu, compact)
+#define LOOP_LEAVE() leave_compact(compact, &cpu)
+#include "threaded-loop.h"
+}
+
+static cpu_state_t run_words_counted(vm_t *vm, uint64_t budget) {
+#define LOOP_COUNTED 1
+#define LOOP_ENTER() ((void)0)
+#define LOOP_FETCH() fetch_decode(&cpu)
+#define LOOP_LEAVE() ((void)0)
+#include "threaded-loop.h"
+}
+
+static cpu_state_t run_words(vm_t *vm, uint64_t budget) {
+#define LOOP_COUNTED 0
+#define LOOP_ENTER() ((void)0)
+#define LOOP_FETCH() fetch_decode(&cpu)
+#define LOOP_LEAVE() ((void)0)
+#include "threaded-loop.h"
+}
+
+cpu_state_t vm_run(vm_t *vm, uint64_t budget) {
+    const int counted = budget != UNLIMITED_STEPS;
+    if (vm->compact && to_byte_pc(vm->compact, vm->cpu.pc) != UINT32_MAX)
+        return counted ? run_compact_counted(vm, budget)
+                       : run_compact(vm, budget);
+    return counted ? run_words_counted(vm, budget) : run_words(vm, budget);
+}
+
+const cpu_t *vm_cpu(const vm_t *vm) {
+    return &vm->cpu;
+}
+
+int vm_restore(vm_t *vm, const cpu_t *state) {
+    return restore_cpu(&vm->cpu, state);
+}
+
+void vm_report(const vm_t *vm) {
+    (void)vm;
+}
 
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
+void vm_destroy(vm_t *vm) {
+    destroy_cpu(&vm->cpu);
+    free(vm);
 }
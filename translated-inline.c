@@ -75,8 +75,9 @@ const char str_pop[] = "Stack underflow\n";
 /* For printf("Stack overflow\n"); in push function. */
 const char str_push[] = "Stack overflow\n";
 
-static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
-    assert(addr < PROGRAM_SIZE);
+static inline decode_t decode_at_address(const Instr_t* prog,
+                                         uint32_t len, uint32_t addr) {
+    assert(addr < len);
     decode_t result = {0};
     Instr_t raw_instr = prog[addr];
     result.opcode = raw_instr;
@@ -110,7 +111,7 @@ static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
     case Instr_JE:
     case Instr_Jump:
         result.length = 2;
-        assert(addr+1 < PROGRAM_SIZE);
+        assert(addr+1 < len);
         result.immediate = (int32_t)prog[addr+1];
         break;
     case Instr_Break:
@@ -134,11 +135,14 @@ static void exit_generated_code() {
 
 static inline void push(cpu_t *pcpu, uint32_t v) {
     assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
+    STACK_BARRIER();
+#ifndef STACK_GUARD
+    if (pcpu->sp >= pcpu->stack_capacity-1 && !grow_stack(pcpu)) {
         printf("Stack overflow\n");
         pcpu->state = Cpu_Break;
         exit_generated_code();
     }
+#endif
     pcpu->stack[++pcpu->sp] = v;
 }
 
@@ -157,7 +161,7 @@ static void inline_translate_program(const Instr_t *prog,
     char* cur = out_code; /* Where to put new code */
 
     while (i < len) {
-        decode_t decoded = decode_at_address(prog, i);
+        decode_t decoded = decode_at_address(prog, len, i);
         entrypoints[i] = (void*) cur;
 
         /* Address of function relative of the end of call.
@@ -558,14 +562,17 @@ int main(int argc, char **argv) {
     /* Pre-populate resulting code buffer with INT3 (machine code 0xCC).
        This will help to catch jumps to wrong locations */
     memset(gen_code, 0xcc, JIT_CODE_SIZE);
-    void* entrypoints[PROGRAM_SIZE] = {0}; /* a map of guest PCs to capsules */
+    /* a map of guest PCs to capsules */
+    void** entrypoints = calloc(cpu.pmem_size, sizeof(void*));
 
-    inline_translate_program(cpu.pmem, gen_code, entrypoints, PROGRAM_SIZE);
+    inline_translate_program(cpu.pmem, gen_code, entrypoints, cpu.pmem_size);
 
+    watch_stack(&cpu);
+    STACK_FAULT_CAUGHT(); /* Will get here after a stack fault */
     setjmp(return_buf); /* Will get here from generated code. */
 
     while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
-        if (cpu.pc > PROGRAM_SIZE) {
+        if (cpu.pc >= cpu.pmem_size) {
             cpu.state = Cpu_Break;
             break;
         }
@@ -584,7 +591,9 @@ int main(int argc, char **argv) {
     }
     printf("%s\n", cpu.sp == -1? "(empty)": "");
 
-    free(LoadedProgram);
+    free(entrypoints);
+    destroy_cpu(&cpu);
+    free_program(LoadedProgram, LoadedProgramSize);
 
     return cpu.state == Cpu_Halted ||
            (cpu.state == Cpu_Running &&
@@ -0,0 +1,237 @@
+/*  translated-routines.h - service routines called by code of the binary
+    translator, included by translated.c counting steps or not
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Expects the macros LOOP_COUNTED, 1 to count steps against the limit and
+   0 not to, SR(name), the name of the routine of an instruction, and
+   ROUTINES, the name of their table, and undefines them. */
+
+void SR(Nop)() {
+    /* Do nothing */
+    ADVANCE_PC(1);
+}
+
+void SR(Halt)() {
+    pcpu->state = Cpu_Halted;
+    ADVANCE_PC(1);
+    exit_generated_code();
+}
+
+void SR(Push)(int32_t immediate) {
+    push(pcpu, immediate);
+    ADVANCE_PC(2);
+}
+
+void SR(Print)() {
+    uint32_t tmp1 = pop(pcpu);
+    print_value(tmp1);
+    ADVANCE_PC(1);
+}
+
+void SR(Swap)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    push(pcpu, tmp1);
+    push(pcpu, tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(Dup)() {
+    uint32_t tmp1 = pop(pcpu);
+    push(pcpu, tmp1);
+    push(pcpu, tmp1);
+    ADVANCE_PC(1);
+}
+
+void SR(Over)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    push(pcpu, tmp2);
+    push(pcpu, tmp1);
+    push(pcpu, tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(Inc)() {
+    uint32_t tmp1 = pop(pcpu);
+    push(pcpu, tmp1+1);
+    ADVANCE_PC(1);
+}
+
+void SR(Add)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    push(pcpu, tmp1 + tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(Sub)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    push(pcpu, tmp1 - tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(Mod)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    if (tmp2 == 0) {
+        pcpu->state = Cpu_Break;
+        exit_generated_code();
+    }
+    push(pcpu, tmp1 % tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(Mul)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    push(pcpu, tmp1 * tmp2);
+    ADVANCE_PC(1);
+}
+
+/* Generated code draws the value itself and passes it in */
+void SR(Rand)(uint32_t value) {
+    push(pcpu, value);
+    ADVANCE_PC(1);
+}
+
+void SR(Dec)() {
+    uint32_t tmp1 = pop(pcpu);
+    push(pcpu, tmp1-1);
+    ADVANCE_PC(1);
+}
+
+void SR(Drop)() {
+    (void)pop(pcpu);
+    ADVANCE_PC(1);
+}
+
+void SR(Je)(int32_t immediate) {
+    uint32_t tmp1 = pop(pcpu);
+    if (tmp1 == 0)
+        pcpu->pc += immediate;
+    ADVANCE_PC(2);
+    if (tmp1 == 0) /* Non-sequential PC change */
+        exit_generated_code();
+}
+
+void SR(Jne)(int32_t immediate) {
+    uint32_t tmp1 = pop(pcpu);
+    if (tmp1 != 0)
+        pcpu->pc += immediate;
+    ADVANCE_PC(2);
+    if (tmp1 != 0) /* Non-sequential PC change */
+        exit_generated_code();
+}
+
+void SR(Jump)(int32_t immediate) {
+    pcpu->pc += immediate;
+    ADVANCE_PC(2);
+    /* Non-sequential PC change */
+    exit_generated_code();
+}
+
+void SR(And)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    push(pcpu, tmp1 & tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(Or)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    push(pcpu, tmp1 | tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(Xor)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    push(pcpu, tmp1 ^ tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(SHL)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    push(pcpu, tmp1 << tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(SHR)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    push(pcpu, tmp1 >> tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(Rot)() {
+    uint32_t tmp1 = pop(pcpu);
+    uint32_t tmp2 = pop(pcpu);
+    uint32_t tmp3 = pop(pcpu);
+    push(pcpu, tmp1);
+    push(pcpu, tmp3);
+    push(pcpu, tmp2);
+    ADVANCE_PC(1);
+}
+
+void SR(SQRT)() {
+    uint32_t tmp1 = pop(pcpu);
+    push(pcpu, sqrt(tmp1));
+    ADVANCE_PC(1);
+}
+
+void SR(Pick)() {
+    uint32_t tmp1 = pop(pcpu);
+    push(pcpu, pick(pcpu, tmp1));
+    ADVANCE_PC(1);
+}
+
+void SR(Break)() {
+    pcpu->state = Cpu_Break;
+    ADVANCE_PC(1);
+    exit_generated_code();
+}
+
+const service_routine_t ROUTINES[] = {
+        &SR(Break), &SR(Nop), &SR(Halt), &SR(Push), &SR(Print),
+        &SR(Jne), &SR(Swap), &SR(Dup), &SR(Je), &SR(Inc),
+        &SR(Add), &SR(Sub), &SR(Mul), &SR(Rand), &SR(Dec),
+        &SR(Drop), &SR(Over), &SR(Mod), &SR(Jump),
+        &SR(And), &SR(Or), &SR(Xor),
+        &SR(SHL), &SR(SHR),
+        &SR(SQRT),
+        &SR(Rot),
+        &SR(Pick)
+    };
+
+#undef LOOP_COUNTED
+#undef SR
+#undef ROUTINES
@@ -1,464 +1,966 @@
-/*  translated.c - a binary translation sample engine
-    for a stack virtual machine.
-    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
-
-Redistribution and use in source and binary forms, with or without
-modification, are permitted provided that the following conditions are met:
-
-* Redistributions of source code must retain the above copyright notice, this
-  list of conditions and the following disclaimer.
-
-* Redistributions in binary form must reproduce the above copyright notice,
-  this list of conditions and the following disclaimer in the documentation
-  and/or other materials provided with the distribution.
-
-* Neither the name of interpreters-comparison nor the names of its
-  contributors may be used to endorse or promote products derived from
-  this software without specific prior written permission.
-
-THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
-AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
-IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
-DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
-FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
-DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
-SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
-CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
-OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
-OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
-
-#ifndef __x86_64__
-/* The program generates machine code, only specific platforms are supported */
-#error This program is designed to compile only on Intel64/AMD64 platform.
-#error Sorry.
-#endif
-
-#include <stdio.h>
-#include <stdint.h>
-#include <stdbool.h>
-#include <assert.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <limits.h>
-#include <string.h>
-#include <sys/mman.h>
-#include <setjmp.h>
-#include <math.h>
-
-#include "common.h"
-
-/* setjmp/longjmp context buffer to be reachable from within generated code */
-static jmp_buf return_buf;
-
-/* Global pointer to be accessible from generated code.
-   Uses GNU extension to statically occupy host R15 register. */
-register cpu_t * pcpu asm("r15");
-
-/* Area for generated code. It is put into the .text section to be reachable
-   from the rest of the code (relative branch to fit in 32 bits) */
-/* For explanation of '#' character,
-   see https://gcc.gnu.org/ml/gcc-help/2010-09/msg00088.html */
-char gen_code[JIT_CODE_SIZE] __attribute__ ((section (".text#")))
-                             __attribute__ ((aligned(4096)));
-
-/* TODO:a global - not good. Should be moved into cpu state or somewhere else */
-static uint64_t steplimit = LLONG_MAX;
-
-static inline decode_t decode_at_address(const Instr_t* prog, uint32_t addr) {
-    assert(addr < PROGRAM_SIZE);
-    decode_t result = {0};
-    Instr_t raw_instr = prog[addr];
-    result.opcode = raw_instr;
-    switch (raw_instr) {
-    case Instr_Nop:
-    case Instr_Halt:
-    case Instr_Print:
-    case Instr_Swap:
-    case Instr_Dup:
-    case Instr_Inc:
-    case Instr_Add:
-    case Instr_Sub:
-    case Instr_Mul:
-    case Instr_Rand:
-    case Instr_Dec:
-    case Instr_Drop:
-    case Instr_Over:
-    case Instr_Mod:
-    case Instr_And:
-    case Instr_Or:
-    case Instr_Xor:
-    case Instr_SHL:
-    case Instr_SHR:
-    case Instr_Rot:
-    case Instr_SQRT:
-    case Instr_Pick:
-        result.length = 1;
-        break;
-    case Instr_Push:
-    case Instr_JNE:
-    case Instr_JE:
-    case Instr_Jump:
-        result.length = 2;
-        assert(addr+1 < PROGRAM_SIZE);
-        result.immediate = (int32_t)prog[addr+1];
-        break;
-    case Instr_Break:
-    default: /* Undefined instructions equal to Break */
-        result.length = 1;
-        result.opcode = Instr_Break;
-        break;
-    }
-    return result;
-}
-
-static void enter_generated_code(void* addr) {
-    __asm__ __volatile__ ( "jmp *%0"::"r"(addr):);
-}
-
-static void exit_generated_code() {
-    longjmp(return_buf, 1);
-}
-
-/*** Service routines ***/
-
-#define ADVANCE_PC(length) do {\
-    pcpu->pc += length;\
-    pcpu->steps++; \
-    if (pcpu->state != Cpu_Running || pcpu->steps >= steplimit) \
-        exit_generated_code(); \
-} while(0);
-
-static inline void push(cpu_t *pcpu, uint32_t v) {
-    assert(pcpu);
-    if (pcpu->sp >= STACK_CAPACITY-1) {
-        printf("Stack overflow\n");
-        pcpu->state = Cpu_Break;
-        exit_generated_code();
-    }
-    pcpu->stack[++pcpu->sp] = v;
-}
-
-static inline uint32_t pop(cpu_t *pcpu) {
-    assert(pcpu);
-    if (pcpu->sp < 0) {
-        printf("Stack underflow\n");
-        pcpu->state = Cpu_Break;
-        exit_generated_code();
-    }
-    return pcpu->stack[pcpu->sp--];
-}
-
-static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
-    assert(pcpu);
-    if (pcpu->sp - 1 < pos) {
-        printf("Out of bound picking\n");
-        pcpu->state = Cpu_Break;
-        return 0;
-    }
-    return pcpu->stack[pcpu->sp - pos];
-}
-
-typedef void (*service_routine_t)();
-
-void sr_Nop() {
-    /* Do nothing */
-    ADVANCE_PC(1);
-}
-
-void sr_Halt() {
-    pcpu->state = Cpu_Halted;
-    ADVANCE_PC(1);
-    exit_generated_code();
-}
-
-void sr_Push(int32_t immediate) {
-    push(pcpu, immediate);
-    ADVANCE_PC(2);
-}
-
-void sr_Print() {
-    uint32_t tmp1 = pop(pcpu);
-    printf("[%d]\n", tmp1);
-    ADVANCE_PC(1);
-}
-
-void sr_Swap() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_Dup() {
-    uint32_t tmp1 = pop(pcpu);
-    push(pcpu, tmp1);
-    push(pcpu, tmp1);
-    ADVANCE_PC(1);
-}
-
-void sr_Over() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp2);
-    push(pcpu, tmp1);
-    push(pcpu, tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_Inc() {
-    uint32_t tmp1 = pop(pcpu);
-    push(pcpu, tmp1+1);
-    ADVANCE_PC(1);
-}
-
-void sr_Add() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 + tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_Sub() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 - tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_Mod() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    if (tmp2 == 0) {
-        pcpu->state = Cpu_Break;
-        exit_generated_code();
-    }
-    push(pcpu, tmp1 % tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_Mul() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 * tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_Rand() {
-    uint32_t tmp1 = rand();
-    push(pcpu, tmp1);
-    ADVANCE_PC(1);
-}
-
-void sr_Dec() {
-    uint32_t tmp1 = pop(pcpu);
-    push(pcpu, tmp1-1);
-    ADVANCE_PC(1);
-}
-
-void sr_Drop() {
-    (void)pop(pcpu);
-    ADVANCE_PC(1);
-}
-
-void sr_Je(int32_t immediate) {
-    uint32_t tmp1 = pop(pcpu);
-    if (tmp1 == 0)
-        pcpu->pc += immediate;
-    ADVANCE_PC(2);
-    if (tmp1 == 0) /* Non-sequential PC change */
-        exit_generated_code();
-}
-
-void sr_Jne(int32_t immediate) {
-    uint32_t tmp1 = pop(pcpu);
-    if (tmp1 != 0)
-        pcpu->pc += immediate;
-    ADVANCE_PC(2);
-    if (tmp1 != 0) /* Non-sequential PC change */
-        exit_generated_code();
-}
-
-void sr_Jump(int32_t immediate) {
-    pcpu->pc += immediate;
-    ADVANCE_PC(2);
-    /* Non-sequential PC change */
-    exit_generated_code();
-}
-
-void sr_And() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 & tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_Or() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 | tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_Xor() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 ^ tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_SHL() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 << tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_SHR() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    push(pcpu, tmp1 >> tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_Rot() {
-    uint32_t tmp1 = pop(pcpu);
-    uint32_t tmp2 = pop(pcpu);
-    uint32_t tmp3 = pop(pcpu);
-    push(pcpu, tmp1);
-    push(pcpu, tmp3);
-    push(pcpu, tmp2);
-    ADVANCE_PC(1);
-}
-
-void sr_SQRT() {
-    uint32_t tmp1 = pop(pcpu);
-    push(pcpu, sqrt(tmp1));
-    ADVANCE_PC(1);
-}
-
-void sr_Pick() {
-    uint32_t tmp1 = pop(pcpu);
-    push(pcpu, pick(pcpu, tmp1));
-    ADVANCE_PC(1);
-}
-
-void sr_Break() {
-    pcpu->state = Cpu_Break;
-    ADVANCE_PC(1);
-    exit_generated_code();
-}
-
-const service_routine_t service_routines[] = {
-        &sr_Break, &sr_Nop, &sr_Halt, &sr_Push, &sr_Print,
-        &sr_Jne, &sr_Swap, &sr_Dup, &sr_Je, &sr_Inc,
-        &sr_Add, &sr_Sub, &sr_Mul, &sr_Rand, &sr_Dec,
-        &sr_Drop, &sr_Over, &sr_Mod, &sr_Jump,
-        &sr_And, &sr_Or, &sr_Xor,
-        &sr_SHL, &sr_SHR,
-        &sr_SQRT,
-        &sr_Rot,
-        &sr_Pick
-    };
-
-static void translate_program(const Instr_t *prog,
-                           char *out_code, void **entrypoints, int len) {
-    assert(prog);
-    assert(out_code);
-    assert(entrypoints);
-
-    /* An IA-32 instruction "MOV RDI, imm32" is used to pass a parameter
-       to a function invoked by a following CALL. */
-#ifdef __CYGWIN__ /* Win64 ABI, use RCX instead of RDI */
-    const char mov_template_code[]= {0x48, 0xc7, 0xc1, 0x00, 0x00, 0x00, 0x00};
-#else
-    const char mov_template_code[]= {0x48, 0xc7, 0xc7, 0x00, 0x00, 0x00, 0x00};
-#endif
-    const int mov_template_size = sizeof(mov_template_code);
-
-    /* An IA-32 instruction "CALL rel32" is used as a trampoline to invoke
-       service routines. A template for it is "call .+0x00000005" */
-    const char call_template_code[] = { 0xe8, 0x00, 0x00, 0x00, 0x00 };
-    const int call_template_size = sizeof(call_template_code);
-
-    int i = 0; /* Address of current guest instruction */
-    char* cur = out_code; /* Where to put new code */
-
-    /* The program is short, so we can translate it as a whole.
-       Otherwise, some sort of lazy decoding will be required */
-    while (i < len) {
-        decode_t decoded = decode_at_address(prog, i);
-        entrypoints[i] = (void*) cur;
-
-        if (decoded.length == 2) { /* Guest instruction has an immediate */
-            assert(cur + mov_template_size - out_code < JIT_CODE_SIZE);
-            memcpy(cur, mov_template_code, mov_template_size);
-            /* Patch template with correct immediate value */
-            memcpy(cur + 3, &decoded.immediate, 4);
-            cur += mov_template_size;
-        }
-
-        assert(cur + call_template_size - out_code < JIT_CODE_SIZE);
-        memcpy(cur, call_template_code, call_template_size);
-        intptr_t offset = (intptr_t)service_routines[decoded.opcode]
-                            - (intptr_t)cur - call_template_size;
-        if (offset != (intptr_t)(int32_t)offset) {
-            fprintf(stderr, "Offset to service routine for opcode %d"
-            " does not fit in 32 bits. Cannot generate code for it, sorry",
-            decoded.opcode);
-            exit(2);
-        }
-        uint32_t offset32 = (uint32_t)offset;
-        /* Patch template with correct offset */
-        memcpy(cur + 1, &offset, 4);
-        i += decoded.length;
-        cur += call_template_size;
-    }
-}
-
-int main(int argc, char **argv) {
-    steplimit = parse_args(argc, argv);
-    cpu_t cpu = init_cpu();
-
-    pcpu = &cpu;
-
-    /* Code section is protected from writes by default, un-protect it */
-    if (mprotect(gen_code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC)) {
-        perror("mprotect");
-        exit(2);
-    }
-    /* Pre-populate resulting code buffer with INT3 (machine code 0xCC).
-       This will help to catch jumps to wrong locations */
-    memset(gen_code, 0xcc, JIT_CODE_SIZE);
-    void* entrypoints[PROGRAM_SIZE] = {0}; /* a map of guest PCs to capsules */
-
-    translate_program(cpu.pmem, gen_code, entrypoints, PROGRAM_SIZE);
-
-    setjmp(return_buf); /* Will get here from generated code. */
-
-    while (cpu.state == Cpu_Running && cpu.steps < steplimit) {
-        if (cpu.pc > PROGRAM_SIZE) {
-            cpu.state = Cpu_Break;
-            break;
-        }
-        enter_generated_code(entrypoints[cpu.pc]); /* Will not return */
-    }
-
-    assert(cpu.state != Cpu_Running || cpu.steps == steplimit);
-    /* Print CPU state */
-    printf("CPU executed %ld steps. End state \"%s\".\n",
-            cpu.steps, cpu.state == Cpu_Halted? "Halted":
-                       cpu.state == Cpu_Running? "Running": "Break");
-    printf("PC = %#x, SP = %d\n", cpu.pc, cpu.sp);
-    printf("Stack: ");
-    for (int32_t i=cpu.sp; i >= 0 ; i--) {
-        printf("%#10x ", cpu.stack[i]);
-    }
-    printf("%s\n", cpu.sp == -1? "(empty)": "");
-
-    free(LoadedProgram);
-
-    return cpu.state == Cpu_Halted ||
-           (cpu.state == Cpu_Running &&
-            cpu.steps == steplimit)?0:1;
-}
+/*  translated.c - a binary translation sample engine
+    for a stack virtual machine.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef __x86_64__
+/* The program generates machine code, only specific platforms are supported */
+#error This program is designed to compile only on Intel64/AMD64 platform.
+#error Sorry.
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <setjmp.h>
+#include <math.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "common.h"
+#include "checkpoint.h"
+#include "container.h"
+#include "output.h"
+#include "codearena.h"
+#include "sharedcode.h"
+#include "vm.h"
+
+/* Global pointer to be accessible from generated code.
+   Uses GNU extension to statically occupy host R15 register.
+   Points to the cpu of the machine inside vm_run(). */
+register cpu_t * pcpu asm("r15");
+
+static inline decode_t decode_at_address(const Instr_t* prog,
+                                         uint32_t len, uint32_t addr) {
+    assert(addr < len);
+    decode_t result = {0};
+    Instr_t raw_instr = prog[addr];
+    result.opcode = raw_instr;
+    switch (raw_instr) {
+    case Instr_Nop:
+    case Instr_Halt:
+    case Instr_Print:
+    case Instr_Swap:
+    case Instr_Dup:
+    case Instr_Inc:
+    case Instr_Add:
+    case Instr_Sub:
+    case Instr_Mul:
+    case Instr_Rand:
+    case Instr_Dec:
+    case Instr_Drop:
+    case Instr_Over:
+    case Instr_Mod:
+    case Instr_And:
+    case Instr_Or:
+    case Instr_Xor:
+    case Instr_SHL:
+    case Instr_SHR:
+    case Instr_Rot:
+    case Instr_SQRT:
+    case Instr_Pick:
+        result.length = 1;
+        break;
+    case Instr_Push:
+    case Instr_JNE:
+    case Instr_JE:
+    case Instr_Jump:
+        result.length = 2;
+        if (!(addr+1 < len)) {
+            result.length = 1;
+            result.opcode = Instr_Break;
+            break;
+        }
+        result.immediate = (int32_t)prog[addr+1];
+        break;
+    case Instr_Break:
+    default: /* Undefined instructions equal to Break */
+        result.length = 1;
+        result.opcode = Instr_Break;
+        break;
+    }
+    return result;
+}
+
+static void enter_generated_code(void* addr) {
+    __asm__ __volatile__ ( "jmp *%0"::"r"(addr):);
+}
+
+static void exit_generated_code();
+
+/*** Service routines ***/
+
+#define ADVANCE_PC(length) do {\
+    pcpu->pc += length;\
+    if (LOOP_COUNTED) \
+        pcpu->steps++; \
+    if (pcpu->state != Cpu_Running \
+        || (LOOP_COUNTED && pcpu->steps >= pcpu->steplimit)) \
+        exit_generated_code(); \
+} while(0);
+
+static inline void push(cpu_t *pcpu, uint32_t v) {
+    assert(pcpu);
+    STACK_BARRIER();
+#ifndef STACK_GUARD
+    if (pcpu->sp >= pcpu->stack_capacity-1 && !grow_stack(pcpu)) {
+        print_message("Stack overflow\n");
+        pcpu->state = Cpu_Break;
+        exit_generated_code();
+    }
+#endif
+    pcpu->stack[++pcpu->sp] = v;
+}
+
+static inline uint32_t pop(cpu_t *pcpu) {
+    assert(pcpu);
+    if (pcpu->sp < 0) {
+        print_message("Stack underflow\n");
+        pcpu->state = Cpu_Break;
+        exit_generated_code();
+    }
+    return pcpu->stack[pcpu->sp--];
+}
+
+static inline uint32_t pick(cpu_t *pcpu, int32_t pos) {
+    assert(pcpu);
+    if (pcpu->sp - 1 < pos) {
+        print_message("Out of bound picking\n");
+        pcpu->state = Cpu_Break;
+        return 0;
+    }
+    return pcpu->stack[pcpu->sp - pos];
+}
+
+typedef void (*service_routine_t)();
+
+/* Not a guest instruction: terminates a block which does not end with
+   an unconditional control transfer */
+void sr_Leave() {
+    exit_generated_code();
+}
+
+/* Code translated for runs that count steps calls the first routines,
+   code for runs that do not the second. The latter leave generated code
+   on taken branches and block ends only, where the dispatcher checks for
+   preemption */
+#define LOOP_COUNTED 1
+#define SR(name) sr_##name##_counted
+#define ROUTINES counted_routines
+#include "translated-routines.h"
+
+#define LOOP_COUNTED 0
+#define SR(name) sr_##name
+#define ROUTINES service_routines
+#include "translated-routines.h"
+
+/* Guest code is translated lazily, one block at a time. A block ends after
+   an unconditional control transfer or after this many guest instructions */
+#define MAX_BLOCK_LENGTH 64
+
+/* Host bytes for one guest instruction: "MOV RDI, imm32" + "CALL rel32" */
+#define CAPSULE_MAX_SIZE (7 + 5)
+
+/* Rand advances the generator inline, then calls sr_Rand */
+#define RAND_CAPSULE_SIZE (66 + 5)
+
+/* Host bytes for the block terminating "CALL sr_Leave" */
+#define LEAVE_CAPSULE_SIZE 5
+
+#define MAX_BLOCK_SIZE (MAX_BLOCK_LENGTH * CAPSULE_MAX_SIZE + LEAVE_CAPSULE_SIZE)
+
+/* Under the generational policy, blocks entered at least this many times
+   are retranslated into the old generation instead of being evicted */
+#define HOT_BLOCK_THRESHOLD 16
+
+/* With --jit-thread, machines do not translate code themselves. A PC
+   dispatched to this many times is queued for a compiler thread, and
+   instructions are interpreted until their block is published */
+#define QUEUE_THRESHOLD 16
+
+/* Queued PCs a machine watches for its first entry into generated code */
+#define MAX_PENDING 64
+
+typedef struct {
+    uint32_t start; /* Guest PC of the first instruction */
+    uint32_t end;   /* Guest PC past the last instruction */
+} block_t;
+
+/* A group of blocks sharing one code arena and evicted together */
+typedef struct {
+    code_arena_t arena;
+    size_t budget;  /* Bytes of code allowed in this generation */
+    size_t size;    /* Bytes of code currently in it */
+    block_t *blocks;
+    int nblocks;
+    int capacity;
+} generation_t;
+
+typedef struct {
+    void **entrypoints;     /* a map of guest PCs to capsules, NULL if the
+                               PC is not translated */
+    uint32_t *entry_counts; /* How many times a guest PC was dispatched to,
+                               counted for the generational policy only */
+    uint32_t len;           /* Number of guest PCs */
+    const service_routine_t *routines; /* Called by the code */
+    generation_t young;
+    generation_t old;       /* Used only by the generational policy */
+    generation_t *parts;    /* Translated up front, never evicted */
+    int nparts;
+    pthread_mutex_t lock;   /* Held while translating */
+    /* Background translation, see QUEUE_THRESHOLD. Every PC is queued at
+       most once, so the queue has a slot for each and never wraps */
+    bool background;
+    const Instr_t *program;
+    uint32_t *queue;        /* PC + 1 of every queued PC in the order they
+                               got hot, 0 while its slot is being written */
+    uint32_t queue_tail;    /* Next free slot, taken by atomic increment */
+    uint32_t queue_head;    /* Next slot for the compiler thread */
+    uint64_t *queued_ns;    /* When a PC was queued */
+    sem_t queued;           /* Posted once for every queued PC */
+    pthread_t compiler;
+    int stop;
+    /* Statistics */
+    uint64_t evictions;
+    uint64_t flushes;
+    uint64_t promotions;
+    uint64_t ahead;         /* Hot PCs of a container translated before
+                               the first run */
+    uint64_t compiled;      /* Blocks translated by the compiler thread */
+    uint64_t compile_ns;    /* Time it spent on them */
+} code_cache_t;
+
+/* Generated code does not depend on the machine it runs for, so machines
+   running programs with the same contents and the same cache settings share
+   one cache. A block is published once translated and never changes until
+   evicted. Caches of limited size evict blocks that other machines may be
+   running, so they are only shared by machines of one thread. */
+typedef struct {
+    uint64_t budget;
+    jit_evict_t policy;
+    const void *owner; /* Thread that uses the cache, NULL for any */
+    int background;    /* Translated by a compiler thread */
+    uint32_t threads;  /* Translated up front on this many, if not zero */
+    int counted;       /* Code counts steps */
+} cache_params_t;
+
+static _Thread_local char thread_tag;
+
+struct vm {
+    cpu_t cpu; /* Must go first, generated code only knows pcpu */
+    /* setjmp/longjmp context buffer to be reachable from within
+       generated code */
+    jmp_buf return_buf;
+    /* Code for runs not counting steps and counting, the cache is built
+       by the first run of either kind */
+    shared_code_t *shared[2];
+    code_cache_t *cache[2];
+    const Instr_t *program;
+    int jit_stats;
+    volatile sig_atomic_t preempted;
+    /* Statistics */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t translate_ns;  /* Spent translating on this machine's thread */
+    uint64_t interpreted;   /* Instructions run without generated code */
+    uint32_t pending[MAX_PENDING]; /* PCs queued by this machine and not
+                                      entered natively yet */
+    int npending;
+    uint64_t native_entries; /* Of queued PCs, and time to them */
+    uint64_t latency_ns;
+    uint64_t max_latency_ns;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void exit_generated_code() {
+    longjmp(((vm_t *)pcpu)->return_buf, 1);
+}
+
+
+static void init_generation(generation_t *gen, size_t budget) {
+    const size_t arena_capacity = CODE_ARENA_RESERVE
+                                  - CODE_ARENA_MAX_STUBS * CODE_ARENA_STUB_SIZE;
+    gen->budget = budget < arena_capacity ? budget : arena_capacity;
+    gen->size = 0;
+    gen->nblocks = 0;
+    gen->capacity = 0;
+    gen->blocks = NULL;
+    /* Generated code is written through a separate non-executable view, and
+       pages are populated in advance to avoid page faults on first run */
+    code_arena_init(&gen->arena, JIT_CODE_SIZE,
+                    Arena_DualMap | Arena_Populate | Arena_Prefault);
+}
+
+static void destroy_generation(generation_t *gen) {
+    code_arena_destroy(&gen->arena);
+    free(gen->blocks);
+}
+
+static void init_code_cache(code_cache_t *cache, uint32_t len,
+                            uint64_t budget, jit_evict_t policy) {
+    cache->len = len;
+    cache->entrypoints = calloc(len, sizeof(void *));
+    cache->entry_counts = calloc(len, sizeof(uint32_t));
+    if (!cache->entrypoints || !cache->entry_counts) {
+        fprintf(stderr, "Failed to allocate memory for code cache->\n");
+        exit(2);
+    }
+    if (budget == 0)
+        budget = SIZE_MAX;
+    if (budget < 2 * MAX_BLOCK_SIZE) {
+        fprintf(stderr, "Code cache size should be at least %d bytes.\n",
+                2 * MAX_BLOCK_SIZE);
+        exit(2);
+    }
+    if (policy == Jit_Evict_Generational) {
+        init_generation(&cache->young, budget / 2);
+        init_generation(&cache->old, budget - budget / 2);
+    } else {
+        init_generation(&cache->young, budget);
+        cache->old.budget = 0;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->parts = NULL;
+    cache->nparts = 0;
+    cache->background = false;
+    cache->evictions = cache->flushes = cache->promotions = 0;
+    cache->ahead = cache->compiled = cache->compile_ns = 0;
+}
+
+static void destroy_code_cache(code_cache_t *cache) {
+    if (cache->background) {
+        /* PCs still in the queue are dropped */
+        __atomic_store_n(&cache->stop, 1, __ATOMIC_RELEASE);
+        sem_post(&cache->queued);
+        pthread_join(cache->compiler, NULL);
+        sem_destroy(&cache->queued);
+        free(cache->queue);
+        free(cache->queued_ns);
+    }
+    destroy_generation(&cache->young);
+    if (cache->old.budget)
+        destroy_generation(&cache->old);
+    for (int p = 0; p < cache->nparts; p++)
+        destroy_generation(&cache->parts[p]);
+    free(cache->parts);
+    free(cache->entrypoints);
+    free(cache->entry_counts);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/* Hits and misses are those of one machine */
+static void report_code_cache(const code_cache_t *cache, const vm_t *vm) {
+    fprintf(stderr, "Code cache: %lu hits, %lu misses, %lu blocks evicted "
+            "in %lu flushes, %lu blocks promoted, %zu+%zu bytes in use\n",
+            vm->hits, vm->misses, cache->evictions, cache->flushes,
+            cache->promotions, cache->young.size, cache->old.size);
+    if (cache->nparts) {
+        size_t size = 0;
+        for (int p = 0; p < cache->nparts; p++)
+            size += cache->parts[p].size;
+        fprintf(stderr, "Translated up front: %d parts, %zu bytes\n",
+                cache->nparts, size);
+    }
+    if (cache->ahead)
+        fprintf(stderr, "Hot PCs of the container: %lu translated before "
+                "the run\n", cache->ahead);
+    if (!cache->background) {
+        fprintf(stderr, "Translation: %.1f us on the running thread\n",
+                vm->translate_ns / 1e3);
+        return;
+    }
+    fprintf(stderr, "Translation: %lu blocks in %.1f us on the compiler "
+            "thread, %lu instructions interpreted meanwhile\n",
+            __atomic_load_n(&cache->compiled, __ATOMIC_RELAXED),
+            __atomic_load_n(&cache->compile_ns, __ATOMIC_RELAXED) / 1e3,
+            vm->interpreted);
+    fprintf(stderr, "First native entry: %lu queued PCs, %.1f us mean, "
+            "%.1f us max after queueing\n", vm->native_entries,
+            vm->native_entries ? vm->latency_ns / 1e3 / vm->native_entries
+                               : 0.0,
+            vm->max_latency_ns / 1e3);
+}
+
+/* Find where a block starting at a guest PC should end, no further than
+   at limit */
+static uint32_t block_extent(const code_cache_t *cache, const Instr_t *prog,
+                             uint32_t start, uint32_t limit) {
+    uint32_t i = start;
+    size_t size = LEAVE_CAPSULE_SIZE;
+    for (int n = 0; n < MAX_BLOCK_LENGTH && i < limit; n++) {
+        if (i != start && cache->entrypoints[i]) /* Already translated */
+            break;
+        decode_t decoded = decode_at_address(prog, cache->len, i);
+        size += decoded.opcode == Instr_Rand ? RAND_CAPSULE_SIZE
+                                             : CAPSULE_MAX_SIZE;
+        if (size > MAX_BLOCK_SIZE)
+            break;
+        i += decoded.length;
+        if (decoded.opcode == Instr_Jump || decoded.opcode == Instr_Halt
+            || decoded.opcode == Instr_Break)
+            break;
+    }
+    return i;
+}
+
+/* Translate guest instructions [start, end) into a generation and
+   return the capsule of the first one */
+static void* translate_block(code_cache_t *cache, generation_t *gen,
+                             const Instr_t *prog, uint32_t start, uint32_t end) {
+    assert(prog);
+    assert(gen);
+
+    /* An IA-32 instruction "MOV RDI, imm32" is used to pass a parameter
+       to a function invoked by a following CALL. */
+#ifdef __CYGWIN__ /* Win64 ABI, use RCX instead of RDI */
+    const char mov_template_code[]= {0x48, 0xc7, 0xc1, 0x00, 0x00, 0x00, 0x00};
+#else
+    const char mov_template_code[]= {0x48, 0xc7, 0xc7, 0x00, 0x00, 0x00, 0x00};
+#endif
+    const int mov_template_size = sizeof(mov_template_code);
+
+    /* An IA-32 instruction "CALL rel32" is used as a trampoline to invoke
+       service routines. A template for it is "call .+0x00000005" */
+    const char call_template_code[] = { 0xe8, 0x00, 0x00, 0x00, 0x00 };
+    const int call_template_size = sizeof(call_template_code);
+
+    /* One step of next_random() on pcpu->random, leaving the value in
+       the parameter register for sr_Rand */
+    const char rand_template_code[] = {
+        0x49, 0x8b, 0x87, 0x00, 0x00, 0x00, 0x00, /* mov rax, [r15+state] */
+        0x48, 0x89, 0xc1,                         /* mov rcx, rax */
+        0x48, 0xba, 0, 0, 0, 0, 0, 0, 0, 0,       /* mov rdx, multiplier */
+        0x48, 0x0f, 0xaf, 0xc2,                   /* imul rax, rdx */
+        0x48, 0xba, 0, 0, 0, 0, 0, 0, 0, 0,       /* mov rdx, increment */
+        0x48, 0x01, 0xd0,                         /* add rax, rdx */
+        0x49, 0x89, 0x87, 0x00, 0x00, 0x00, 0x00, /* mov [r15+state], rax */
+        0x48, 0x89, 0xc8,                         /* mov rax, rcx */
+        0x48, 0xc1, 0xe8, 18,                     /* shr rax, 18 */
+        0x48, 0x31, 0xc8,                         /* xor rax, rcx */
+        0x48, 0xc1, 0xe8, 27,                     /* shr rax, 27 */
+        0x48, 0xc1, 0xe9, 59,                     /* shr rcx, 59 */
+        0xd3, 0xc8,                               /* ror eax, cl */
+#ifdef __CYGWIN__
+        0x89, 0xc1                                /* mov ecx, eax */
+#else
+        0x89, 0xc7                                /* mov edi, eax */
+#endif
+    };
+    const int rand_template_size = sizeof(rand_template_code);
+    const int32_t state_offset = offsetof(cpu_t, random);
+    const uint64_t multiplier = RANDOM_MULTIPLIER;
+    const uint64_t increment = RANDOM_INCREMENT;
+    _Static_assert(sizeof(rand_template_code) + 5 == RAND_CAPSULE_SIZE,
+                   "Rand capsule size");
+
+    code_arena_t *arena = &gen->arena;
+    char* begin = code_arena_reserve(arena, MAX_BLOCK_SIZE);
+    char* cur = begin; /* Where to put new code */
+
+    uint32_t i = start; /* Address of current guest instruction */
+    decode_t decoded = {0};
+    uint32_t offsets[2 * MAX_BLOCK_LENGTH]; /* Of capsules from begin, by
+                                               guest PC from start */
+    while (i < end) {
+        decoded = decode_at_address(prog, cache->len, i);
+        offsets[i - start] = cur - begin;
+
+        if (decoded.length == 2) { /* Guest instruction has an immediate */
+            memcpy(cur, mov_template_code, mov_template_size);
+            /* Patch template with correct immediate value */
+            memcpy(cur + 3, &decoded.immediate, 4);
+            cur += mov_template_size;
+        } else if (decoded.opcode == Instr_Rand) {
+            memcpy(cur, rand_template_code, rand_template_size);
+            memcpy(cur + 3, &state_offset, 4);
+            memcpy(cur + 12, &multiplier, 8);
+            memcpy(cur + 26, &increment, 8);
+            memcpy(cur + 40, &state_offset, 4);
+            cur += rand_template_size;
+        }
+
+        memcpy(cur, call_template_code, call_template_size);
+        const void *target = code_arena_call_target(arena,
+                                 (const void *)cache->routines[decoded.opcode]);
+        intptr_t offset = (intptr_t)target
+                            - (intptr_t)code_arena_rx(arena, cur)
+                            - call_template_size;
+        assert(offset == (intptr_t)(int32_t)offset);
+        int32_t offset32 = (int32_t)offset;
+        /* Patch template with correct offset */
+        memcpy(cur + 1, &offset32, 4);
+        i += decoded.length;
+        cur += call_template_size;
+    }
+
+    if (!(decoded.opcode == Instr_Jump || decoded.opcode == Instr_Halt
+          || decoded.opcode == Instr_Break)) {
+        /* Return to the dispatcher to find the next block */
+        memcpy(cur, call_template_code, call_template_size);
+        const void *target = code_arena_call_target(arena, (const void *)&sr_Leave);
+        int32_t offset32 = (int32_t)((intptr_t)target
+                            - (intptr_t)code_arena_rx(arena, cur)
+                            - call_template_size);
+        memcpy(cur + 1, &offset32, 4);
+        cur += call_template_size;
+    }
+    assert(cur - begin <= MAX_BLOCK_SIZE);
+    code_arena_commit(arena, cur - begin);
+    gen->size += cur - begin;
+
+    /* Machines of other threads may dispatch to the block as soon as it
+       is published, so entry points are set after the code is complete */
+    for (i = start; i < end; i += decode_at_address(prog, cache->len, i).length)
+        __atomic_store_n(&cache->entrypoints[i],
+                         (void *)code_arena_rx(arena, begin + offsets[i - start]),
+                         __ATOMIC_RELEASE);
+
+    if (gen->nblocks == gen->capacity) {
+        gen->capacity = gen->capacity ? 2 * gen->capacity : 64;
+        gen->blocks = realloc(gen->blocks, gen->capacity * sizeof(block_t));
+        if (!gen->blocks) {
+            fprintf(stderr, "Failed to allocate memory for code cache->\n");
+            exit(2);
+        }
+    }
+    gen->blocks[gen->nblocks++] = (block_t){.start = start, .end = end};
+    return code_arena_rx(arena, begin);
+}
+
+/* Drop all code of a generation. Guest PCs covered by it will be translated
+   again on the next dispatch to them. */
+static void evict_generation(code_cache_t *cache, generation_t *gen) {
+    for (int b = 0; b < gen->nblocks; b++) {
+        for (uint32_t i = gen->blocks[b].start; i < gen->blocks[b].end; i++)
+            cache->entrypoints[i] = NULL;
+    }
+    cache->evictions += gen->nblocks;
+    cache->flushes++;
+    gen->nblocks = 0;
+    gen->size = 0;
+    code_arena_reset(&gen->arena);
+}
+
+/* Make room for a new block in the young generation */
+static void make_room(code_cache_t *cache, const Instr_t *prog) {
+    if (!cache->old.budget) { /* Jit_Evict_Flush */
+        evict_generation(cache, &cache->young);
+        return;
+    }
+
+    /* Entry counters are kept across evictions, so a block which is
+       repeatedly evicted and translated again eventually becomes hot */
+    block_t *hot = malloc(cache->young.nblocks * sizeof(block_t));
+    int nhot = 0;
+    for (int b = 0; b < cache->young.nblocks; b++) {
+        const block_t blk = cache->young.blocks[b];
+        uint64_t count = 0;
+        for (uint32_t i = blk.start; i < blk.end; i++)
+            count += cache->entry_counts[i];
+        if (count >= HOT_BLOCK_THRESHOLD)
+            hot[nhot++] = blk;
+    }
+    evict_generation(cache, &cache->young);
+
+    for (int b = 0; b < nhot; b++) {
+        if (cache->old.size + MAX_BLOCK_SIZE > cache->old.budget)
+            evict_generation(cache, &cache->old);
+        translate_block(cache, &cache->old, prog, hot[b].start, hot[b].end);
+        cache->promotions++;
+    }
+    free(hot);
+}
+
+typedef struct {
+    code_cache_t *cache;
+    const Instr_t *program;
+} translate_job_t;
+
+/* Blocks of a part are translated from its beginning on, and its last
+   block may run into the next part by one word. A dispatch to a PC which
+   was not reached that way is translated lazily, as usual. */
+static void translate_part(void *arg, int part, uint32_t begin, uint32_t end) {
+    const translate_job_t *job = arg;
+    generation_t *gen = &job->cache->parts[part];
+    init_generation(gen, SIZE_MAX);
+    for (uint32_t pc = begin; pc < end; ) {
+        const uint32_t stop = block_extent(job->cache, job->program, pc, end);
+        translate_block(job->cache, gen, job->program, pc, stop);
+        pc = stop;
+    }
+}
+
+/* Translate the whole program before it runs, on up to nthreads threads,
+   each into an arena of its own. Control leaves generated code at every
+   taken branch and block end, so blocks of different parts never refer to
+   each other and need no linking. */
+static void translate_program(code_cache_t *cache, const Instr_t *program,
+                              uint32_t nthreads, const program_info_t *info) {
+    uint32_t bounds[MAX_PARTS + 1];
+    const int nparts = partition(cache->len, nthreads, bounds);
+    uint32_t pc = 0; /* Where an instruction starts, decoding from 0 on */
+    for (int p = 1; p < nparts; p++) {
+        if (info && info->nblocks) {
+            /* Move the boundary to the next start of a block the container
+               lists, a PC where an instruction starts for sure */
+            uint32_t lo = 0, hi = info->nblocks;
+            while (lo < hi) {
+                const uint32_t mid = lo + (hi - lo) / 2;
+                if (info->blocks[mid] < bounds[p])
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            if (lo < info->nblocks && info->blocks[lo] < bounds[p + 1])
+                bounds[p] = info->blocks[lo];
+            continue;
+        }
+        /* Move the boundary past the next unconditional control transfer,
+           where a block would end anyway. An immediate may equal the
+           opcode of one, so instructions are decoded in sequence from the
+           start of the program rather than words looked at one by one. */
+        while (pc < bounds[p])
+            pc += decode_at_address(program, cache->len, pc).length;
+        if (pc < bounds[p + 1]) /* At least start on an instruction */
+            bounds[p] = pc;
+        while (pc < bounds[p + 1]) {
+            const decode_t decoded = decode_at_address(program, cache->len, pc);
+            pc += decoded.length;
+            if (decoded.opcode == Instr_Jump || decoded.opcode == Instr_Halt
+                || decoded.opcode == Instr_Break) {
+                if (pc < bounds[p + 1])
+                    bounds[p] = pc;
+                break;
+            }
+        }
+    }
+    cache->parts = calloc(nparts, sizeof(generation_t));
+    if (cache->parts == NULL) {
+        fprintf(stderr, "Failed to allocate memory for code cache.\n");
+        exit(2);
+    }
+    cache->nparts = nparts;
+    translate_job_t job = {.cache = cache, .program = program};
+    run_parts(nparts, bounds, translate_part, &job);
+}
+
+/* Dispatcher slow path: translate a block starting at a guest PC */
+static void* translate_missing(code_cache_t *cache, const Instr_t *prog,
+                               uint32_t pc) {
+    if (cache->young.size + MAX_BLOCK_SIZE > cache->young.budget) {
+        make_room(cache, prog);
+        if (cache->entrypoints[pc]) /* Was promoted */
+            return cache->entrypoints[pc];
+    }
+    return translate_block(cache, &cache->young, prog, pc,
+                           block_extent(cache, prog, pc, cache->len));
+}
+
+/* Translates queued PCs until the cache is destroyed */
+static void *compiler_main(void *arg) {
+    code_cache_t *cache = arg;
+    for (;;) {
+        while (sem_wait(&cache->queued))
+            ; /* EINTR */
+        if (__atomic_load_n(&cache->stop, __ATOMIC_ACQUIRE))
+            break;
+        /* The slot may have been taken but not yet written */
+        uint32_t pc1;
+        while (!(pc1 = __atomic_load_n(&cache->queue[cache->queue_head],
+                                       __ATOMIC_ACQUIRE)))
+            sched_yield();
+        cache->queue_head++;
+
+        const uint64_t start = now_ns();
+        pthread_mutex_lock(&cache->lock);
+        if (!cache->entrypoints[pc1 - 1]) {
+            translate_missing(cache, cache->program, pc1 - 1);
+            __atomic_store_n(&cache->compiled, cache->compiled + 1,
+                             __ATOMIC_RELAXED);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        __atomic_store_n(&cache->compile_ns,
+                         cache->compile_ns + now_ns() - start,
+                         __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static void start_compiler(code_cache_t *cache, const Instr_t *program) {
+    cache->background = true;
+    cache->program = program;
+    cache->queue = calloc(cache->len ? cache->len : 1, sizeof(uint32_t));
+    cache->queued_ns = calloc(cache->len ? cache->len : 1, sizeof(uint64_t));
+    if (!cache->queue || !cache->queued_ns) {
+        fprintf(stderr, "Failed to allocate memory for code cache.\n");
+        exit(2);
+    }
+    cache->queue_tail = cache->queue_head = 0;
+    cache->stop = 0;
+    sem_init(&cache->queued, 0, 0);
+    /* Signals such as the --timeout timer are for the running threads */
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    errno = pthread_create(&cache->compiler, NULL, compiler_main, cache);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (errno) {
+        perror("pthread_create");
+        exit(2);
+    }
+}
+
+/* Count a dispatch to an untranslated PC, queue it once it gets hot */
+static void count_cold_entry(vm_t *vm, code_cache_t *cache, uint32_t pc) {
+    if (__atomic_load_n(&cache->entry_counts[pc], __ATOMIC_RELAXED)
+           >= QUEUE_THRESHOLD
+        || __atomic_add_fetch(&cache->entry_counts[pc], 1, __ATOMIC_RELAXED)
+           != QUEUE_THRESHOLD)
+        return;
+    const uint32_t slot = __atomic_fetch_add(&cache->queue_tail, 1,
+                                             __ATOMIC_RELAXED);
+    cache->queued_ns[pc] = now_ns();
+    __atomic_store_n(&cache->queue[slot], pc + 1, __ATOMIC_RELEASE);
+    sem_post(&cache->queued);
+    if (vm->npending < MAX_PENDING)
+        vm->pending[vm->npending++] = pc;
+}
+
+/* Called on hits while this machine waits for PCs it queued */
+static void note_native_entry(vm_t *vm, const code_cache_t *cache,
+                              uint32_t pc) {
+    for (int i = 0; i < vm->npending; i++) {
+        if (vm->pending[i] != pc)
+            continue;
+        const uint64_t latency = now_ns() - cache->queued_ns[pc];
+        vm->native_entries++;
+        vm->latency_ns += latency;
+        if (latency > vm->max_latency_ns)
+            vm->max_latency_ns = latency;
+        vm->pending[i] = vm->pending[--vm->npending];
+        return;
+    }
+}
+
+/* Run one instruction at pcpu->pc through its service routine, which
+   leaves through exit_generated_code() after a taken branch */
+static void interpret_one(const code_cache_t *cache) {
+    const decode_t decoded = decode_at_address(pcpu->pmem, pcpu->pmem_size,
+                                               pcpu->pc);
+    if (decoded.opcode == Instr_Rand)
+        cache->routines[Instr_Rand](next_random(&pcpu->random));
+    else
+        cache->routines[decoded.opcode](decoded.immediate);
+}
+
+/* Code at PCs a container lists as hot is translated while the cache is
+   built, also with --jit-thread: no machine runs yet, and the compiler
+   thread may not get a CPU before the first ones have waited for it */
+static void translate_hot_pcs(code_cache_t *cache, const Instr_t *program,
+                              const program_info_t *info) {
+    for (uint32_t i = 0; i < info->nhot_pcs; i++) {
+        const uint32_t pc = info->hot_pcs[i];
+        /* Never evict code for a guess */
+        if (cache->young.size + MAX_BLOCK_SIZE > cache->young.budget)
+            break;
+        if (cache->entrypoints[pc])
+            continue;
+        translate_missing(cache, program, pc);
+        cache->ahead++;
+    }
+}
+
+static void *build_code_cache(shared_code_t *sc, void *arg) {
+    const program_info_t *info = arg;
+    const cache_params_t *params = sc->params;
+    code_cache_t *cache = malloc(sizeof(code_cache_t));
+    if (cache == NULL) {
+        fprintf(stderr, "Failed to allocate memory for code cache.\n");
+        exit(2);
+    }
+    init_code_cache(cache, sc->len, params->budget, params->policy);
+    cache->routines = params->counted ? counted_routines : service_routines;
+    if (params->threads)
+        translate_program(cache, sc->program, params->threads, info);
+    else if (info)
+        translate_hot_pcs(cache, sc->program, info);
+    if (params->background)
+        start_compiler(cache, sc->program);
+    return cache;
+}
+
+static void destroy_shared_cache(shared_code_t *sc) {
+    destroy_code_cache(sc->data);
+    free(sc->data);
+}
+
+vm_t *vm_create(const Instr_t *program, uint32_t len, const options_t *opts) {
+    if (opts == NULL)
+        opts = &DefOptions;
+    vm_t *vm = malloc(sizeof(vm_t));
+    if (vm == NULL) {
+        fprintf(stderr, "Failed to allocate memory for virtual machine.\n");
+        exit(2);
+    }
+    cache_params_t params;
+    memset(&params, 0, sizeof(params)); /* Compared bytewise with padding */
+    params.budget = opts->jit_cache_size;
+    params.policy = opts->jit_evict;
+    params.owner = params.budget ? &thread_tag : NULL;
+    /* The compiler thread cannot evict code that machines may be running */
+    if (opts->jit_thread && params.budget) {
+        fprintf(stderr, "--jit-thread needs an unlimited code cache.\n");
+        exit(2);
+    }
+    params.background = opts->jit_thread;
+    /* Code translated up front is never evicted */
+    if (opts->decode_threads && params.budget) {
+        fprintf(stderr, "--decode-threads needs an unlimited code cache.\n");
+        exit(2);
+    }
+    params.threads = opts->decode_threads;
+    for (int counted = 0; counted < 2; counted++) {
+        params.counted = counted;
+        vm->shared[counted] = get_shared_code(program, len, &params,
+                                              sizeof(params));
+        vm->cache[counted] = NULL;
+    }
+    vm->program = program;
+    vm->cpu = init_cpu(vm->shared[0]->program, len, opts);
+    vm->jit_stats = opts->jit_stats;
+    vm->preempted = 0;
+    vm->hits = vm->misses = 0;
+    vm->translate_ns = vm->interpreted = 0;
+    vm->npending = 0;
+    vm->native_entries = vm->latency_ns = vm->max_latency_ns = 0;
+    return vm;
+}
+
+/* Generated code that counts steps checks the limit after every
+   instruction, the dispatcher checks it between blocks */
+void vm_preempt(vm_t *vm) {
+    vm->preempted = 1;
+    vm->cpu.steplimit = 0;
+}
+
+cpu_state_t vm_run(vm_t *vm, uint64_t budget) {
+    const int counted = budget != UNLIMITED_STEPS;
+    if (!vm->cache[counted]) {
+        /* The analysis of a container helps whichever machine builds it */
+        void *info = (void *)program_info(vm->program);
+        vm->cache[counted] = shared_code_data(vm->shared[counted],
+                                              build_code_cache, info);
+    }
+    code_cache_t *const cache = vm->cache[counted];
+    /* Other translation units may keep their own values in R15 */
+    cpu_t *const saved_pcpu = pcpu;
+    pcpu = &vm->cpu;
+    pcpu->steplimit = run_steplimit(pcpu, budget);
+    if (vm->preempted)
+        pcpu->steplimit = pcpu->steps;
+
+    watch_stack(pcpu);
+    STACK_FAULT_CAUGHT(); /* Will get here after a stack fault */
+    setjmp(vm->return_buf); /* Will get here from generated code. */
+
+    while (pcpu->state == Cpu_Running && pcpu->steps < pcpu->steplimit) {
+        if (pcpu->pc >= pcpu->pmem_size) {
+            print_message("PC out of bounds\n");
+            pcpu->state = Cpu_Break;
+            break;
+        }
+        void *entry = __atomic_load_n(&cache->entrypoints[pcpu->pc],
+                                      __ATOMIC_ACQUIRE);
+        if (entry) {
+            vm->hits++;
+            if (vm->npending)
+                note_native_entry(vm, cache, pcpu->pc);
+        } else if (cache->background) {
+            vm->misses++;
+            vm->interpreted++;
+            count_cold_entry(vm, cache, pcpu->pc);
+            interpret_one(cache);
+            continue;
+        } else {
+            vm->misses++;
+            const uint64_t start = now_ns();
+            pthread_mutex_lock(&cache->lock);
+            entry = cache->entrypoints[pcpu->pc]; /* Another thread's? */
+            if (!entry)
+                entry = translate_missing(cache, pcpu->pmem, pcpu->pc);
+            pthread_mutex_unlock(&cache->lock);
+            vm->translate_ns += now_ns() - start;
+        }
+        if (cache->old.budget)
+            cache->entry_counts[pcpu->pc]++;
+        enter_generated_code(entry); /* Will not return */
+    }
+
+    vm->preempted = 0;
+    const cpu_state_t state = pcpu->state;
+    if (state != Cpu_Running)
+        flush_output(); /* All output of a finished guest is out */
+    pcpu = saved_pcpu;
+    return state;
+}
+
+const cpu_t *vm_cpu(const vm_t *vm) {
+    return &vm->cpu;
+}
+
+int vm_restore(vm_t *vm, const cpu_t *state) {
+    return restore_cpu(&vm->cpu, state);
+}
+
+void vm_report(const vm_t *vm) {
+    if (!vm->jit_stats)
+        return;
+    for (int counted = 0; counted < 2; counted++)
+        if (vm->cache[counted])
+            report_code_cache(vm->cache[counted], vm);
+}
+
+void vm_destroy(vm_t *vm) {
+    put_shared_code(vm->shared[0], destroy_shared_cache);
+    put_shared_code(vm->shared[1], destroy_shared_cache);
+    destroy_cpu(&vm->cpu);
+    free(vm);
+}
@@ -0,0 +1,79 @@
+/*  vm.h - embedding interface of interpreters for a stack virtual machine.
+    Copyright (c) 2015, 2016 Grigory Rechistov. All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright notice, this
+  list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright notice,
+  this list of conditions and the following disclaimer in the documentation
+  and/or other materials provided with the distribution.
+
+* Neither the name of interpreters-comparison nor the names of its
+  contributors may be used to endorse or promote products derived from
+  this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include "common.h"
+
+#ifndef VM_H_
+#define VM_H_
+
+/* Every variant implements this interface and is also available as
+   libvm-<variant>.a. All state of a virtual machine lives in its vm_t, so
+   any number of them may exist in one process. predecoded, threaded-cached
+   and translated machines running programs with the same contents share
+   their decoded or translated code, in any thread.
+
+   Different machines may run in different threads. A translated machine
+   with a code cache size limit must be run and destroyed by the thread
+   that created it, as it shares code only with machines of that thread. */
+typedef struct vm vm_t;
+
+/* Create a virtual machine about to execute program of len words from
+   address zero. The program is not copied and must outlive the machine.
+   opts may be NULL for defaults. Exits the process when out of memory,
+   as other setup code does. */
+vm_t *vm_create(const Instr_t *program, uint32_t len, const options_t *opts);
+
+/* Execute at most budget more guest instructions. Returns the state of the
+   CPU afterwards: Cpu_Running means the budget was exhausted or the run was
+   preempted, and another vm_run() continues from there. A budget of
+   UNLIMITED_STEPS runs until the program stops or is preempted, with no
+   step counting in the hot path: steps of the CPU keep their value. */
+cpu_state_t vm_run(vm_t *vm, uint64_t budget);
+
+/* Make a vm_run() in progress return at the next instruction boundary. A
+   run of UNLIMITED_STEPS may go on until the next taken branch or the end
+   of a translated block, as only those can repeat code. Safe to call from
+   a signal handler. */
+void vm_preempt(vm_t *vm);
+
+/* Current CPU state */
+const cpu_t *vm_cpu(const vm_t *vm);
+
+/* Continue from the state of a machine running the same program, such as
+   vm_cpu() of another machine or read_checkpoint() of checkpoint.h: pc,
+   stack, steps, the Instr_Rand generator and end state are copied. Not
+   to be called during vm_run(). Returns zero if the stack does not fit
+   the limit set by the options of this machine. */
+int vm_restore(vm_t *vm, const cpu_t *state);
+
+/* Print variant specific statistics, if there are any */
+void vm_report(const vm_t *vm);
+
+void vm_destroy(vm_t *vm);
+
+#endif /* VM_H_ */